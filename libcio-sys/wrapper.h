@@ -1,2 +1,7 @@
 #include "../src/cio.h"
 #include "../src/cio-stream.h"
+#include "../src/cio-msg.h"
+#include "../src/cio-executor.h"
+#include "../src/cio-co.h"
+#include "../src/cio-buf.h"
+#include "../src/cio-acceptor.h"
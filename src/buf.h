@@ -0,0 +1,28 @@
+#ifndef __BUF_H
+#define __BUF_H
+
+#include "cio-buf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct cio_buf {
+    int refcnt;
+    size_t len;
+    struct cio_bufpool *pool; /* NULL if not pooled */
+    struct cio_buf *next; /* free list of pool */
+    uint8_t data[];
+};
+
+/**
+ * bufpool_get: an empty buf of bufpool_buf_size, refcount starts at 1
+ */
+struct cio_buf *bufpool_get(struct cio_bufpool *pool);
+
+size_t bufpool_buf_size(struct cio_bufpool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,99 @@
+//! Pooled receive buffers, so recv needs neither a fresh allocation nor
+//! zeroing per call.
+
+use std::ops::{Deref, DerefMut};
+use std::sync::{Arc, Mutex};
+
+struct PoolInner {
+    buf_size: usize,
+    max_pooled: usize,
+    free: Mutex<Vec<Vec<u8>>>,
+}
+
+/**
+ * BufferPool
+ */
+
+#[derive(Clone)]
+pub struct BufferPool {
+    inner: Arc<PoolInner>,
+}
+
+impl BufferPool {
+    /// `max_pooled` buffers of `buf_size` capacity are kept for reuse.
+    pub fn new(buf_size: usize, max_pooled: usize) -> BufferPool {
+        BufferPool {
+            inner: Arc::new(PoolInner {
+                buf_size: buf_size,
+                max_pooled: max_pooled,
+                free: Mutex::new(Vec::new()),
+            }),
+        }
+    }
+
+    pub fn buf_size(&self) -> usize {
+        self.inner.buf_size
+    }
+
+    /// An empty buffer with `buf_size` capacity, its memory is not zeroed.
+    pub fn get(&self) -> PooledBuf {
+        let buf = self.inner.free.lock().unwrap().pop()
+            .unwrap_or_else(|| Vec::with_capacity(self.inner.buf_size));
+        PooledBuf { buf: buf, pool: self.inner.clone() }
+    }
+}
+
+/**
+ * PooledBuf
+ */
+
+pub struct PooledBuf {
+    buf: Vec<u8>,
+    pool: Arc<PoolInner>,
+}
+
+impl PooledBuf {
+    /// The uninitialized tail the next recv writes into.
+    pub fn spare_capacity_mut(&mut self) -> &mut [std::mem::MaybeUninit<u8>] {
+        self.buf.spare_capacity_mut()
+    }
+
+    /// Mark `n` more bytes of the spare capacity as initialized.
+    ///
+    /// # Safety
+    /// The first `n` bytes of `spare_capacity_mut()` must be written.
+    pub unsafe fn advance(&mut self, n: usize) {
+        let len = self.buf.len() + n;
+        assert!(len <= self.buf.capacity());
+        self.buf.set_len(len);
+    }
+
+    pub fn clear(&mut self) {
+        self.buf.clear();
+    }
+}
+
+impl Deref for PooledBuf {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        &self.buf
+    }
+}
+
+impl DerefMut for PooledBuf {
+    fn deref_mut(&mut self) -> &mut [u8] {
+        &mut self.buf
+    }
+}
+
+impl Drop for PooledBuf {
+    fn drop(&mut self) {
+        let mut buf = std::mem::take(&mut self.buf);
+        buf.clear();
+        let mut free = self.pool.free.lock().unwrap();
+        if free.len() < self.pool.max_pooled && buf.capacity() >= self.pool.buf_size {
+            free.push(buf);
+        }
+    }
+}
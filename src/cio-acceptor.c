@@ -0,0 +1,156 @@
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "cio.h"
+#include "cio-stream.h"
+#include "cio-acceptor.h"
+
+struct worker {
+    struct cio *ctx;
+    int pending; /* handed over, not taken by the worker yet */
+};
+
+struct cio_acceptor {
+    int refcnt; /* 1 for the owner, 1 for each handoff not taken yet */
+    struct cio_listener *listener;
+    int policy;
+    cio_acceptor_fn fn;
+    void *arg;
+
+    struct worker *workers;
+    int nr_workers;
+    int next; /* ties go round robin */
+};
+
+struct handoff {
+    struct cio_acceptor *acc;
+    struct worker *worker;
+    struct cio_stream *stream;
+};
+
+struct cio_acceptor *cio_acceptor_new(
+    struct cio_listener *listener, struct cio **workers, int nr_workers,
+    int policy, cio_acceptor_fn fn, void *arg)
+{
+    assert(listener && workers && nr_workers > 0 && fn);
+
+    if (cio_listener_set_nonblock(listener, 1) == -1)
+        return NULL;
+
+    struct cio_acceptor *acc = malloc(sizeof(*acc));
+    memset(acc, 0, sizeof(*acc));
+    acc->refcnt = 1;
+    acc->listener = listener;
+    acc->policy = policy;
+    acc->fn = fn;
+    acc->arg = arg;
+    acc->nr_workers = nr_workers;
+    acc->workers = calloc(nr_workers, sizeof(struct worker));
+    for (int i = 0; i < nr_workers; i++)
+        acc->workers[i].ctx = workers[i];
+    return acc;
+}
+
+static void acceptor_unref(struct cio_acceptor *acc)
+{
+    if (__atomic_sub_fetch(&acc->refcnt, 1, __ATOMIC_ACQ_REL))
+        return;
+    free(acc->workers);
+    free(acc);
+}
+
+void cio_acceptor_drop(struct cio_acceptor *acc)
+{
+    acceptor_unref(acc);
+}
+
+/**
+ * fds and event rates are as of the last polls of the workers, streams in
+ * flight are counted too, so a burst of accepts doesn't pile up on one
+ */
+static struct worker *pick_worker(struct cio_acceptor *acc, struct cio_stream *stream)
+{
+    // the cpu the nic queue of the stream interrupts, so its data is cache hot
+    if (acc->policy == CIO_BALANCE_CPU) {
+        int cpu = cio_stream_get_incoming_cpu(stream);
+        for (int i = 0; cpu != -1 && i < acc->nr_workers; i++) {
+            if (cio_get_cpu(acc->workers[i].ctx) == cpu)
+                return &acc->workers[i];
+        }
+    }
+
+    int nr_fds[acc->nr_workers];
+    int rates[acc->nr_workers];
+    long total_fds = 0, total_rate = 0;
+    for (int i = 0; i < acc->nr_workers; i++) {
+        struct worker *w = &acc->workers[i];
+        nr_fds[i] = cio_get_load(w->ctx, &rates[i]) +
+            __atomic_load_n(&w->pending, __ATOMIC_RELAXED);
+        total_fds += nr_fds[i];
+        total_rate += rates[i];
+    }
+
+    // a new stream is assumed as busy as the average one
+    long rate_per_fd = total_fds ? total_rate / total_fds : 0;
+
+    int best = -1;
+    long best_load = 0;
+    for (int k = 0; k < acc->nr_workers; k++) {
+        int i = (acc->next + k) % acc->nr_workers;
+        long load = nr_fds[i];
+        if (acc->policy == CIO_BALANCE_EVENTS) {
+            int pending = __atomic_load_n(&acc->workers[i].pending, __ATOMIC_RELAXED);
+            load = rates[i] + pending * rate_per_fd;
+        }
+        if (best == -1 || load < best_load ||
+            (load == best_load && nr_fds[i] < nr_fds[best])) {
+            best = i;
+            best_load = load;
+        }
+    }
+
+    acc->next = (best + 1) % acc->nr_workers;
+    return &acc->workers[best];
+}
+
+static void handoff_fn(struct cio *ctx, void *arg)
+{
+    struct handoff *h = arg;
+    struct cio_acceptor *acc = h->acc;
+    __atomic_sub_fetch(&h->worker->pending, 1, __ATOMIC_RELAXED);
+    acc->fn(ctx, h->stream, acc->arg);
+    free(h);
+    acceptor_unref(acc);
+}
+
+int cio_acceptor_run(struct cio_acceptor *acc, int max)
+{
+    int nr = 0;
+    while (max == 0 || nr < max) {
+        struct cio_stream *stream = cio_listener_accept(acc->listener);
+        if (stream == NULL)
+            break;
+
+        struct handoff *h = malloc(sizeof(*h));
+        if (h == NULL) {
+            cio_stream_drop(stream);
+            continue;
+        }
+        h->acc = acc;
+        h->worker = pick_worker(acc, stream);
+        h->stream = stream;
+
+        __atomic_add_fetch(&acc->refcnt, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&h->worker->pending, 1, __ATOMIC_RELAXED);
+        if (cio_submit(h->worker->ctx, handoff_fn, h) == -1) {
+            __atomic_sub_fetch(&h->worker->pending, 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&acc->refcnt, 1, __ATOMIC_RELAXED);
+            cio_stream_drop(stream);
+            free(h);
+            continue;
+        }
+        nr++;
+    }
+    return nr;
+}
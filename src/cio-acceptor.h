@@ -0,0 +1,54 @@
+#ifndef __CIO_ACCEPTOR_H
+#define __CIO_ACCEPTOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct cio;
+struct cio_stream;
+struct cio_listener;
+struct cio_acceptor;
+
+enum cio_balance {
+    CIO_BALANCE_FDS = 0, /* fewest fds registered */
+    CIO_BALANCE_EVENTS, /* lowest recent event rate */
+    CIO_BALANCE_CPU, /* the worker pinned on the incoming cpu, else fewest fds */
+};
+
+/**
+ * cio_acceptor_fn: runs on the thread polling ctx, which owns the stream
+ * from now on, e.g. to cio_register it
+ */
+typedef void (*cio_acceptor_fn)(struct cio *ctx, struct cio_stream *stream, void *arg);
+
+/**
+ * cio_acceptor_new: accept on one listener and place each new stream on the
+ * least loaded of the worker ctxs, handed over by cio_submit
+ * @listener: set nonblocking, still owned by the caller
+ * @workers: ctxs polled by worker threads, copied
+ * @policy: cio_balance, see cio_get_load, cio_set_cpu and
+ *          cio_stream_get_incoming_cpu
+ */
+struct cio_acceptor *cio_acceptor_new(
+    struct cio_listener *listener, struct cio **workers, int nr_workers,
+    int policy, cio_acceptor_fn fn, void *arg);
+
+/**
+ * cio_acceptor_drop: streams handed over but not taken yet keep it alive
+ * until their worker polls
+ */
+void cio_acceptor_drop(struct cio_acceptor *acc);
+
+/**
+ * cio_acceptor_run: call it on readable events of the listener, accept up to
+ * max pending connections and dispatch them
+ * @max: 0 for all pending
+ * @return: nr streams dispatched
+ */
+int cio_acceptor_run(struct cio_acceptor *acc, int max);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
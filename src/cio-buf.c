@@ -0,0 +1,148 @@
+#include <pthread.h>
+
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "cio-buf.h"
+#include "buf.h"
+
+struct cio_bufpool {
+    int refcnt; /* 1 for the owner, 1 for each buf out of the pool */
+    size_t buf_size;
+    int max_pooled;
+    int nr_pooled;
+    struct cio_buf *free;
+    pthread_mutex_t lock;
+};
+
+struct cio_buf *cio_buf_new(const void *data, size_t len)
+{
+    struct cio_buf *buf = malloc(sizeof(*buf) + len);
+    if (buf == NULL)
+        return NULL;
+    buf->refcnt = 1;
+    buf->len = len;
+    buf->pool = NULL;
+    buf->next = NULL;
+    memcpy(buf->data, data, len);
+    return buf;
+}
+
+struct cio_buf *cio_buf_ref(struct cio_buf *buf)
+{
+    __atomic_add_fetch(&buf->refcnt, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+static void bufpool_unref(struct cio_bufpool *pool)
+{
+    int refcnt = __atomic_sub_fetch(&pool->refcnt, 1, __ATOMIC_ACQ_REL);
+    assert(refcnt >= 0);
+    if (refcnt)
+        return;
+
+    while (pool->free) {
+        struct cio_buf *buf = pool->free;
+        pool->free = buf->next;
+        free(buf);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+static void bufpool_put(struct cio_bufpool *pool, struct cio_buf *buf)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->nr_pooled < pool->max_pooled) {
+        buf->next = pool->free;
+        pool->free = buf;
+        pool->nr_pooled++;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    free(buf);
+    bufpool_unref(pool);
+}
+
+void cio_buf_unref(struct cio_buf *buf)
+{
+    int refcnt = __atomic_sub_fetch(&buf->refcnt, 1, __ATOMIC_ACQ_REL);
+    assert(refcnt >= 0);
+    if (refcnt)
+        return;
+
+    if (buf->pool)
+        bufpool_put(buf->pool, buf);
+    else
+        free(buf);
+}
+
+const void *cio_buf_data(struct cio_buf *buf)
+{
+    return buf->data;
+}
+
+size_t cio_buf_len(struct cio_buf *buf)
+{
+    return buf->len;
+}
+
+struct cio_bufpool *cio_bufpool_new(size_t buf_size, int max_pooled)
+{
+    assert(buf_size);
+    struct cio_bufpool *pool = malloc(sizeof(*pool));
+    if (pool == NULL)
+        return NULL;
+    pool->refcnt = 1;
+    pool->buf_size = buf_size;
+    pool->max_pooled = max_pooled;
+    pool->nr_pooled = 0;
+    pool->free = NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+void cio_bufpool_drop(struct cio_bufpool *pool)
+{
+    // bufs still out keep the pool alive until they are unref'ed
+    bufpool_unref(pool);
+}
+
+int cio_bufpool_get_pooled(struct cio_bufpool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    int nr = pool->nr_pooled;
+    pthread_mutex_unlock(&pool->lock);
+    return nr;
+}
+
+struct cio_buf *bufpool_get(struct cio_bufpool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    struct cio_buf *buf = pool->free;
+    if (buf) {
+        pool->free = buf->next;
+        pool->nr_pooled--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (buf == NULL) {
+        buf = malloc(sizeof(*buf) + pool->buf_size);
+        if (buf == NULL)
+            return NULL;
+    }
+
+    __atomic_add_fetch(&pool->refcnt, 1, __ATOMIC_RELAXED);
+    buf->refcnt = 1;
+    buf->len = 0;
+    buf->pool = pool;
+    buf->next = NULL;
+    return buf;
+}
+
+size_t bufpool_buf_size(struct cio_bufpool *pool)
+{
+    return pool->buf_size;
+}
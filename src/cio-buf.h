@@ -0,0 +1,65 @@
+#ifndef __CIO_BUF_H
+#define __CIO_BUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct cio_buf;
+struct cio_bufpool;
+
+/**
+ * cio_buf_new: a refcounted immutable buffer holding a copy of data, it can
+ * be queued on many streams without copying, refcount starts at 1
+ */
+struct cio_buf *cio_buf_new(const void *data, size_t len);
+
+/**
+ * cio_buf_ref: thread safe
+ * @return: buf
+ */
+struct cio_buf *cio_buf_ref(struct cio_buf *buf);
+
+/**
+ * cio_buf_unref: thread safe, buf is freed, or returned to its pool, when the
+ * last reference is gone
+ */
+void cio_buf_unref(struct cio_buf *buf);
+
+/**
+ * cio_buf_data
+ */
+const void *cio_buf_data(struct cio_buf *buf);
+
+/**
+ * cio_buf_len
+ */
+size_t cio_buf_len(struct cio_buf *buf);
+
+/**
+ * cio_bufpool_new: a thread safe pool of receive bufs, see
+ * cio_stream_recv_buf; one pool shared by all streams of a ctx makes memory
+ * follow the data in flight instead of the nr of connections
+ * @buf_size: capacity of each buf
+ * @max_pooled: max free bufs kept for reuse, the rest are freed
+ */
+struct cio_bufpool *cio_bufpool_new(size_t buf_size, int max_pooled);
+
+/**
+ * cio_bufpool_drop: the pool is freed once bufs taken from it are unref'ed
+ */
+void cio_bufpool_drop(struct cio_bufpool *pool);
+
+/**
+ * cio_bufpool_get_pooled
+ * @return: nr free bufs kept in the pool
+ */
+int cio_bufpool_get_pooled(struct cio_bufpool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,305 @@
+#if defined __unix__
+
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "cio.h"
+#include "cio-stream.h"
+#include "cio-co.h"
+#include "list.h"
+
+#define CO_STACK_SIZE (64 * 1024)
+
+struct co {
+    ucontext_t uc;
+    void *stack; /* with a guard page at the bottom */
+    cio_co_fn fn;
+    void *arg;
+    int done;
+    uint64_t deadline; /* usec, valid when sleeping */
+    struct list_head ln; /* ready, sleepers or pool */
+};
+
+struct cio_co_sched {
+    struct cio *ctx;
+    size_t stack_size;
+    size_t page_size;
+    ucontext_t main;
+    struct co *current;
+    int nr_live;
+    struct list_head ready;
+    struct list_head sleepers; /* sorted by deadline */
+    struct list_head pool;
+};
+
+static __thread struct cio_co_sched *current_sched;
+
+static uint64_t co_now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 * 1000 + tv.tv_usec;
+}
+
+static void co_entry(void)
+{
+    struct co *co = current_sched->current;
+    co->fn(co->arg);
+    co->done = 1;
+    // returns to uc_link, which is the scheduler
+}
+
+static void co_resume(struct cio_co_sched *sched, struct co *co)
+{
+    struct cio_co_sched *saved = current_sched;
+    current_sched = sched;
+    sched->current = co;
+    swapcontext(&sched->main, &co->uc);
+    sched->current = NULL;
+    current_sched = saved;
+
+    // recycle after switching off its stack
+    if (co->done) {
+        sched->nr_live--;
+        list_add(&co->ln, &sched->pool);
+    }
+}
+
+static void co_park(void)
+{
+    struct cio_co_sched *sched = current_sched;
+    assert(sched && sched->current);
+    swapcontext(&sched->current->uc, &sched->main);
+}
+
+static void co_wait_fd(int fd, int flags)
+{
+    struct cio_co_sched *sched = current_sched;
+    assert(sched && sched->current);
+    cio_register(sched->ctx, fd, CIO_CO_TOKEN, flags, sched->current);
+    co_park();
+}
+
+struct cio_co_sched *cio_co_sched_new(struct cio *ctx, size_t stack_size)
+{
+    assert(ctx);
+
+    struct cio_co_sched *sched = malloc(sizeof(*sched));
+    memset(sched, 0, sizeof(*sched));
+    sched->ctx = ctx;
+    sched->page_size = sysconf(_SC_PAGESIZE);
+    if (stack_size == 0)
+        stack_size = CO_STACK_SIZE;
+    sched->stack_size = (stack_size + sched->page_size - 1) & ~(sched->page_size - 1);
+    sched->current = NULL;
+    sched->nr_live = 0;
+    INIT_LIST_HEAD(&sched->ready);
+    INIT_LIST_HEAD(&sched->sleepers);
+    INIT_LIST_HEAD(&sched->pool);
+    return sched;
+}
+
+static void co_free(struct cio_co_sched *sched, struct co *co)
+{
+    munmap(co->stack, sched->stack_size + sched->page_size);
+    free(co);
+}
+
+void cio_co_sched_drop(struct cio_co_sched *sched)
+{
+    struct co *pos, *n;
+    list_for_each_entry_safe(pos, n, &sched->pool, ln) {
+        list_del(&pos->ln);
+        co_free(sched, pos);
+    }
+
+    // coroutines not finished are abandoned
+    list_for_each_entry_safe(pos, n, &sched->ready, ln) {
+        list_del(&pos->ln);
+        co_free(sched, pos);
+    }
+    list_for_each_entry_safe(pos, n, &sched->sleepers, ln) {
+        list_del(&pos->ln);
+        co_free(sched, pos);
+    }
+
+    free(sched);
+}
+
+int cio_co_spawn(struct cio_co_sched *sched, cio_co_fn fn, void *arg)
+{
+    struct co *co;
+    if (!list_empty(&sched->pool)) {
+        co = list_first_entry(&sched->pool, struct co, ln);
+        list_del(&co->ln);
+    } else {
+        co = malloc(sizeof(*co));
+        if (co == NULL)
+            return -1;
+        co->stack = mmap(NULL, sched->stack_size + sched->page_size,
+                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS
+#ifdef MAP_NORESERVE
+                         | MAP_NORESERVE
+#endif
+                         , -1, 0);
+        if (co->stack == MAP_FAILED) {
+            free(co);
+            return -1;
+        }
+        // stacks grow down, a overflow hits the guard page
+        mprotect(co->stack, sched->page_size, PROT_NONE);
+    }
+
+    getcontext(&co->uc);
+    co->uc.uc_stack.ss_sp = (char *)co->stack + sched->page_size;
+    co->uc.uc_stack.ss_size = sched->stack_size;
+    co->uc.uc_link = &sched->main;
+    makecontext(&co->uc, co_entry, 0);
+
+    co->fn = fn;
+    co->arg = arg;
+    co->done = 0;
+    co->deadline = 0;
+    INIT_LIST_HEAD(&co->ln);
+    list_add_tail(&co->ln, &sched->ready);
+    sched->nr_live++;
+    return 0;
+}
+
+int cio_co_dispatch(struct cio_co_sched *sched, struct cio_event *ev)
+{
+    if (cioe_get_token(ev) != CIO_CO_TOKEN)
+        return 0;
+
+    struct co *co = cioe_get_wrapper(ev);
+    cio_unregister(sched->ctx, cioe_getfd(ev));
+    co_resume(sched, co);
+    return 1;
+}
+
+static void run_ready(struct cio_co_sched *sched)
+{
+    // coroutines spawned meanwhile wait for next round
+    LIST_HEAD(ready);
+    list_splice_init(&sched->ready, &ready);
+
+    while (!list_empty(&ready)) {
+        struct co *co = list_first_entry(&ready, struct co, ln);
+        list_del_init(&co->ln);
+        co_resume(sched, co);
+    }
+}
+
+static void run_sleepers(struct cio_co_sched *sched)
+{
+    uint64_t now = co_now();
+    while (!list_empty(&sched->sleepers)) {
+        struct co *co = list_first_entry(&sched->sleepers, struct co, ln);
+        if (co->deadline > now)
+            break;
+        list_del_init(&co->ln);
+        co_resume(sched, co);
+    }
+}
+
+int cio_co_run(struct cio_co_sched *sched, uint64_t usec)
+{
+    run_ready(sched);
+
+    if (!list_empty(&sched->ready)) {
+        usec = 0;
+    } else if (!list_empty(&sched->sleepers)) {
+        uint64_t now = co_now();
+        struct co *co = list_first_entry(&sched->sleepers, struct co, ln);
+        uint64_t left = co->deadline > now ? co->deadline - now : 0;
+        if (left < usec)
+            usec = left;
+    }
+
+    if (cio_poll(sched->ctx, usec) == -1)
+        return -1;
+
+    struct cio_event *ev;
+    while ((ev = cio_iter(sched->ctx)))
+        cio_co_dispatch(sched, ev);
+
+    run_sleepers(sched);
+    return sched->nr_live;
+}
+
+int cio_co_recv(struct cio_stream *stream, void *buf, size_t len)
+{
+    int fd = cio_stream_getfd(stream);
+    cio_stream_set_nonblock(stream, 1);
+
+    // data may be buffered already, e.g. by tls or a shm ring, so try first;
+    // shm streams may also report a wakeup without data
+    for (;;) {
+        int nr = cio_stream_recv(stream, buf, len);
+        if (nr == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            co_wait_fd(fd, CIOF_READABLE);
+            continue;
+        }
+        return nr;
+    }
+}
+
+int cio_co_send(struct cio_stream *stream, const void *buf, size_t len)
+{
+    int fd = cio_stream_getfd(stream);
+    cio_stream_set_nonblock(stream, 1);
+
+    size_t off = 0;
+    while (off < len) {
+        int nr = cio_stream_send(stream, (const char *)buf + off, len - off);
+        if (nr > 0) {
+            off += nr;
+        } else if (nr == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            co_wait_fd(fd, CIOF_WRITABLE);
+        } else {
+            return -1;
+        }
+    }
+    return len;
+}
+
+struct cio_stream *cio_co_accept(struct cio_listener *listener)
+{
+    int fd = cio_listener_getfd(listener);
+    cio_listener_set_nonblock(listener, 1);
+
+    for (;;) {
+        struct cio_stream *stream = cio_listener_accept(listener);
+        if (stream == NULL && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            co_wait_fd(fd, CIOF_READABLE);
+            continue;
+        }
+        return stream;
+    }
+}
+
+void cio_co_sleep(uint64_t usec)
+{
+    struct cio_co_sched *sched = current_sched;
+    assert(sched && sched->current);
+
+    struct co *co = sched->current;
+    co->deadline = co_now() + usec;
+
+    struct co *pos;
+    list_for_each_entry(pos, &sched->sleepers, ln) {
+        if (pos->deadline > co->deadline)
+            break;
+    }
+    list_add_tail(&co->ln, &pos->ln);
+    co_park();
+}
+
+#endif
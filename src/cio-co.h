@@ -0,0 +1,84 @@
+#ifndef __CIO_CO_H
+#define __CIO_CO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct cio;
+struct cio_event;
+struct cio_stream;
+struct cio_listener;
+struct cio_co_sched;
+
+/**
+ * the token of fds registered by parked coroutines, don't use it for others
+ */
+#define CIO_CO_TOKEN (-0x636f)
+
+typedef void (*cio_co_fn)(void *arg);
+
+/**
+ * cio_co_sched_new: stackful coroutines parked on and resumed by ctx, unix only
+ * @stack_size: stack size of each coroutine, 0 for 64k, stacks are pooled
+ *              and only touched pages take memory
+ */
+struct cio_co_sched *cio_co_sched_new(struct cio *ctx, size_t stack_size);
+
+/**
+ * cio_co_sched_drop: drop it after all coroutines finish
+ */
+void cio_co_sched_drop(struct cio_co_sched *sched);
+
+/**
+ * cio_co_spawn: the coroutine starts at next cio_co_run
+ */
+int cio_co_spawn(struct cio_co_sched *sched, cio_co_fn fn, void *arg);
+
+/**
+ * cio_co_dispatch: resume the coroutine parked on ev, for loops mixing
+ * coroutines with other fds of the same ctx
+ * @return: 1 if ev belongs to a coroutine, 0 if not
+ */
+int cio_co_dispatch(struct cio_co_sched *sched, struct cio_event *ev);
+
+/**
+ * cio_co_run: run spawned coroutines, cio_poll once, then resume coroutines
+ * woken by fds or timers, events not belong to coroutines are dropped
+ * @usec: same as cio_poll, but never longer than the next cio_co_sleep
+ * @return: nr live coroutines, -1 if cio_poll fails
+ */
+int cio_co_run(struct cio_co_sched *sched, uint64_t usec);
+
+/**
+ * cio_co_recv: only in a coroutine, recv and park only while there is
+ * nothing to read, the fd of stream is switched to non-blocking
+ * @return: same as cio_stream_recv, never -1 with EAGAIN
+ */
+int cio_co_recv(struct cio_stream *stream, void *buf, size_t len);
+
+/**
+ * cio_co_send: only in a coroutine, park whenever not writable until all of
+ * buf is sent, the fd of stream is switched to non-blocking
+ * @return: len, -1 if error
+ */
+int cio_co_send(struct cio_stream *stream, const void *buf, size_t len);
+
+/**
+ * cio_co_accept: only in a coroutine, accept and park only while no
+ * connection is pending, the fd of listener is switched to non-blocking
+ */
+struct cio_stream *cio_co_accept(struct cio_listener *listener);
+
+/**
+ * cio_co_sleep: only in a coroutine
+ */
+void cio_co_sleep(uint64_t usec);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
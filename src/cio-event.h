@@ -1,7 +1,8 @@
 #ifndef __CIO_EVENT_H
 #define __CIO_EVENT_H
 
-#include <sys/time.h>
+#include <stddef.h>
+#include "cio.h"
 #include "list.h"
 #include "stream.h"
 
@@ -10,16 +11,16 @@ extern "C" {
 #endif
 
 struct cio_event {
+    struct cio_event_view view; /* public head, see CIO_EVENT_ABI */
     int fin;
-    int token;
-    int fd;
-    void *wrapper;
-    union stream_state state;
-    struct timeval ts;
+    int prio;
     struct stream *stream;
     struct list_head ln;
 };
 
+_Static_assert(offsetof(struct cio_event, view) == 0,
+               "struct cio_event_view is the head of struct cio_event");
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,346 @@
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/select.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "cio.h"
+#include "cio-executor.h"
+
+#define DEQUE_INIT_CAP 64
+
+struct task {
+    struct cio_executor *exec;
+    int fd;
+    int token;
+    int flags;
+    int events;
+    void *wrapper;
+    int rc;
+};
+
+/**
+ * fd_state: owned by the thread polling ctx, an fd is busy from dispatch
+ * until its task is done and it's re-armed, events meanwhile are merged
+ */
+struct fd_state {
+    int busy;
+    int again;
+    int events;
+};
+
+/**
+ * deque: the owner pops from bottom, thieves steal from top
+ */
+struct deque {
+    pthread_mutex_t lock;
+    struct task **buf;
+    size_t cap;
+    size_t top;
+    size_t bottom;
+};
+
+struct worker {
+    struct cio_executor *exec;
+    struct deque deque;
+    pthread_t tid;
+    int id;
+};
+
+struct cio_executor {
+    struct cio *ctx;
+    cio_executor_fn fn;
+
+    struct worker *workers;
+    int nr_workers;
+    int next; /* round robin for dispatch */
+
+    struct fd_state *fds; /* FD_SETSIZE */
+    int nr_busy;
+
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    int nr_pending;
+    int stop;
+};
+
+static int deque_init(struct deque *dq)
+{
+    dq->cap = DEQUE_INIT_CAP;
+    dq->buf = malloc(dq->cap * sizeof(*dq->buf));
+    if (dq->buf == NULL)
+        return -1;
+    pthread_mutex_init(&dq->lock, NULL);
+    dq->top = 0;
+    dq->bottom = 0;
+    return 0;
+}
+
+static void deque_fini(struct deque *dq)
+{
+    assert(dq->top == dq->bottom);
+    free(dq->buf);
+    pthread_mutex_destroy(&dq->lock);
+}
+
+static void deque_push(struct deque *dq, struct task *task)
+{
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom - dq->top == dq->cap) {
+        struct task **buf = malloc(dq->cap * 2 * sizeof(*buf));
+        for (size_t i = dq->top; i != dq->bottom; i++)
+            buf[i & (dq->cap * 2 - 1)] = dq->buf[i & (dq->cap - 1)];
+        free(dq->buf);
+        dq->buf = buf;
+        dq->cap *= 2;
+    }
+    dq->buf[dq->bottom & (dq->cap - 1)] = task;
+    dq->bottom++;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+static struct task *deque_pop(struct deque *dq)
+{
+    struct task *task = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom != dq->top) {
+        dq->bottom--;
+        task = dq->buf[dq->bottom & (dq->cap - 1)];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+static struct task *deque_steal(struct deque *dq)
+{
+    struct task *task = NULL;
+    // a busy victim is skipped instead of waited for
+    if (pthread_mutex_trylock(&dq->lock) != 0)
+        return NULL;
+    if (dq->bottom != dq->top) {
+        task = dq->buf[dq->top & (dq->cap - 1)];
+        dq->top++;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+static struct task *worker_take(struct worker *worker)
+{
+    struct cio_executor *exec = worker->exec;
+
+    struct task *task = deque_pop(&worker->deque);
+    for (int i = 1; task == NULL && i < exec->nr_workers; i++) {
+        struct worker *victim = &exec->workers[(worker->id + i) % exec->nr_workers];
+        task = deque_steal(&victim->deque);
+    }
+
+    if (task)
+        __atomic_sub_fetch(&exec->nr_pending, 1, __ATOMIC_ACQ_REL);
+    return task;
+}
+
+static void exec_free(struct cio_executor *exec)
+{
+    pthread_cond_destroy(&exec->idle_cond);
+    pthread_mutex_destroy(&exec->idle_lock);
+    free(exec->fds);
+    free(exec->workers);
+    free(exec);
+}
+
+static void exec_push(struct cio_executor *exec, struct task *task)
+{
+    // counted first, so a worker taking it never sees nr_pending below 0
+    __atomic_add_fetch(&exec->nr_pending, 1, __ATOMIC_ACQ_REL);
+    struct worker *worker = &exec->workers[exec->next++ % exec->nr_workers];
+    deque_push(&worker->deque, task);
+
+    pthread_mutex_lock(&exec->idle_lock);
+    pthread_cond_signal(&exec->idle_cond);
+    pthread_mutex_unlock(&exec->idle_lock);
+}
+
+/**
+ * task_done: runs on the thread polling ctx, by cio_submit from the worker
+ */
+static void task_done(struct cio *ctx, void *arg)
+{
+    struct task *task = arg;
+    struct cio_executor *exec = task->exec;
+    struct fd_state *state = &exec->fds[task->fd];
+
+    // events merged while running go to a worker before the fd is re-armed
+    if (task->rc == 0 && state->again && !exec->stop) {
+        task->events = state->events;
+        state->again = 0;
+        state->events = 0;
+        exec_push(exec, task);
+        return;
+    }
+
+    memset(state, 0, sizeof(*state));
+    if (task->rc == 0)
+        cio_register(ctx, task->fd, task->token, task->flags, task->wrapper);
+    free(task);
+
+    // the last task of a dropped executor frees it
+    if (--exec->nr_busy == 0 && exec->stop)
+        exec_free(exec);
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *worker = arg;
+    struct cio_executor *exec = worker->exec;
+
+    for (;;) {
+        struct task *task = worker_take(worker);
+        if (task) {
+            task->rc = exec->fn(exec->ctx, task->fd, task->token, task->events,
+                                task->wrapper);
+            // the fd stays busy until task_done, so a failed submit is retried
+            while (cio_submit(exec->ctx, task_done, task) == -1)
+                usleep(1000);
+            continue;
+        }
+
+        pthread_mutex_lock(&exec->idle_lock);
+        while (__atomic_load_n(&exec->nr_pending, __ATOMIC_ACQUIRE) == 0 &&
+               !exec->stop)
+            pthread_cond_wait(&exec->idle_cond, &exec->idle_lock);
+        int stop = exec->stop &&
+            __atomic_load_n(&exec->nr_pending, __ATOMIC_ACQUIRE) == 0;
+        pthread_mutex_unlock(&exec->idle_lock);
+        if (stop)
+            break;
+    }
+
+    return NULL;
+}
+
+struct cio_executor *cio_executor_new(struct cio *ctx, int nr_workers, cio_executor_fn fn)
+{
+    assert(ctx && fn);
+
+    if (nr_workers <= 0) {
+        long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nr_workers = nr_cpus > 0 ? nr_cpus : 1;
+    }
+
+    struct cio_executor *exec = calloc(1, sizeof(*exec));
+    if (exec == NULL)
+        return NULL;
+    exec->ctx = ctx;
+    exec->fn = fn;
+    exec->workers = calloc(nr_workers, sizeof(struct worker));
+    exec->fds = calloc(FD_SETSIZE, sizeof(struct fd_state));
+    if (exec->workers == NULL || exec->fds == NULL)
+        goto err_free;
+    pthread_mutex_init(&exec->idle_lock, NULL);
+    pthread_cond_init(&exec->idle_cond, NULL);
+
+    for (int i = 0; i < nr_workers; i++) {
+        exec->workers[i].exec = exec;
+        exec->workers[i].id = i;
+        if (deque_init(&exec->workers[i].deque) == -1)
+            goto err_deque;
+        exec->nr_workers++;
+    }
+
+    for (int i = 0; i < nr_workers; i++) {
+        int err = pthread_create(&exec->workers[i].tid, NULL, worker_thread,
+                                 &exec->workers[i]);
+        if (err) {
+            errno = err;
+            perror("pthread_create");
+            // nothing is dispatched yet, the started ones just stop
+            pthread_mutex_lock(&exec->idle_lock);
+            exec->stop = 1;
+            pthread_cond_broadcast(&exec->idle_cond);
+            pthread_mutex_unlock(&exec->idle_lock);
+            for (int j = 0; j < i; j++)
+                pthread_join(exec->workers[j].tid, NULL);
+            errno = err;
+            goto err_deque;
+        }
+    }
+
+    return exec;
+
+err_deque:
+    for (int i = 0; i < exec->nr_workers; i++)
+        deque_fini(&exec->workers[i].deque);
+    pthread_cond_destroy(&exec->idle_cond);
+    pthread_mutex_destroy(&exec->idle_lock);
+err_free:
+    free(exec->fds);
+    free(exec->workers);
+    free(exec);
+    return NULL;
+}
+
+void cio_executor_drop(struct cio_executor *exec)
+{
+    pthread_mutex_lock(&exec->idle_lock);
+    exec->stop = 1;
+    pthread_cond_broadcast(&exec->idle_cond);
+    pthread_mutex_unlock(&exec->idle_lock);
+
+    for (int i = 0; i < exec->nr_workers; i++)
+        pthread_join(exec->workers[i].tid, NULL);
+
+    for (int i = 0; i < exec->nr_workers; i++)
+        deque_fini(&exec->workers[i].deque);
+
+    // tasks are all run, but their task_done may still wait in cio_submit
+    if (exec->nr_busy == 0)
+        exec_free(exec);
+}
+
+int cio_executor_dispatch(struct cio_executor *exec, struct cio_event *ev)
+{
+    int fd = cioe_getfd(ev);
+    if (fd < 0 || fd >= FD_SETSIZE)
+        return -1;
+    int events = (cioe_is_readable(ev) ? CIOF_READABLE : 0) |
+        (cioe_is_writable(ev) ? CIOF_WRITABLE : 0) |
+        (cioe_is_drained(ev) ? CIOF_DRAINED : 0) |
+        (cioe_is_timeout(ev) ? CIOF_TIMEOUT : 0) |
+        (cioe_is_zerocopy(ev) ? CIOF_ZEROCOPY : 0);
+
+    // e.g. a posted event and a polled one of fd in the same round
+    struct fd_state *state = &exec->fds[fd];
+    if (state->busy) {
+        state->again = 1;
+        state->events |= events;
+        return 0;
+    }
+
+    int flags = cio_get_flags(exec->ctx, fd);
+    if (flags == -1)
+        return -1;
+
+    struct task *task = malloc(sizeof(*task));
+    if (task == NULL)
+        return -1;
+    task->exec = exec;
+    task->fd = fd;
+    task->token = cioe_get_token(ev);
+    task->flags = flags;
+    task->events = events;
+    task->wrapper = cioe_get_wrapper(ev);
+    task->rc = 0;
+
+    // one-shot, no more events of fd until its task is done and re-arms it
+    state->busy = 1;
+    exec->nr_busy++;
+    cio_register(exec->ctx, fd, task->token, 0, task->wrapper);
+    exec_push(exec, task);
+
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef __CIO_EXECUTOR_H
+#define __CIO_EXECUTOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct cio;
+struct cio_event;
+struct cio_executor;
+
+/**
+ * cio_executor_fn: runs on a worker thread, never concurrently for one fd
+ * @events: cio_flag of the event, or'ed with events of fd merged meanwhile
+ * @return: 0 to re-arm the fd, others to leave it disarmed, e.g. the handler
+ *          has closed it by cio_stream_submit_close
+ */
+typedef int (*cio_executor_fn)(
+    struct cio *ctx, int fd, int token, int events, void *wrapper);
+
+/**
+ * cio_executor_new: a pool of worker threads with work-stealing deques
+ * @nr_workers: nr threads, 0 for nr online cpus
+ * @return: NULL if out of memory or a thread can't be created
+ */
+struct cio_executor *cio_executor_new(struct cio *ctx, int nr_workers, cio_executor_fn fn);
+
+/**
+ * cio_executor_drop: run all dispatched events, then stop and join workers,
+ * drop it before the cio it runs on; the fds are re-armed by the next
+ * cio_poll or cio_drop, which also frees what is left of exec
+ */
+void cio_executor_drop(struct cio_executor *exec);
+
+/**
+ * cio_executor_dispatch: call it on the thread polling ctx, the fd of ev is
+ * disarmed (one-shot) and ev is handed to a worker, after fn returns 0 the
+ * fd is re-armed with its registered flags by cio_submit; events of an fd
+ * still in a worker, e.g. posted ones, are merged and run by fn once more
+ * before the re-arm
+ */
+int cio_executor_dispatch(struct cio_executor *exec, struct cio_event *ev);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
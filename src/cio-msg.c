@@ -0,0 +1,209 @@
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "cio-stream.h"
+#include "cio-msg.h"
+
+#define RX_BUF_MIN (64 * 1024)
+#define TX_BUF_MIN (4 * 1024)
+#define TX_BUF_MAX (4 * 1024 * 1024)
+
+struct cio_msg_stream {
+    struct cio_stream *stream;
+    size_t max_msg;
+
+    /* rx: [start, end) holds received but not fetched bytes */
+    uint8_t *rx_buf;
+    size_t rx_cap;
+    size_t rx_start;
+    size_t rx_end;
+
+    /* tx: [0, tx_len) holds queued but not sent bytes */
+    uint8_t *tx_buf;
+    size_t tx_cap;
+    size_t tx_len;
+    size_t tx_max; /* queued bytes beyond are refused with ENOBUFS */
+};
+
+struct cio_msg_stream *cio_msg_stream_new(struct cio_stream *stream, size_t max_msg)
+{
+    assert(stream);
+
+    // the rx buffer is allocated for a max message up front
+    if (max_msg > CIO_MSG_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct cio_msg_stream *ms = malloc(sizeof(*ms));
+    if (ms == NULL)
+        return NULL;
+    memset(ms, 0, sizeof(*ms));
+
+    ms->stream = stream;
+    ms->max_msg = max_msg;
+
+    // the rx buffer must hold at least one max message with its prefix
+    ms->rx_cap = max_msg + CIO_MSG_HDR_LEN;
+    if (ms->rx_cap < RX_BUF_MIN)
+        ms->rx_cap = RX_BUF_MIN;
+    ms->rx_buf = malloc(ms->rx_cap);
+    ms->rx_start = 0;
+    ms->rx_end = 0;
+
+    ms->tx_cap = TX_BUF_MIN;
+    ms->tx_buf = malloc(ms->tx_cap);
+    ms->tx_len = 0;
+    ms->tx_max = max_msg + CIO_MSG_HDR_LEN;
+    if (ms->tx_max < TX_BUF_MAX)
+        ms->tx_max = TX_BUF_MAX;
+
+    if (ms->rx_buf == NULL || ms->tx_buf == NULL) {
+        free(ms->rx_buf);
+        free(ms->tx_buf);
+        free(ms);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return ms;
+}
+
+void cio_msg_stream_drop(struct cio_msg_stream *ms)
+{
+    cio_stream_drop(ms->stream);
+    free(ms->rx_buf);
+    free(ms->tx_buf);
+    free(ms);
+}
+
+int cio_msg_stream_getfd(struct cio_msg_stream *ms)
+{
+    return cio_stream_getfd(ms->stream);
+}
+
+struct cio_stream *cio_msg_stream_get_stream(struct cio_msg_stream *ms)
+{
+    return ms->stream;
+}
+
+/**
+ * the length prefix of the message at rx_start, at least 4 bytes are there
+ */
+static size_t rx_msg_len(struct cio_msg_stream *ms)
+{
+    const uint8_t *hdr = ms->rx_buf + ms->rx_start;
+    return (size_t)hdr[0] << 24 | (size_t)hdr[1] << 16 |
+        (size_t)hdr[2] << 8 | (size_t)hdr[3];
+}
+
+int cio_msg_stream_fill(struct cio_msg_stream *ms)
+{
+    // move the partial message to the head, so messages stay contiguous
+    if (ms->rx_start != 0) {
+        ms->rx_end -= ms->rx_start;
+        if (ms->rx_end)
+            memmove(ms->rx_buf, ms->rx_buf + ms->rx_start, ms->rx_end);
+        ms->rx_start = 0;
+    }
+
+    // a valid partial message always fits, so a full buffer starts with a
+    // complete message the caller hasn't fetched, or a too long one
+    if (ms->rx_end == ms->rx_cap) {
+        errno = rx_msg_len(ms) > ms->max_msg ? EPROTO : ENOBUFS;
+        return -1;
+    }
+
+    int nr = cio_stream_recv(ms->stream, ms->rx_buf + ms->rx_end,
+                             ms->rx_cap - ms->rx_end);
+    if (nr > 0)
+        ms->rx_end += nr;
+    return nr;
+}
+
+int cio_msg_stream_next(struct cio_msg_stream *ms, const void **msg, size_t *len)
+{
+    size_t avail = ms->rx_end - ms->rx_start;
+    if (avail < CIO_MSG_HDR_LEN)
+        return 0;
+
+    const uint8_t *hdr = ms->rx_buf + ms->rx_start;
+    size_t msg_len = rx_msg_len(ms);
+    if (msg_len > ms->max_msg)
+        return -1;
+
+    if (avail < CIO_MSG_HDR_LEN + msg_len)
+        return 0;
+
+    *msg = hdr + CIO_MSG_HDR_LEN;
+    *len = msg_len;
+    ms->rx_start += CIO_MSG_HDR_LEN + msg_len;
+
+    // rewind for free when everything is fetched, saves a memmove in fill
+    if (ms->rx_start == ms->rx_end) {
+        ms->rx_start = 0;
+        ms->rx_end = 0;
+    }
+
+    return 1;
+}
+
+int cio_msg_stream_send(struct cio_msg_stream *ms, const void *buf, size_t len)
+{
+    if (len > ms->max_msg) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    size_t need = ms->tx_len + CIO_MSG_HDR_LEN + len;
+    if (need > ms->tx_max) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    if (need > ms->tx_cap) {
+        size_t cap = ms->tx_cap;
+        while (cap < need)
+            cap *= 2;
+        if (cap > ms->tx_max)
+            cap = ms->tx_max;
+        uint8_t *buf = realloc(ms->tx_buf, cap);
+        if (buf == NULL) {
+            errno = ENOBUFS;
+            return -1;
+        }
+        ms->tx_buf = buf;
+        ms->tx_cap = cap;
+    }
+
+    uint8_t *hdr = ms->tx_buf + ms->tx_len;
+    hdr[0] = (uint8_t)(len >> 24);
+    hdr[1] = (uint8_t)(len >> 16);
+    hdr[2] = (uint8_t)(len >> 8);
+    hdr[3] = (uint8_t)len;
+    memcpy(hdr + CIO_MSG_HDR_LEN, buf, len);
+    ms->tx_len = need;
+
+    return 0;
+}
+
+int cio_msg_stream_flush(struct cio_msg_stream *ms)
+{
+    if (ms->tx_len == 0)
+        return 0;
+
+    int nr = cio_stream_send(ms->stream, ms->tx_buf, ms->tx_len);
+    if (nr <= 0)
+        return nr;
+
+    ms->tx_len -= nr;
+    if (ms->tx_len)
+        memmove(ms->tx_buf, ms->tx_buf + nr, ms->tx_len);
+    return nr;
+}
+
+size_t cio_msg_stream_pending(struct cio_msg_stream *ms)
+{
+    return ms->tx_len;
+}
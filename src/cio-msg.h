@@ -0,0 +1,92 @@
+#ifndef __CIO_MSG_H
+#define __CIO_MSG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct cio_stream;
+struct cio_msg_stream;
+
+/**
+ * message framing: every message is prefixed with a 4 bytes length
+ * in network byte order, the length does not include the prefix itself
+ */
+#define CIO_MSG_HDR_LEN 4
+
+/**
+ * the largest max_msg, the receive buffer holds one max message up front
+ */
+#define CIO_MSG_MAX (64 * 1024 * 1024)
+
+/**
+ * cio_msg_stream_new: wrap a stream into message mode, the stream is owned
+ * by the returned cio_msg_stream and dropped together with it
+ * @max_msg: the max length of a message payload, larger one is a protocol error,
+ *           at most CIO_MSG_MAX
+ * @return: NULL with errno EINVAL if max_msg is too large, or ENOMEM; the
+ *          stream is still owned by the caller then
+ */
+struct cio_msg_stream *cio_msg_stream_new(struct cio_stream *stream, size_t max_msg);
+
+/**
+ * cio_msg_stream_drop
+ */
+void cio_msg_stream_drop(struct cio_msg_stream *ms);
+
+/**
+ * cio_msg_stream_getfd
+ */
+int cio_msg_stream_getfd(struct cio_msg_stream *ms);
+
+/**
+ * cio_msg_stream_get_stream
+ * @return: the wrapped stream, still owned by the cio_msg_stream
+ */
+struct cio_stream *cio_msg_stream_get_stream(struct cio_msg_stream *ms);
+
+/**
+ * cio_msg_stream_fill: recv as much as available into the receive buffer,
+ * call it once per readable event; it invalidates views returned by next
+ * @return: same as cio_stream_recv, nr bytes, 0 if peer closed, -1 if error,
+ *          errno ENOBUFS if the buffer is full of messages not fetched by
+ *          next yet, EPROTO if it holds a too long message, as next reports
+ */
+int cio_msg_stream_fill(struct cio_msg_stream *ms);
+
+/**
+ * cio_msg_stream_next: fetch next complete message as a zero-copy view into
+ * the receive buffer, valid until next call of cio_msg_stream_fill
+ * @return: 1 if a message is fetched, 0 if no complete message, -1 if the
+ *          length prefix exceeds max_msg
+ */
+int cio_msg_stream_next(struct cio_msg_stream *ms, const void **msg, size_t *len);
+
+/**
+ * cio_msg_stream_send: queue a message, nothing is sent until flush; the
+ * queue holds 4MB or one max message, whichever is more
+ * @return: 0 on success, -1 with errno EMSGSIZE if len exceeds max_msg,
+ *          ENOBUFS if the queue is full or out of memory
+ */
+int cio_msg_stream_send(struct cio_msg_stream *ms, const void *buf, size_t len);
+
+/**
+ * cio_msg_stream_flush: send all queued messages with one cio_stream_send,
+ * call it once per writable event; unsent bytes stay queued
+ * @return: nr bytes sent, -1 if error
+ */
+int cio_msg_stream_flush(struct cio_msg_stream *ms);
+
+/**
+ * cio_msg_stream_pending
+ * @return: nr bytes queued but not sent
+ */
+size_t cio_msg_stream_pending(struct cio_msg_stream *ms);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -1,13 +1,45 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <unistd.h>
 
 #ifndef WIN32
 #include <fcntl.h>
 #include <termios.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
-#else
+#endif
+
+#ifdef __linux__
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#endif
+
+#if defined CIO_TLS && defined __unix__
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+// kTLS, SSL_sendfile and ossl_ssize_t came with openssl 3.0
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined OPENSSL_NO_KTLS
+#define TLS_KTLS
+#endif
+#endif
+
+#include <sys/time.h>
+
+#ifdef WIN32
 #include <Winsock2.h>
 
 #if defined(NO_SOCKLEN_T)
@@ -17,15 +49,42 @@ typedef int socklen_t;
 #if !defined(MSG_NOSIGNAL)
 #define MSG_NOSIGNAL (0)
 #endif
+
+#if !defined(MSG_DONTWAIT)
+#define MSG_DONTWAIT (0)
+#endif
+
+#if !defined(SHUT_RDWR)
+#define SHUT_RDWR SD_BOTH
+#endif
+
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#endif
+
+#if !defined(MSG_MORE)
+#define MSG_MORE (0)
 #endif
 
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 
+#include "cio.h"
 #include "cio-stream.h"
+#include "cio-buf.h"
+#include "buf.h"
+#include "list.h"
+
+#define SENDQ_IOV_MAX 64
+#define RATE_RESUME_MSEC 10
+#define SENDFILE_CHUNK (64 * 1024)
 
 /**
  * cio_stream
@@ -41,8 +100,20 @@ struct cio_stream_operations {
     void (*drop)(struct cio_stream *stream);
     int (*getfd)(struct cio_stream *stream);
     int (*send)(struct cio_stream *stream, const void *buf, size_t len);
+    int (*sendv)(struct cio_stream *stream, const struct iovec *iov, int iovcnt,
+                 int flags);
     int (*recv)(struct cio_stream *stream, void *buf, size_t size);
     struct cio_stream *(*accept)(struct cio_listener *listener);
+    int (*sendfile)(struct cio_stream *stream, int in_fd, int64_t *offset,
+                    size_t count);
+};
+
+struct rate {
+    uint64_t rate; /* bytes per second, 0 for unlimited */
+    uint64_t burst;
+    uint64_t tokens;
+    uint64_t ts; /* usec, tokens are refilled up to it */
+    int throttled;
 };
 
 struct cio_stream {
@@ -50,257 +121,1915 @@ struct cio_stream {
     char *addr;
     char type; /* stream_type */
     const struct cio_stream_operations *ops;
+
+    /* send queue, flushed at the beginning of cio_poll of ctx */
+    struct cio *ctx;
+    int corked;
+    int deferred;
+    int sendq_err;
+    size_t sendq_len;
+    struct list_head sendq;
+
+    /* bounded send queue, see cio_stream_set_sendq */
+    size_t sendq_limit;
+    size_t sendq_low;
+    int sendq_policy;
+    int sendq_above_low;
+
+    /* token buckets, see cio_stream_set_rate */
+    struct rate rx_rate;
+    struct rate tx_rate;
+
+    /* bytes received in budget_round, see cio_set_budget */
+    uint64_t budget_round;
+    size_t budget_used;
+
+    /* MSG_ZEROCOPY sends, see cio_stream_send_zerocopy */
+    int zerocopy;
+    uint32_t zc_next; /* id of the next send */
+    uint32_t zc_done; /* nr sends completed */
 };
 
-void cio_stream_drop(struct cio_stream *stream)
+struct sendq_node {
+    size_t len;
+    size_t off;
+    const uint8_t *data; /* points to inline_data or the shared buf */
+    struct cio_buf *buf;
+    int started; /* the head of its message is on the wire already */
+    struct list_head ln;
+    uint8_t inline_data[];
+};
+
+static void sendq_node_free(struct sendq_node *node)
 {
-    assert(stream->ops->drop);
-    stream->ops->drop(stream);
+    if (node->buf)
+        cio_buf_unref(node->buf);
+    free(node);
 }
 
-int cio_stream_getfd(struct cio_stream *stream)
+static uint64_t stream_now(void)
 {
-    assert(stream->ops->getfd);
-    return stream->ops->getfd(stream);
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 * 1000 + tv.tv_usec;
 }
 
-int cio_stream_recv(struct cio_stream *stream, void *buf, size_t len)
+static void rate_refill(struct rate *r)
 {
-    if (stream->ops->recv) {
-        return stream->ops->recv(stream, buf, len);
-    } else {
-        return -1;
+    uint64_t now = stream_now();
+    uint64_t elapsed = now - r->ts;
+    // a long idle at a high rate would overflow elapsed * rate, the bucket
+    // is full long before that anyway
+    if (elapsed > UINT64_MAX / r->rate) {
+        r->tokens = r->burst;
+        r->ts = now;
+        return;
+    }
+
+    uint64_t add = elapsed * r->rate / (1000 * 1000);
+    if (add >= r->burst - r->tokens) {
+        r->tokens = r->burst;
+        r->ts = now;
+    } else if (add) {
+        // advance by what add is worth, keep the fraction for next time
+        r->tokens += add;
+        r->ts += add * 1000 * 1000 / r->rate;
     }
 }
 
-int cio_stream_send(struct cio_stream *stream, const void *buf, size_t len)
+static void rate_rx_resume(void *arg)
 {
-    if (stream->ops->send) {
-        return stream->ops->send(stream, buf, len);
-    } else {
-        return -1;
-    }
+    struct cio_stream *stream = arg;
+    stream->rx_rate.throttled = 0;
+    cio_resume(stream->ctx, cio_stream_getfd(stream), CIOF_READABLE);
 }
 
-void cio_listener_drop(struct cio_listener *listener)
+static void rate_tx_resume(void *arg)
 {
-    cio_stream_drop((struct cio_stream *)listener);
+    struct cio_stream *stream = arg;
+    stream->tx_rate.throttled = 0;
+    cio_resume(stream->ctx, cio_stream_getfd(stream), CIOF_WRITABLE);
 }
 
-int cio_listener_getfd(struct cio_listener *listener)
+/**
+ * bytes of len the bucket allows now, when it's empty the fd is taken out
+ * of polling in ctx until a timer finds RATE_RESUME_MSEC worth of tokens
+ */
+static size_t rate_take(struct cio_stream *stream, struct rate *r, size_t len)
 {
-    return cio_stream_getfd((struct cio_stream *)listener);
+    if (r->rate == 0)
+        return len;
+
+    rate_refill(r);
+    if (r->tokens)
+        return len < r->tokens ? len : r->tokens;
+
+    if (!r->throttled && stream->ctx) {
+        int is_rx = r == &stream->rx_rate;
+        uint64_t need = r->rate * RATE_RESUME_MSEC / 1000;
+        if (need == 0)
+            need = 1;
+        if (need > r->burst)
+            need = r->burst;
+
+        cio_suspend(stream->ctx, cio_stream_getfd(stream), is_rx ? CIOF_READABLE : CIOF_WRITABLE);
+        cio_defer_after(stream->ctx, need * 1000 * 1000 / r->rate + 1,
+                        is_rx ? rate_rx_resume : rate_tx_resume, stream);
+        r->throttled = 1;
+    }
+    return 0;
 }
 
-struct cio_stream *cio_listener_accept(struct cio_listener *listener)
+static int __stream_sendv(struct cio_stream *stream, const struct iovec *iov,
+                          int iovcnt, int flags)
 {
-    struct cio_stream *stream = (struct cio_stream *)listener;
-    if(stream->ops->accept)
-        return stream->ops->accept(listener);
-    else
-        return NULL;
+    if (stream->ops->sendv)
+        return stream->ops->sendv(stream, iov, iovcnt, flags);
+
+    // no vectored send, fall back to one send for each iov
+    int total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        int nr = stream->ops->send(stream, iov[i].iov_base, iov[i].iov_len);
+        if (nr < 0)
+            return total ? total : nr;
+        total += nr;
+        if ((size_t)nr < iov[i].iov_len)
+            break;
+    }
+    return total;
 }
 
-static struct cio_stream *__cio_stream_new(
-    const char *addr, int fd, int type, const struct cio_stream_operations *ops)
+static int stream_sendv(struct cio_stream *stream, const struct iovec *iov,
+                        int iovcnt, int flags)
 {
-    struct cio_stream *stream = malloc(sizeof(*stream));
-    memset(stream, 0, sizeof(*stream));
+    if (stream->tx_rate.rate == 0)
+        return __stream_sendv(stream, iov, iovcnt, flags);
 
-    stream->fd = fd;
-    stream->addr = strdup(addr);
-    stream->type = type;
-    stream->ops = ops;
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
 
-    return stream;
+    size_t allowed = rate_take(stream, &stream->tx_rate, total);
+    if (allowed == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // cut the tail beyond what the bucket allows
+    struct iovec vec[SENDQ_IOV_MAX];
+    if (allowed < total) {
+        assert(iovcnt <= SENDQ_IOV_MAX);
+        int cnt = 0;
+        for (size_t left = allowed; left; cnt++) {
+            vec[cnt] = iov[cnt];
+            if (vec[cnt].iov_len > left)
+                vec[cnt].iov_len = left;
+            left -= vec[cnt].iov_len;
+        }
+        iov = vec;
+        iovcnt = cnt;
+    }
+
+    int nr = __stream_sendv(stream, iov, iovcnt, flags);
+    if (nr > 0)
+        stream->tx_rate.tokens -= nr;
+    return nr;
 }
 
-static void __cio_stream_drop(struct cio_stream *stream)
+static void sendq_consume(struct cio_stream *stream, size_t len)
 {
-    close(stream->fd);
-    free(stream->addr);
-    free(stream);
+    stream->sendq_len -= len;
+
+    struct sendq_node *pos, *n;
+    list_for_each_entry_safe(pos, n, &stream->sendq, ln) {
+        if (len == 0)
+            break;
+        size_t left = pos->len - pos->off;
+        if (len < left) {
+            pos->off += len;
+            break;
+        }
+        len -= left;
+        list_del(&pos->ln);
+        sendq_node_free(pos);
+    }
 }
 
-static int __cio_stream_getfd(struct cio_stream *stream)
+static void sendq_check_drained(struct cio_stream *stream)
 {
-    return stream->fd;
+    if (stream->ctx && stream->sendq_above_low &&
+        stream->sendq_len <= stream->sendq_low) {
+        stream->sendq_above_low = 0;
+        cio_post(stream->ctx, cio_stream_getfd(stream), CIOF_DRAINED);
+    }
 }
 
-/**
- * tcp_stream
- */
-
-static int tcp_stream_recv(struct cio_stream *stream, void *buf, size_t len)
+static int sendq_flush(struct cio_stream *stream)
 {
-    assert(stream->type != CIOS_T_LISTEN);
-    return recv(stream->fd, buf, len, 0);
+    while (!list_empty(&stream->sendq)) {
+        struct iovec iov[SENDQ_IOV_MAX];
+        int cnt = 0;
+        size_t total = 0;
+
+        struct sendq_node *pos;
+        list_for_each_entry(pos, &stream->sendq, ln) {
+            if (cnt == SENDQ_IOV_MAX)
+                break;
+            iov[cnt].iov_base = (void *)(pos->data + pos->off);
+            iov[cnt].iov_len = pos->len - pos->off;
+            total += iov[cnt].iov_len;
+            cnt++;
+        }
+
+        // tell the kernel more is coming if the queue can't go in one call
+        int flags = MSG_DONTWAIT;
+        if (total < stream->sendq_len)
+            flags |= MSG_MORE;
+
+        int nr = stream_sendv(stream, iov, cnt, flags);
+        if (nr < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+            stream->sendq_err = errno;
+            return -1;
+        }
+
+        sendq_consume(stream, nr);
+        if ((size_t)nr < total)
+            break;
+    }
+
+    sendq_check_drained(stream);
+    // an unbounded queue may hold more than an int tells
+    return stream->sendq_len > INT_MAX ? INT_MAX : (int)stream->sendq_len;
 }
 
-static int tcp_stream_send(struct cio_stream *stream, const void *buf, size_t len)
+static void sendq_flush_deferred(void *arg)
 {
-    assert(stream->type != CIOS_T_LISTEN);
-    return send(stream->fd, buf, len, MSG_NOSIGNAL);
+    struct cio_stream *stream = arg;
+    stream->deferred = 0;
+
+    if (sendq_flush(stream) > 0) {
+        if (cio_defer(stream->ctx, sendq_flush_deferred, stream) == 0)
+            stream->deferred = 1;
+    }
 }
 
-static struct cio_stream_operations tcp_stream_ops = {
-    .drop = __cio_stream_drop,
-    .getfd = __cio_stream_getfd,
-    .send = tcp_stream_send,
-    .recv = tcp_stream_recv,
-    .accept = NULL,
-};
+static void sendq_clear(struct cio_stream *stream);
 
-static struct cio_stream *tcp_stream_connect(const char *addr)
+/**
+ * make room for len more bytes under sendq_limit, a message always fits an
+ * empty queue, so a partly sent message is never cut by the limit
+ */
+static int sendq_admit(struct cio_stream *stream, size_t len)
 {
-    int fd = socket(PF_INET, SOCK_STREAM, 0);
-    if (fd == -1)
-        return NULL;
+    if (stream->sendq_limit == 0 || list_empty(&stream->sendq) ||
+        stream->sendq_len + len <= stream->sendq_limit)
+        return 0;
+
+    switch (stream->sendq_policy) {
+    case CIO_SENDQ_DROP_OLDEST: {
+        // whole messages only, the head may be partly on the wire already
+        struct sendq_node *pos, *n;
+        list_for_each_entry_safe(pos, n, &stream->sendq, ln) {
+            if (stream->sendq_len + len <= stream->sendq_limit)
+                break;
+            if (pos->off || pos->started)
+                continue;
+            stream->sendq_len -= pos->len;
+            list_del(&pos->ln);
+            sendq_node_free(pos);
+        }
+        return 0;
+    }
+    case CIO_SENDQ_DISCONNECT:
+        sendq_clear(stream);
+        stream->sendq_err = ENOBUFS;
+        shutdown(cio_stream_getfd(stream), SHUT_RDWR);
+        errno = ENOBUFS;
+        return -1;
+    default:
+        // posts CIOF_DRAINED once the queue is back to the low watermark
+        stream->sendq_above_low = 1;
+        errno = EAGAIN;
+        return -1;
+    }
+}
 
-    uint32_t host;
-    uint16_t port;
-    char *tmp = strdup(addr);
-    char *colon = strchr(tmp, ':');
-    *colon = 0;
-    host = inet_addr(tmp);
-    port = htons(atoi(colon + 1));
-    free(tmp);
+static int sendq_check(struct cio_stream *stream, size_t len)
+{
+    if (stream->sendq_err) {
+        errno = stream->sendq_err;
+        return -1;
+    }
 
-    int rc = 0;
-    struct sockaddr_in sockaddr = {0};
-    sockaddr.sin_family = PF_INET;
-    sockaddr.sin_addr.s_addr = host;
-    sockaddr.sin_port = port;
+    return sendq_admit(stream, len);
+}
 
-    rc = connect(fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
-    if (rc == -1) {
-        perror("connect");
-        close(fd);
-        return NULL;
+static void sendq_add(struct cio_stream *stream, struct sendq_node *node)
+{
+    INIT_LIST_HEAD(&node->ln);
+    list_add_tail(&node->ln, &stream->sendq);
+    stream->sendq_len += node->len - node->off;
+    if (stream->sendq_limit && stream->sendq_len > stream->sendq_low)
+        stream->sendq_above_low = 1;
+
+    if (!stream->deferred && stream->ctx) {
+        if (cio_defer(stream->ctx, sendq_flush_deferred, stream) == 0)
+            stream->deferred = 1;
     }
-
-    return __cio_stream_new(addr, fd, CIOS_T_CONNECT, &tcp_stream_ops);
 }
 
 /**
- * tcp_listener
+ * queue a copy of iov as one message, so the policy drops it as a whole
+ * @skip: nr bytes of iov already sent, the rest is the tail of a message
  */
-
-struct cio_stream *tcp_listener_accept(struct cio_listener *listener)
+static int sendq_pushv(struct cio_stream *stream, const struct cio_iovec *iov,
+                       int iovcnt, size_t skip)
 {
-    struct cio_stream *stream = (struct cio_stream *)listener;;
-    int fd = accept(stream->fd, NULL, NULL);
-    if (fd == -1) {
-        perror("accept");
-        return NULL;
-    }
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].len;
+    assert(skip <= len);
+    len -= skip;
+    if (sendq_check(stream, len) == -1)
+        return -1;
 
-    return __cio_stream_new(stream->addr, fd, CIOS_T_ACCEPT, &tcp_stream_ops);
+    struct sendq_node *node = malloc(sizeof(*node) + len);
+    if (node == NULL)
+        return -1;
+    node->len = len;
+    node->off = 0;
+    node->data = node->inline_data;
+    node->buf = NULL;
+    node->started = skip > 0;
+    size_t off = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (skip >= iov[i].len) {
+            skip -= iov[i].len;
+            continue;
+        }
+        memcpy(node->inline_data + off, (uint8_t *)iov[i].base + skip, iov[i].len - skip);
+        off += iov[i].len - skip;
+        skip = 0;
+    }
+    sendq_add(stream, node);
+    return len;
 }
 
-static struct cio_stream_operations tcp_listener_ops = {
-    .drop = __cio_stream_drop,
-    .getfd = __cio_stream_getfd,
-    .send = NULL,
-    .recv = NULL,
-    .accept = tcp_listener_accept,
-};
-
-static struct cio_listener *tcp_listener_bind(const char *addr)
+static int sendq_push(struct cio_stream *stream, const void *buf, size_t len)
 {
-    int fd = socket(PF_INET, SOCK_STREAM, 0);
-    if (fd == -1)
-        return NULL;
+    struct cio_iovec iov = { (void *)buf, len };
+    return sendq_pushv(stream, &iov, 1, 0);
+}
 
-    uint32_t host;
-    uint16_t port;
-    char *tmp = strdup(addr);
-    char *colon = strchr(tmp, ':');
-    *colon = 0;
-    host = inet_addr(tmp);
-    port = htons(atoi(colon + 1));
-    free(tmp);
+/**
+ * queue the tail of buf from off by reference
+ */
+static int sendq_push_buf(struct cio_stream *stream, struct cio_buf *buf, size_t off)
+{
+    size_t len = cio_buf_len(buf);
+    if (sendq_check(stream, len - off) == -1)
+        return -1;
 
-    int rc = 0;
-    struct sockaddr_in sockaddr = {0};
-    sockaddr.sin_family = PF_INET;
-    sockaddr.sin_addr.s_addr = host;
-    sockaddr.sin_port = port;
+    struct sendq_node *node = malloc(sizeof(*node));
+    if (node == NULL)
+        return -1;
+    node->len = len;
+    node->off = off;
+    node->data = cio_buf_data(buf);
+    node->buf = cio_buf_ref(buf);
+    node->started = off > 0;
+    sendq_add(stream, node);
+    return len;
+}
 
-    rc = bind(fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
-    if (rc == -1) {
-        perror("bind");
-        close(fd);
-        return NULL;
+static void sendq_clear(struct cio_stream *stream)
+{
+    if (stream->deferred) {
+        cio_undefer(stream->ctx, sendq_flush_deferred, stream);
+        stream->deferred = 0;
     }
 
-    rc = listen(fd, 1000);
-    if (rc == -1) {
-        perror("listen");
-        close(fd);
-        return NULL;
+    struct sendq_node *pos, *n;
+    list_for_each_entry_safe(pos, n, &stream->sendq, ln) {
+        list_del(&pos->ln);
+        sendq_node_free(pos);
     }
-
-    return (struct cio_listener *)__cio_stream_new(
-        addr, fd, CIOS_T_LISTEN, &tcp_listener_ops);
+    stream->sendq_len = 0;
 }
 
-#if defined __unix__ || __APPLE__
-
-/**
- * unix_stream
- */
+static void stream_unbind_fn(void *arg);
 
-static struct cio_stream_operations unix_stream_ops = {
-    .drop = __cio_stream_drop,
-    .getfd = __cio_stream_getfd,
-    .send = tcp_stream_send,
-    .recv = tcp_stream_recv,
-    .accept = NULL,
-};
+void cio_stream_drop(struct cio_stream *stream)
+{
+    if (stream->rx_rate.throttled)
+        cio_undefer(stream->ctx, rate_rx_resume, stream);
+    if (stream->tx_rate.throttled)
+        cio_undefer(stream->ctx, rate_tx_resume, stream);
+    if (stream->ctx)
+        cio_undefer_drop(stream->ctx, stream_unbind_fn, stream);
+    sendq_clear(stream);
+    assert(stream->ops->drop);
+    stream->ops->drop(stream);
+}
 
-static struct cio_stream *unix_stream_connect(const char *addr)
+int cio_stream_getfd(struct cio_stream *stream)
 {
-    int fd = socket(PF_UNIX, SOCK_STREAM, 0);
-    if (fd == -1)
-        return NULL;
+    assert(stream->ops->getfd);
+    return stream->ops->getfd(stream);
+}
 
-    int rc = 0;
-    struct sockaddr_un sockaddr = {0};
-    sockaddr.sun_family = PF_UNIX;
-    snprintf(sockaddr.sun_path, sizeof(sockaddr.sun_path), "%s", addr);
+int cio_stream_set_nonblock(struct cio_stream *stream, int on)
+{
+    int fd = cio_stream_getfd(stream);
+#ifndef WIN32
+    int fl = fcntl(fd, F_GETFL);
+    if (fl == -1)
+        return -1;
+    if (!!(fl & O_NONBLOCK) == !!on)
+        return 0;
+    return fcntl(fd, F_SETFL, on ? fl | O_NONBLOCK : fl & ~O_NONBLOCK);
+#else
+    u_long mode = !!on;
+    return ioctlsocket(fd, FIONBIO, &mode) == 0 ? 0 : -1;
+#endif
+}
 
-    rc = connect(fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
-    if (rc == -1) {
-        perror("connect");
-        close(fd);
-        return NULL;
+/**
+ * bytes of len the byte budget of this round of ctx allows
+ */
+static size_t budget_take(struct cio_stream *stream, size_t len)
+{
+    size_t budget = stream->ctx ? cio_get_byte_budget(stream->ctx) : 0;
+    if (budget == 0)
+        return len;
+
+    uint64_t round = cio_get_round(stream->ctx);
+    if (stream->budget_round != round) {
+        stream->budget_round = round;
+        stream->budget_used = 0;
     }
 
-    return __cio_stream_new(addr, fd, CIOS_T_CONNECT, &unix_stream_ops);
+    size_t left = budget > stream->budget_used ? budget - stream->budget_used : 0;
+    return len < left ? len : left;
 }
 
 /**
- * unix_listener
+ * stream_recv_op: the recv op, or a MSG_DONTWAIT recv for zerocopy streams,
+ * only tcp streams take SO_ZEROCOPY
  */
-
-static void unix_listener_drop(struct cio_stream *stream)
+static int stream_recv_op(struct cio_stream *stream, void *buf, size_t len, int dontwait)
 {
-    unlink(stream->addr);
-    __cio_stream_drop(stream);
+#ifndef WIN32
+    if (dontwait)
+        return recv(stream->fd, buf, len, MSG_DONTWAIT);
+#else
+    (void)dontwait;
+#endif
+    return stream->ops->recv(stream, buf, len);
 }
 
-static struct cio_stream_operations unix_listener_ops = {
-    .drop = unix_listener_drop,
-    .getfd = __cio_stream_getfd,
-    .send = NULL,
-    .recv = NULL,
-    .accept = tcp_listener_accept,
-};
-
-static struct cio_listener *unix_listener_bind(const char *addr)
+int cio_stream_recv(struct cio_stream *stream, void *buf, size_t len)
 {
-    int fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (stream->ops->recv == NULL)
+        return -1;
+
+    // completions make the socket readable too, so a readable event may have
+    // no data behind it, don't block then even if the stream is blocking
+    int dontwait = 0;
+    if (stream->zerocopy) {
+        dontwait = stream->zc_done != stream->zc_next;
+        if (cio_stream_reap_zerocopy(stream, NULL) > 0)
+            dontwait = 1;
+    }
+
+    if (stream->ctx == NULL || len == 0)
+        return stream_recv_op(stream, buf, len, dontwait);
+
+    len = budget_take(stream, len);
+    if (len)
+        len = rate_take(stream, &stream->rx_rate, len);
+    if (len == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    int nr = stream_recv_op(stream, buf, len, dontwait);
+    if (nr > 0) {
+        stream->budget_used += nr;
+        if (stream->rx_rate.rate)
+            stream->rx_rate.tokens -= nr;
+    }
+    return nr;
+}
+
+int cio_stream_recv_buf(struct cio_stream *stream, struct cio_bufpool *pool,
+                        struct cio_buf **buf)
+{
+    *buf = bufpool_get(pool);
+    if (*buf == NULL)
+        return -1;
+
+    int nr = cio_stream_recv(stream, (*buf)->data, bufpool_buf_size(pool));
+    if (nr <= 0) {
+        // keep errno of the recv
+        int err = errno;
+        cio_buf_unref(*buf);
+        *buf = NULL;
+        errno = err;
+        return nr;
+    }
+
+    (*buf)->len = nr;
+    return nr;
+}
+
+/**
+ * send what the socket takes now of iov and queue the rest on ctx, as one
+ * message
+ */
+static int stream_sendv_or_queue(struct cio_stream *stream, struct cio *ctx,
+                                 const struct cio_iovec *iov, int iovcnt)
+{
+    if (stream->ctx == NULL && ctx)
+        cio_stream_bind(stream, ctx);
+    assert(stream->ctx == ctx);
+
+    if (stream->corked || stream->sendq_len)
+        return sendq_pushv(stream, iov, iovcnt, 0);
+
+    // the iov beyond SENDQ_IOV_MAX is queued with the tail
+    struct iovec vec[SENDQ_IOV_MAX];
+    int cnt = iovcnt < SENDQ_IOV_MAX ? iovcnt : SENDQ_IOV_MAX;
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (i < cnt) {
+            vec[i].iov_base = iov[i].base;
+            vec[i].iov_len = iov[i].len;
+        }
+        len += iov[i].len;
+    }
+
+    int nr = stream_sendv(stream, vec, cnt, MSG_DONTWAIT);
+    if (nr < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            return -1;
+        nr = 0;
+    }
+
+    if ((size_t)nr < len && sendq_pushv(stream, iov, iovcnt, nr) == -1)
+        return -1;
+    return len;
+}
+
+static int stream_send_or_queue(
+    struct cio_stream *stream, struct cio *ctx, const void *buf, size_t len)
+{
+    struct cio_iovec iov = { (void *)buf, len };
+    return stream_sendv_or_queue(stream, ctx, &iov, 1);
+}
+
+int cio_stream_send(struct cio_stream *stream, const void *buf, size_t len)
+{
+    // a bounded queue also takes what the socket can't
+    if (stream->sendq_limit)
+        return stream_send_or_queue(stream, stream->ctx, buf, len);
+
+    // keep the order, queue it if anything is queued before
+    if (stream->corked || stream->sendq_len)
+        return sendq_push(stream, buf, len);
+
+    if (stream->tx_rate.rate) {
+        struct iovec iov = { (void *)buf, len };
+        return stream_sendv(stream, &iov, 1, 0);
+    }
+
+    if (stream->ops->send) {
+        return stream->ops->send(stream, buf, len);
+    } else {
+        return -1;
+    }
+}
+
+int cio_stream_sendv(struct cio_stream *stream, const struct cio_iovec *iov, int iovcnt)
+{
+    if (stream->ops->send == NULL)
+        return -1;
+
+    // one message to a bounded queue, like cio_stream_send
+    if (stream->sendq_limit)
+        return stream_sendv_or_queue(stream, stream->ctx, iov, iovcnt);
+
+    if (stream->corked || stream->sendq_len)
+        return sendq_pushv(stream, iov, iovcnt, 0);
+
+    // more than SENDQ_IOV_MAX is a partial send as of a full socket
+    struct iovec vec[SENDQ_IOV_MAX];
+    if (iovcnt > SENDQ_IOV_MAX)
+        iovcnt = SENDQ_IOV_MAX;
+    for (int i = 0; i < iovcnt; i++) {
+        vec[i].iov_base = iov[i].base;
+        vec[i].iov_len = iov[i].len;
+    }
+    return stream_sendv(stream, vec, iovcnt, 0);
+}
+
+static int sendfile_copy(struct cio_stream *stream, int in_fd, int64_t *offset,
+                         size_t count)
+{
+#ifndef WIN32
+    uint8_t buf[SENDFILE_CHUNK];
+    ssize_t nr = pread(in_fd, buf, count < sizeof(buf) ? count : sizeof(buf), *offset);
+    if (nr <= 0)
+        return nr;
+
+    int sent = cio_stream_send(stream, buf, nr);
+    if (sent > 0)
+        *offset += sent;
+    return sent;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int cio_stream_sendfile(struct cio_stream *stream, int in_fd, int64_t *offset,
+                        size_t count)
+{
+    // queued or throttled data goes through the copying path to keep order
+    if (stream->ops->sendfile && !stream->corked && !stream->sendq_len &&
+        !stream->tx_rate.rate)
+        return stream->ops->sendfile(stream, in_fd, offset, count);
+
+    return sendfile_copy(stream, in_fd, offset, count);
+}
+
+/**
+ * cio_drop of the bound ctx, timers and defers armed there are gone with it
+ */
+static void stream_unbind_fn(void *arg)
+{
+    struct cio_stream *stream = arg;
+    stream->deferred = 0;
+    stream->rx_rate.throttled = 0;
+    stream->tx_rate.throttled = 0;
+    stream->ctx = NULL;
+}
+
+/**
+ * re-arm on the new ctx what was armed on the old one
+ */
+static void stream_attach_fn(struct cio *ctx, void *arg)
+{
+    struct cio_stream *stream = arg;
+    // ctx is from if the migration bounced
+    stream->ctx = ctx;
+
+    cio_defer_drop(ctx, stream_unbind_fn, stream);
+    if (stream->rx_rate.throttled)
+        cio_defer_after(ctx, RATE_RESUME_MSEC * 1000, rate_rx_resume, stream);
+    if (stream->tx_rate.throttled)
+        cio_defer_after(ctx, RATE_RESUME_MSEC * 1000, rate_tx_resume, stream);
+    if (stream->sendq_len && !stream->deferred) {
+        if (cio_defer(ctx, sendq_flush_deferred, stream) == 0)
+            stream->deferred = 1;
+    }
+}
+
+int cio_stream_bind(struct cio_stream *stream, struct cio *ctx)
+{
+    assert(ctx);
+    if (stream->ctx)
+        return stream->ctx == ctx ? 0 : -1;
+    if (stream->type == CIOS_T_LISTEN)
+        return -1;
+
+    stream->ctx = ctx;
+    stream_attach_fn(ctx, stream);
+    return 0;
+}
+
+static void stream_detach(struct cio_stream *stream, struct cio *ctx)
+{
+    cio_undefer_drop(ctx, stream_unbind_fn, stream);
+    if (stream->rx_rate.throttled)
+        cio_undefer(ctx, rate_rx_resume, stream);
+    if (stream->tx_rate.throttled)
+        cio_undefer(ctx, rate_tx_resume, stream);
+    if (stream->deferred) {
+        cio_undefer(ctx, sendq_flush_deferred, stream);
+        stream->deferred = 0;
+    }
+}
+
+int cio_stream_migrate(struct cio_stream *stream, struct cio *from, struct cio *to)
+{
+    if (stream->ctx == NULL)
+        return cio_migrate(from, cio_stream_getfd(stream), to, NULL, NULL);
+    if (stream->ctx != from)
+        return -1;
+
+    // published to the thread of to by cio_submit
+    stream_detach(stream, from);
+    stream->ctx = to;
+    if (cio_migrate(from, cio_stream_getfd(stream), to, stream_attach_fn, stream) == -1) {
+        stream->ctx = from;
+        stream_attach_fn(from, stream);
+        return -1;
+    }
+    return 0;
+}
+
+int cio_stream_cork(struct cio_stream *stream, struct cio *ctx)
+{
+    if (cio_stream_bind(stream, ctx) == -1)
+        return -1;
+
+    stream->corked = 1;
+    return 0;
+}
+
+int cio_stream_set_sendq(struct cio_stream *stream, struct cio *ctx,
+                         size_t limit, size_t low_watermark, int policy)
+{
+    if (limit && low_watermark >= limit)
+        return -1;
+    if (cio_stream_bind(stream, ctx) == -1)
+        return -1;
+
+    stream->sendq_limit = limit;
+    stream->sendq_low = low_watermark;
+    stream->sendq_policy = policy;
+    return 0;
+}
+
+static void rate_set(struct rate *r, uint64_t rate, uint64_t burst)
+{
+    r->rate = rate;
+    r->burst = burst ? burst : rate;
+    r->tokens = r->burst;
+    r->ts = stream_now();
+}
+
+int cio_stream_set_rate(struct cio_stream *stream, struct cio *ctx,
+                        uint64_t rx_rate, uint64_t tx_rate, uint64_t burst)
+{
+    if (cio_stream_bind(stream, ctx) == -1)
+        return -1;
+
+    rate_set(&stream->rx_rate, rx_rate, burst);
+    rate_set(&stream->tx_rate, tx_rate, burst);
+
+    // lifting a limit re-arms the fd at once
+    if (rx_rate == 0 && stream->rx_rate.throttled) {
+        cio_undefer(ctx, rate_rx_resume, stream);
+        rate_rx_resume(stream);
+    }
+    if (tx_rate == 0 && stream->tx_rate.throttled) {
+        cio_undefer(ctx, rate_tx_resume, stream);
+        rate_tx_resume(stream);
+    }
+    return 0;
+}
+
+int cio_stream_uncork(struct cio_stream *stream)
+{
+    stream->corked = 0;
+    return cio_stream_flush(stream);
+}
+
+int cio_stream_flush(struct cio_stream *stream)
+{
+    if (stream->sendq_err) {
+        errno = stream->sendq_err;
+        return -1;
+    }
+
+    return sendq_flush(stream);
+}
+
+int cio_broadcast(struct cio *ctx, struct cio_stream **streams, int n,
+                  struct cio_buf *buf)
+{
+    const uint8_t *data = cio_buf_data(buf);
+    size_t len = cio_buf_len(buf);
+    int nr_ok = 0;
+
+    for (int i = 0; i < n; i++) {
+        struct cio_stream *stream = streams[i];
+        if (stream->ctx == NULL)
+            cio_stream_bind(stream, ctx);
+        assert(stream->ctx == ctx);
+
+        size_t off = 0;
+        if (!stream->corked && !stream->sendq_len && !stream->sendq_err) {
+            struct iovec iov = { (void *)data, len };
+            int nr = stream_sendv(stream, &iov, 1, MSG_DONTWAIT);
+            if (nr < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    continue;
+                nr = 0;
+            }
+            off = nr;
+        }
+
+        if (off == len || sendq_push_buf(stream, buf, off) != -1)
+            nr_ok++;
+    }
+
+    return nr_ok;
+}
+
+struct submit_send {
+    struct cio_stream *stream;
+    size_t len;
+    uint8_t data[];
+};
+
+static void submit_send_fn(struct cio *ctx, void *arg)
+{
+    struct submit_send *ss = arg;
+    stream_send_or_queue(ss->stream, ctx, ss->data, ss->len);
+    free(ss);
+}
+
+int cio_stream_submit_send(
+    struct cio *ctx, struct cio_stream *stream, const void *buf, size_t len)
+{
+    struct submit_send *ss = malloc(sizeof(*ss) + len);
+    if (ss == NULL)
+        return -1;
+    ss->stream = stream;
+    ss->len = len;
+    memcpy(ss->data, buf, len);
+
+    if (cio_submit(ctx, submit_send_fn, ss) == -1) {
+        free(ss);
+        return -1;
+    }
+    return 0;
+}
+
+static void submit_close_fn(struct cio *ctx, void *arg)
+{
+    struct cio_stream *stream = arg;
+    cio_unregister(ctx, cio_stream_getfd(stream));
+    cio_stream_drop(stream);
+}
+
+int cio_stream_submit_close(struct cio *ctx, struct cio_stream *stream)
+{
+    return cio_submit(ctx, submit_close_fn, stream);
+}
+
+void cio_listener_drop(struct cio_listener *listener)
+{
+    cio_stream_drop((struct cio_stream *)listener);
+}
+
+int cio_listener_getfd(struct cio_listener *listener)
+{
+    return cio_stream_getfd((struct cio_stream *)listener);
+}
+
+int cio_listener_set_nonblock(struct cio_listener *listener, int on)
+{
+    return cio_stream_set_nonblock((struct cio_stream *)listener, on);
+}
+
+struct cio_stream *cio_listener_accept(struct cio_listener *listener)
+{
+    struct cio_stream *stream = (struct cio_stream *)listener;
+    if(stream->ops->accept)
+        return stream->ops->accept(listener);
+    else
+        return NULL;
+}
+
+static struct cio_stream *__cio_stream_alloc(
+    size_t size, const char *addr, int fd, int type,
+    const struct cio_stream_operations *ops)
+{
+    assert(size >= sizeof(struct cio_stream));
+    struct cio_stream *stream = malloc(size);
+    memset(stream, 0, size);
+
+    stream->fd = fd;
+    stream->addr = strdup(addr);
+    stream->type = type;
+    stream->ops = ops;
+    INIT_LIST_HEAD(&stream->sendq);
+
+    return stream;
+}
+
+static struct cio_stream *__cio_stream_new(
+    const char *addr, int fd, int type, const struct cio_stream_operations *ops)
+{
+    return __cio_stream_alloc(sizeof(struct cio_stream), addr, fd, type, ops);
+}
+
+static void __cio_stream_drop(struct cio_stream *stream)
+{
+    close(stream->fd);
+    free(stream->addr);
+    free(stream);
+}
+
+static int __cio_stream_getfd(struct cio_stream *stream)
+{
+    return stream->fd;
+}
+
+/**
+ * tcp_stream
+ */
+
+static int tcp_stream_recv(struct cio_stream *stream, void *buf, size_t len)
+{
+    assert(stream->type != CIOS_T_LISTEN);
+    return recv(stream->fd, buf, len, 0);
+}
+
+static int tcp_stream_send(struct cio_stream *stream, const void *buf, size_t len)
+{
+    assert(stream->type != CIOS_T_LISTEN);
+    return send(stream->fd, buf, len, MSG_NOSIGNAL);
+}
+
+#ifndef WIN32
+static int tcp_stream_sendv(struct cio_stream *stream, const struct iovec *iov,
+                            int iovcnt, int flags)
+{
+    assert(stream->type != CIOS_T_LISTEN);
+    struct msghdr msg = {0};
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+    return sendmsg(stream->fd, &msg, flags | MSG_NOSIGNAL);
+}
+#else
+#define tcp_stream_sendv NULL
+#endif
+
+#ifdef __linux__
+static int tcp_stream_sendfile(struct cio_stream *stream, int in_fd,
+                               int64_t *offset, size_t count)
+{
+    off_t off = *offset;
+    ssize_t nr = sendfile(stream->fd, in_fd, &off, count);
+    if (nr > 0)
+        *offset = off;
+    return nr;
+}
+#else
+#define tcp_stream_sendfile NULL
+#endif
+
+static struct cio_stream_operations tcp_stream_ops = {
+    .drop = __cio_stream_drop,
+    .getfd = __cio_stream_getfd,
+    .send = tcp_stream_send,
+    .sendv = tcp_stream_sendv,
+    .recv = tcp_stream_recv,
+    .accept = NULL,
+    .sendfile = tcp_stream_sendfile,
+};
+
+#if defined CIO_TLS && defined __unix__
+static struct cio_stream_operations tls_stream_ops;
+#endif
+
+/**
+ * stream_is_tls: tls streams are tcp streams underneath, socket options of
+ * tcp apply to them as well
+ */
+static int stream_is_tls(struct cio_stream *stream)
+{
+#if defined CIO_TLS && defined __unix__
+    return stream->ops == &tls_stream_ops;
+#else
+    (void)stream;
+    return 0;
+#endif
+}
+
+int cio_stream_set_keepalive(
+    struct cio_stream *stream, int idle_sec, int intvl_sec, int cnt)
+{
+    if (stream->ops != &tcp_stream_ops && !stream_is_tls(stream)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int on = idle_sec > 0;
+    if (setsockopt(stream->fd, SOL_SOCKET, SO_KEEPALIVE,
+                   (const char *)&on, sizeof(on)) == -1)
+        return -1;
+    if (!on)
+        return 0;
+
+#ifdef TCP_KEEPIDLE
+    if (setsockopt(stream->fd, IPPROTO_TCP, TCP_KEEPIDLE,
+                   (const char *)&idle_sec, sizeof(idle_sec)) == -1)
+        return -1;
+#endif
+#ifdef TCP_KEEPINTVL
+    if (intvl_sec > 0 && setsockopt(stream->fd, IPPROTO_TCP, TCP_KEEPINTVL,
+                                    (const char *)&intvl_sec, sizeof(intvl_sec)) == -1)
+        return -1;
+#endif
+#ifdef TCP_KEEPCNT
+    if (cnt > 0 && setsockopt(stream->fd, IPPROTO_TCP, TCP_KEEPCNT,
+                              (const char *)&cnt, sizeof(cnt)) == -1)
+        return -1;
+#endif
+    (void)intvl_sec;
+    (void)cnt;
+    return 0;
+}
+
+int cio_stream_set_zerocopy(struct cio_stream *stream, int on)
+{
+#if defined __linux__ && defined SO_ZEROCOPY
+    if (stream->ops != &tcp_stream_ops) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    on = !!on;
+    if (setsockopt(stream->fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == -1)
+        return -1;
+    stream->zerocopy = on;
+    return 0;
+#else
+    (void)stream;
+    (void)on;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+int cio_stream_send_zerocopy(struct cio_stream *stream, const void *buf,
+                             size_t len, uint32_t *id)
+{
+#if defined __linux__ && defined SO_ZEROCOPY
+    if (!stream->zerocopy) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // queued bytes go first, and queuing would copy anyway
+    if (stream->corked || stream->sendq_len) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    struct iovec iov = { (void *)buf, len };
+    int nr = stream_sendv(stream, &iov, 1, MSG_ZEROCOPY);
+    if (nr > 0) {
+        // each successful sendmsg is one id for the kernel
+        if (id)
+            *id = stream->zc_next;
+        stream->zc_next++;
+    }
+    return nr;
+#else
+    (void)buf;
+    (void)len;
+    (void)id;
+    errno = stream->zerocopy ? ENOTSUP : EINVAL;
+    return -1;
+#endif
+}
+
+int cio_stream_reap_zerocopy(struct cio_stream *stream, uint32_t *done)
+{
+    int reaped = 0;
+
+#if defined __linux__ && defined SO_ZEROCOPY
+    while (stream->zc_done != stream->zc_next) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct msghdr msg = {0};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(stream->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+
+        struct cmsghdr *cm;
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *serr = (void *)CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0)
+                continue;
+            // sends [ee_info, ee_data] completed, in order on tcp
+            uint32_t nr = serr->ee_data - serr->ee_info + 1;
+            stream->zc_done += nr;
+            reaped += nr;
+        }
+    }
+
+    if (reaped && stream->ctx)
+        cio_post(stream->ctx, stream->fd, CIOF_ZEROCOPY);
+#endif
+
+    if (done)
+        *done = stream->zc_done;
+    return reaped;
+}
+
+int cio_stream_get_incoming_cpu(struct cio_stream *stream)
+{
+#ifdef SO_INCOMING_CPU
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(cio_stream_getfd(stream), SOL_SOCKET, SO_INCOMING_CPU,
+                   &cpu, &len) == -1)
+        return -1;
+    return cpu;
+#else
+    (void)stream;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+int cio_stream_set_busy_poll(struct cio_stream *stream, int usec)
+{
+#ifdef SO_BUSY_POLL
+    return setsockopt(cio_stream_getfd(stream), SOL_SOCKET, SO_BUSY_POLL,
+                      (const char *)&usec, sizeof(usec));
+#else
+    (void)stream;
+    (void)usec;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+static int tcp_connect_fd(const char *addr)
+{
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+
+    uint32_t host;
+    uint16_t port;
+    char *tmp = strdup(addr);
+    char *colon = strchr(tmp, ':');
+    *colon = 0;
+    host = inet_addr(tmp);
+    port = htons(atoi(colon + 1));
+    free(tmp);
+
+    int rc = 0;
+    struct sockaddr_in sockaddr = {0};
+    sockaddr.sin_family = PF_INET;
+    sockaddr.sin_addr.s_addr = host;
+    sockaddr.sin_port = port;
+
+    rc = connect(fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
+    if (rc == -1) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static struct cio_stream *tcp_stream_connect(const char *addr)
+{
+    int fd = tcp_connect_fd(addr);
+    if (fd == -1)
+        return NULL;
+
+    return __cio_stream_new(addr, fd, CIOS_T_CONNECT, &tcp_stream_ops);
+}
+
+/**
+ * tcp_listener
+ */
+
+struct cio_stream *tcp_listener_accept(struct cio_listener *listener)
+{
+    struct cio_stream *stream = (struct cio_stream *)listener;;
+    int fd = accept(stream->fd, NULL, NULL);
+    if (fd == -1) {
+        // the end of a batch on a nonblocking listener
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("accept");
+        return NULL;
+    }
+
+    return __cio_stream_new(stream->addr, fd, CIOS_T_ACCEPT, &tcp_stream_ops);
+}
+
+static struct cio_stream_operations tcp_listener_ops = {
+    .drop = __cio_stream_drop,
+    .getfd = __cio_stream_getfd,
+    .send = NULL,
+    .sendv = NULL,
+    .recv = NULL,
+    .accept = tcp_listener_accept,
+};
+
+static int tcp_listen_fd(const char *addr)
+{
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+
+    uint32_t host;
+    uint16_t port;
+    char *tmp = strdup(addr);
+    char *colon = strchr(tmp, ':');
+    *colon = 0;
+    host = inet_addr(tmp);
+    port = htons(atoi(colon + 1));
+    free(tmp);
+
+    int rc = 0;
+    struct sockaddr_in sockaddr = {0};
+    sockaddr.sin_family = PF_INET;
+    sockaddr.sin_addr.s_addr = host;
+    sockaddr.sin_port = port;
+
+    rc = bind(fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
+    if (rc == -1) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+
+    rc = listen(fd, 1000);
+    if (rc == -1) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static struct cio_listener *tcp_listener_bind(const char *addr)
+{
+    int fd = tcp_listen_fd(addr);
+    if (fd == -1)
+        return NULL;
+
+    return (struct cio_listener *)__cio_stream_new(
+        addr, fd, CIOS_T_LISTEN, &tcp_listener_ops);
+}
+
+#if defined __unix__ || __APPLE__
+
+/**
+ * unix_stream
+ */
+
+static struct cio_stream_operations unix_stream_ops = {
+    .drop = __cio_stream_drop,
+    .getfd = __cio_stream_getfd,
+    .send = tcp_stream_send,
+    .sendv = tcp_stream_sendv,
+    .recv = tcp_stream_recv,
+    .accept = NULL,
+    .sendfile = tcp_stream_sendfile,
+};
+
+static struct cio_stream *unix_stream_connect(const char *addr)
+{
+    int fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return NULL;
+
+    int rc = 0;
+    struct sockaddr_un sockaddr = {0};
+    sockaddr.sun_family = PF_UNIX;
+    snprintf(sockaddr.sun_path, sizeof(sockaddr.sun_path), "%s", addr);
+
+    rc = connect(fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
+    if (rc == -1) {
+        perror("connect");
+        close(fd);
+        return NULL;
+    }
+
+    return __cio_stream_new(addr, fd, CIOS_T_CONNECT, &unix_stream_ops);
+}
+
+/**
+ * unix_listener
+ */
+
+static void unix_listener_drop(struct cio_stream *stream)
+{
+    unlink(stream->addr);
+    __cio_stream_drop(stream);
+}
+
+static struct cio_stream_operations unix_listener_ops = {
+    .drop = unix_listener_drop,
+    .getfd = __cio_stream_getfd,
+    .send = NULL,
+    .sendv = NULL,
+    .recv = NULL,
+    .accept = tcp_listener_accept,
+};
+
+static struct cio_listener *unix_listener_bind(const char *addr)
+{
+    int fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return NULL;
+
+    int rc = 0;
+    struct sockaddr_un sockaddr = {0};
+    sockaddr.sun_family = PF_UNIX;
+    snprintf(sockaddr.sun_path, sizeof(sockaddr.sun_path), "%s", addr);
+
+    unlink(addr);
+
+    rc = bind(fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
+    if (rc == -1) {
+        perror("bind");
+        close(fd);
+        return NULL;
+    }
+
+    rc = listen(fd, 1000);
+    if (rc == -1) {
+        perror("listen");
+        close(fd);
+        return NULL;
+    }
+
+    return (struct cio_listener *)__cio_stream_new(
+        addr, fd, CIOS_T_LISTEN, &unix_listener_ops);
+}
+
+#endif
+
+/**
+ * com_stream
+ */
+
+#if defined __unix__
+
+static int param_get_int(const char *name, int *value, const char *param)
+{
+    char *start, *end;
+
+    assert(name && value);
+    if (!param) return -1;
+
+    start = strstr(param, name);
+    if (!start) return -1;
+
+    start = strchr(start, '=');
+    if (!start) return -1;
+    start++;
+
+    end = strchr(start, ' ');
+    if (!end) end = strchr(start, '\0');
+
+    void *tmp = malloc(end - start + 1);
+    memset(tmp, 0, end - start + 1);
+    memcpy(tmp, start, end - start);
+
+    *value = atoi(tmp);
+    free(tmp);
+    return 0;
+}
+
+static int param_get_string(const char *name, void *buf, size_t size, const char *param)
+{
+    char *start, *end;
+
+    assert(name && buf && size);
+    if (!param) return -1;
+
+    start = strstr(param, name);
+    if (!start) return -1;
+
+    start = strchr(start, '=');
+    if (!start) return -1;
+    start++;
+
+    if (*start == '"') {
+        start++;
+        end = strchr(start, '"');
+        if (!end) return -1;
+    } else {
+        end = strchr(start, ' ');
+        if (!end) end = strchr(start, '\0');
+    }
+
+    memset(buf, 0, size);
+    memcpy(buf, start, size - 1 < (size_t)(end - start) ? size - 1 : (size_t)(end - start));
+    return 0;
+}
+
+static int com_stream_recv(struct cio_stream *stream, void *buf, size_t len)
+{
+    assert(stream->type == CIOS_T_CONNECT);
+    return read(stream->fd, buf, len);
+}
+
+static int com_stream_send(struct cio_stream *stream, const void *buf, size_t len)
+{
+    assert(stream->type == CIOS_T_CONNECT);
+    return write(stream->fd, buf, len);
+}
+
+static int com_stream_sendv(struct cio_stream *stream, const struct iovec *iov,
+                            int iovcnt, int flags)
+{
+    (void)flags;
+    assert(stream->type == CIOS_T_CONNECT);
+    return writev(stream->fd, iov, iovcnt);
+}
+
+static struct cio_stream_operations com_stream_ops = {
+    .drop = __cio_stream_drop,
+    .getfd = __cio_stream_getfd,
+    .send = com_stream_send,
+    .sendv = com_stream_sendv,
+    .recv = com_stream_recv,
+    .accept = NULL,
+};
+
+static struct cio_stream *com_stream_connect(const char *addr)
+{
+    int baud = 9600;
+    int data_bit = 8;
+    int stop_bit = 1;
+    char parity[2] = "n";
+    char com_addr[1024] = {0};
+
+    assert(addr);
+    param_get_int("baud", &baud, addr);
+    param_get_int("data_bit", &data_bit, addr);
+    param_get_int("stop_bit", &stop_bit, addr);
+    param_get_string("parity", parity, sizeof parity, addr);
+    assert(sscanf(addr, "%1023[^?]", com_addr) == 1);
+
+    int fd = open(com_addr, O_RDWR | O_NOCTTY | O_NDELAY);
+    if (fd == -1)
+        return NULL;
+
+    struct termios newtio, oldtio;
+
+    if (tcgetattr(fd, &oldtio) != 0)
+        goto err_out;
+
+    memset(&newtio, 0, sizeof(newtio));
+    newtio.c_cflag |= (CLOCAL | CREAD);
+    newtio.c_cflag &= ~CSIZE;
+
+    if (baud == 110) {
+        cfsetispeed(&newtio, B110);
+    } else if (baud == 300) {
+        cfsetispeed(&newtio, B300);
+    } else if (baud == 600) {
+        cfsetispeed(&newtio, B600);
+    } else if (baud == 1200) {
+        cfsetispeed(&newtio, B1200);
+    } else if (baud == 2400) {
+        cfsetispeed(&newtio, B2400);
+    } else if (baud == 4800) {
+        cfsetispeed(&newtio, B4800);
+    } else if (baud == 9600) {
+        cfsetispeed(&newtio, B9600);
+    } else if (baud == 19200) {
+        cfsetispeed(&newtio, B19200);
+    } else if (baud == 38400) {
+        cfsetispeed(&newtio, B38400);
+    } else if (baud == 57600) {
+        cfsetispeed(&newtio, B57600);
+    } else if (baud == 115200) {
+        cfsetispeed(&newtio, B115200);
+    } else {
+        goto err_out;
+    }
+
+    if (data_bit == 5) {
+        newtio.c_cflag |= CS5;
+    } else if (data_bit == 6) {
+        newtio.c_cflag |= CS6;
+    } else if (data_bit == 7) {
+        newtio.c_cflag |= CS7;
+    } else if (data_bit == 8) {
+        newtio.c_cflag |= CS8;
+    } else {
+        goto err_out;
+    }
+
+    if (parity[0] == 'O') {
+        newtio.c_cflag |= PARENB;
+        newtio.c_cflag |= PARODD;
+        newtio.c_cflag |= (INPCK | ISTRIP);
+    } else if (parity[0] == 'E') {
+        newtio.c_cflag |= PARENB;
+        newtio.c_cflag &= ~PARODD;
+        newtio.c_cflag |= (INPCK | ISTRIP);
+    } else if (parity[0] == 'N') {
+        newtio.c_cflag &= ~PARENB;
+    } else {
+        goto err_out;
+    }
+
+    if (stop_bit == 1) {
+        newtio.c_cflag &= ~CSTOPB;
+    } else if (stop_bit == 2) {
+        newtio.c_cflag |= CSTOPB;
+    } else {
+        goto err_out;
+    }
+
+    /* Raw input */
+    newtio.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
+
+    /*
+     * C_OFLAG      Output options
+     * OPOST        Postprocess output (not set = raw output)
+     * ONLCR        Map NL to CR-NL
+     *
+     * ONCLR ant others needs OPOST to be enabled
+     */
+
+    /* Raw ouput */
+    newtio.c_oflag &= ~OPOST;
+
+    /* Software flow control is disabled */
+    newtio.c_iflag &= ~(IXON | IXOFF | IXANY);
+
+    newtio.c_cc[VTIME] = 0;
+    newtio.c_cc[VMIN] = 0;
+    tcflush(fd, TCIFLUSH);
+
+    if (tcsetattr(fd, TCSANOW, &newtio) != 0)
+        goto err_out;
+
+    return __cio_stream_new(addr, fd, CIOS_T_CONNECT, &com_stream_ops);
+
+err_out:
+    close(fd);
+    return NULL;
+}
+
+#endif
+
+/**
+ * ring: spsc byte ring, head is only written by the consumer and tail is only
+ * written by the producer, both are free running and masked by the size
+ */
+
+#if defined __linux__
+
+struct ring {
+    uint64_t head;
+    uint8_t pad0[56];
+    uint64_t tail;
+    uint8_t pad1[56];
+};
+
+#define ring_data(r) ((uint8_t *)(r) + sizeof(struct ring))
+
+static size_t ring_avail(struct ring *r)
+{
+    return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) -
+        __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * ring_put
+ * @was_empty: set if the consumer had fetched everything before this put,
+ *             so it may be waiting for a wakeup
+ */
+static size_t ring_put(struct ring *r, size_t size, const void *buf, size_t len,
+                       int *was_empty)
+{
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+    // head is written by the peer, a bogus one mustn't take us out of the ring
+    size_t used = (size_t)(tail - head) < size ? (size_t)(tail - head) : size;
+    size_t n = size - used;
+    if (n > len)
+        n = len;
+    if (n == 0) {
+        *was_empty = 0;
+        return 0;
+    }
+
+    size_t off = tail & (size - 1);
+    size_t first = size - off < n ? size - off : n;
+    memcpy(ring_data(r) + off, buf, first);
+    memcpy(ring_data(r), (const uint8_t *)buf + first, n - first);
+    __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+
+    // pairs with the fence in ring_get, one side must see the other's store
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    *was_empty = __atomic_load_n(&r->head, __ATOMIC_RELAXED) == tail;
+    return n;
+}
+
+/**
+ * ring_get
+ * @now_empty: set if nothing is left after this get
+ * @was_full: set if the ring was full before this get, so the producer may
+ *            be waiting for space
+ */
+static size_t ring_get(struct ring *r, size_t size, void *buf, size_t len,
+                       int *now_empty, int *was_full)
+{
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+    size_t n = (size_t)(tail - head);
+    if (n > size)
+        n = size;
+    *was_full = n == size;
+    if (n > len)
+        n = len;
+
+    size_t off = head & (size - 1);
+    size_t first = size - off < n ? size - off : n;
+    memcpy(buf, ring_data(r) + off, first);
+    memcpy((uint8_t *)buf + first, ring_data(r), n - first);
+    __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    *now_empty = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head + n;
+    return n;
+}
+
+static void efd_signal(int efd)
+{
+    uint64_t one = 1;
+    if (write(efd, &one, sizeof(one)) == -1)
+        assert(errno == EAGAIN);
+}
+
+static void efd_clear(int efd)
+{
+    uint64_t cnt;
+    if (read(efd, &cnt, sizeof(cnt)) == -1)
+        assert(errno == EAGAIN);
+}
+
+/**
+ * wakeups of shm streams go through a unix socketpair per side: the rx end is
+ * the fd of the stream and readable while bytes written to the wake end are
+ * queued; while its tx ring is full the rx end stuffs the wake end, which takes
+ * the fd out of writable until the consumer drains the stuffing
+ */
+
+#define WAKE_STUFF_LEN 512
+
+static int wake_pair(int fds[2])
+{
+    if (socketpair(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1)
+        return -1;
+
+    // clamped to the minimum, so a few sends stuff it
+    int size = 1;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    return 0;
+}
+
+static void wake_signal(int fd)
+{
+    char c = 0;
+    if (send(fd, &c, 1, MSG_DONTWAIT | MSG_NOSIGNAL) == -1)
+        assert(errno == EAGAIN || errno == EPIPE);
+}
+
+static void wake_drain(int fd)
+{
+    char buf[WAKE_STUFF_LEN];
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+}
+
+static void wake_stuff(int fd)
+{
+    static const char buf[WAKE_STUFF_LEN];
+    while (send(fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_NOSIGNAL) > 0);
+}
+
+/**
+ * shm_stream: same host streams with a memfd backed ring per direction, the
+ * fd of the stream is readable when its rx ring turns non-empty and writable
+ * while its tx ring has space, see wake_pair; the memfd and both wake pairs
+ * are handed to the peer through a unix socket at addr
+ */
+
+#define SHM_RING_SIZE (1 << 20)
+#define SHM_RING_MAX (1 << 30) /* largest ring_size taken from a peer */
+#define SHM_NR_FDS 5 /* memfd, rx and wake end of side 0, of side 1 */
+#define SHM_MAGIC 0x63696f73 /* cios */
+
+struct shm_hdr {
+    uint32_t magic;
+    uint32_t ring_size;
+    uint32_t closed[2]; /* indexed by side */
+    uint8_t pad[48];
+};
+
+struct shm_stream {
+    struct cio_stream stream;
+    int side; /* 0: accepted, 1: connected */
+    int wake_fd; /* wake end of our rx end, to rearm it and take the stuffing back */
+    int peer_fd; /* wake end of the peer, to wake it and drain its stuffing */
+    void *map;
+    size_t map_len;
+    struct shm_hdr *hdr;
+    struct ring *rx;
+    struct ring *tx;
+    size_t ring_size; /* checked once, the peer may write hdr->ring_size later */
+};
+
+static size_t shm_map_len(size_t ring_size)
+{
+    return sizeof(struct shm_hdr) + 2 * (sizeof(struct ring) + ring_size);
+}
+
+static struct ring *shm_ring(struct shm_hdr *hdr, size_t ring_size, int idx)
+{
+    return (struct ring *)((uint8_t *)hdr + sizeof(struct shm_hdr) +
+                           idx * (sizeof(struct ring) + ring_size));
+}
+
+static int shm_stream_recv(struct cio_stream *stream, void *buf, size_t len)
+{
+    struct shm_stream *shm = (struct shm_stream *)stream;
+    int now_empty, was_full;
+    size_t n = ring_get(shm->rx, shm->ring_size, buf, len, &now_empty, &was_full);
+
+    // the producer may have stuffed its fd after finding the ring full
+    if (n && was_full)
+        wake_drain(shm->peer_fd);
+
+    // clear the wakeup only when drained, then recheck for a racing put
+    if (now_empty) {
+        wake_drain(stream->fd);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (ring_avail(shm->rx))
+            wake_signal(shm->wake_fd);
+    }
+
+    if (n)
+        return n;
+
+    if (__atomic_load_n(&shm->hdr->closed[!shm->side], __ATOMIC_ACQUIRE))
+        return 0;
+
+    // a wakeup may race with a recv which already fetched the data
+    errno = EAGAIN;
+    return -1;
+}
+
+static int shm_stream_send(struct cio_stream *stream, const void *buf, size_t len)
+{
+    struct shm_stream *shm = (struct shm_stream *)stream;
+    if (__atomic_load_n(&shm->hdr->closed[!shm->side], __ATOMIC_ACQUIRE)) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    int was_empty;
+    size_t n = ring_put(shm->tx, shm->ring_size, buf, len, &was_empty);
+    if (n == 0 && len) {
+        // full, stuff the fd out of writable, then recheck for a racing get
+        // which may have drained before the stuffing got there
+        wake_stuff(stream->fd);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (ring_avail(shm->tx) >= shm->ring_size) {
+            errno = EAGAIN;
+            return -1;
+        }
+        wake_drain(shm->wake_fd);
+        n = ring_put(shm->tx, shm->ring_size, buf, len, &was_empty);
+    }
+
+    if (n && was_empty)
+        wake_signal(shm->peer_fd);
+    return n;
+}
+
+/**
+ * shm_close: the peer sees the close by a wakeup, and a writer of the peer
+ * waiting for space by a writable fd
+ */
+static void shm_close(struct shm_stream *shm)
+{
+    __atomic_store_n(&shm->hdr->closed[shm->side], 1, __ATOMIC_RELEASE);
+    wake_signal(shm->peer_fd);
+    wake_drain(shm->peer_fd);
+    close(shm->peer_fd);
+    close(shm->wake_fd);
+}
+
+static void shm_stream_drop(struct cio_stream *stream)
+{
+    struct shm_stream *shm = (struct shm_stream *)stream;
+    shm_close(shm);
+    munmap(shm->map, shm->map_len);
+    __cio_stream_drop(stream);
+}
+
+static struct cio_stream_operations shm_stream_ops = {
+    .drop = shm_stream_drop,
+    .getfd = __cio_stream_getfd,
+    .send = shm_stream_send,
+    .sendv = NULL,
+    .recv = shm_stream_recv,
+    .accept = NULL,
+};
+
+static void close_fds(int *fds, int n)
+{
+    for (int i = 0; i < n; i++) {
+        if (fds[i] != -1)
+            close(fds[i]);
+    }
+}
+
+/**
+ * close_cmsg_fds: fds passed along a message which is not taken
+ */
+static void close_cmsg_fds(struct msghdr *msg)
+{
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < n; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+            close(fd);
+        }
+    }
+}
+
+/**
+ * shm_stream_new: takes fds, ring_size comes from the peer, so it is checked
+ * against the memfd and the header once and never read from the map again
+ * @fds: SHM_NR_FDS, the memfd and the wake pairs of the accepted side and
+ *       of the connected side
+ */
+static struct cio_stream *shm_stream_new(
+    const char *addr, int type, int side, int fds[SHM_NR_FDS], size_t ring_size)
+{
+    size_t map_len = shm_map_len(ring_size);
+    struct stat st;
+    if (ring_size == 0 || (ring_size & (ring_size - 1)) || ring_size > SHM_RING_MAX ||
+        fstat(fds[0], &st) == -1 || (size_t)st.st_size < map_len) {
+        close_fds(fds, SHM_NR_FDS);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    void *map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        close_fds(fds, SHM_NR_FDS);
+        return NULL;
+    }
+
+    struct shm_hdr *hdr = map;
+    if (hdr->magic != SHM_MAGIC || hdr->ring_size != ring_size) {
+        munmap(map, map_len);
+        close_fds(fds, SHM_NR_FDS);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    // the rx end of the peer's pair is the peer's
+    close(fds[0]);
+    close(fds[1 + 2 * !side]);
+    struct shm_stream *shm = (struct shm_stream *)__cio_stream_alloc(
+        sizeof(struct shm_stream), addr, fds[1 + 2 * side], type, &shm_stream_ops);
+    shm->side = side;
+    shm->wake_fd = fds[2 + 2 * side];
+    shm->peer_fd = fds[2 + 2 * !side];
+    shm->map = map;
+    shm->map_len = map_len;
+    shm->hdr = hdr;
+    shm->ring_size = ring_size;
+    shm->rx = shm_ring(hdr, ring_size, side);
+    shm->tx = shm_ring(hdr, ring_size, !side);
+    return &shm->stream;
+}
+
+static struct cio_stream *shm_stream_connect(const char *addr)
+{
+    int fd = socket(PF_UNIX, SOCK_STREAM, 0);
     if (fd == -1)
         return NULL;
 
@@ -309,225 +2038,774 @@ static struct cio_listener *unix_listener_bind(const char *addr)
     sockaddr.sun_family = PF_UNIX;
     snprintf(sockaddr.sun_path, sizeof(sockaddr.sun_path), "%s", addr);
 
-    unlink(addr);
+    rc = connect(fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
+    if (rc == -1) {
+        perror("connect");
+        close(fd);
+        return NULL;
+    }
+
+    uint32_t ring_size = 0;
+    struct iovec iov = { &ring_size, sizeof(ring_size) };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(SHM_NR_FDS * sizeof(int))];
+    } control;
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    // the listener sends the fds once it accepts
+    rc = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    close(fd);
+    if (rc == -1) {
+        perror("recvmsg");
+        return NULL;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (rc != sizeof(ring_size) || (msg.msg_flags & MSG_CTRUNC) || cmsg == NULL ||
+        cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(SHM_NR_FDS * sizeof(int))) {
+        close_cmsg_fds(&msg);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    int fds[SHM_NR_FDS];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    return shm_stream_new(addr, CIOS_T_CONNECT, 1, fds, ring_size);
+}
+
+/**
+ * shm_listener
+ */
+
+static struct cio_stream *shm_listener_accept(struct cio_listener *listener)
+{
+    struct cio_stream *stream = (struct cio_stream *)listener;
+    int fd = accept(stream->fd, NULL, NULL);
+    if (fd == -1) {
+        // the end of a batch on a nonblocking listener
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("accept");
+        return NULL;
+    }
+
+    int fds[SHM_NR_FDS] = {-1, -1, -1, -1, -1};
+    size_t map_len = shm_map_len(SHM_RING_SIZE);
+
+    fds[0] = memfd_create("cio-shm", MFD_CLOEXEC);
+    if (fds[0] == -1 || ftruncate(fds[0], map_len) == -1)
+        goto err_out;
+    if (wake_pair(fds + 1) == -1 || wake_pair(fds + 3) == -1)
+        goto err_out;
+
+    struct shm_hdr *hdr = mmap(NULL, sizeof(*hdr), PROT_READ | PROT_WRITE,
+                               MAP_SHARED, fds[0], 0);
+    if (hdr == MAP_FAILED)
+        goto err_out;
+    hdr->magic = SHM_MAGIC;
+    hdr->ring_size = SHM_RING_SIZE;
+    munmap(hdr, sizeof(*hdr));
+
+    uint32_t ring_size = SHM_RING_SIZE;
+    struct iovec iov = { &ring_size, sizeof(ring_size) };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(ring_size)) {
+        perror("sendmsg");
+        goto err_out;
+    }
+    close(fd);
+
+    return shm_stream_new(stream->addr, CIOS_T_ACCEPT, 0, fds, SHM_RING_SIZE);
+
+err_out:
+    close_fds(fds, SHM_NR_FDS);
+    close(fd);
+    return NULL;
+}
+
+static struct cio_stream_operations shm_listener_ops = {
+    .drop = unix_listener_drop,
+    .getfd = __cio_stream_getfd,
+    .send = NULL,
+    .sendv = NULL,
+    .recv = NULL,
+    .accept = shm_listener_accept,
+};
+
+static struct cio_listener *shm_listener_bind(const char *addr)
+{
+    struct cio_listener *listener = unix_listener_bind(addr);
+    if (listener)
+        ((struct cio_stream *)listener)->ops = &shm_listener_ops;
+    return listener;
+}
+
+/**
+ * mem_stream: in process streams, a shm_stream whose rings are in the heap
+ * and whose peers meet in a registry of listeners by name instead of a unix
+ * socket, so send and recv are memcpy plus a socket write on wakeups
+ */
+
+#define MEM_RING_SIZE (256 * 1024)
+
+struct mem_hdr {
+    int refcnt; /* one per side */
+    uint8_t pad[60];
+};
+
+struct mem_stream {
+    struct shm_stream shm;
+    struct list_head ln; /* backlog of the listener until accepted */
+};
+
+struct mem_listener {
+    struct cio_stream stream;
+    struct list_head ln; /* mem_listeners */
+    struct list_head backlog;
+};
+
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(mem_listeners);
+
+static void mem_stream_drop(struct cio_stream *stream)
+{
+    struct shm_stream *shm = (struct shm_stream *)stream;
+    shm_close(shm);
+    struct mem_hdr *hdr = shm->map;
+    if (__atomic_sub_fetch(&hdr->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+        free(shm->map);
+    __cio_stream_drop(stream);
+}
+
+static struct cio_stream_operations mem_stream_ops = {
+    .drop = mem_stream_drop,
+    .getfd = __cio_stream_getfd,
+    .send = shm_stream_send,
+    .sendv = NULL,
+    .recv = shm_stream_recv,
+    .accept = NULL,
+};
+
+static struct mem_stream *mem_stream_new(const char *addr, int type, int side,
+                                         void *map, int fds[3])
+{
+    struct mem_stream *mem = (struct mem_stream *)__cio_stream_alloc(
+        sizeof(struct mem_stream), addr, fds[0], type, &mem_stream_ops);
+    struct shm_stream *shm = &mem->shm;
+    shm->side = side;
+    shm->wake_fd = fds[1];
+    shm->peer_fd = fds[2];
+    shm->map = map;
+    shm->map_len = 0;
+    shm->hdr = (struct shm_hdr *)((uint8_t *)map + sizeof(struct mem_hdr));
+    shm->ring_size = MEM_RING_SIZE;
+    shm->rx = shm_ring(shm->hdr, MEM_RING_SIZE, side);
+    shm->tx = shm_ring(shm->hdr, MEM_RING_SIZE, !side);
+    INIT_LIST_HEAD(&mem->ln);
+    return mem;
+}
+
+/**
+ * mem_pair: both ends of a connection, each side owns its wake pair and a dup
+ * of the peer's wake end, as shm streams do with the fds passed over the socket
+ */
+static int mem_pair(const char *addr, struct mem_stream *pair[2])
+{
+    int fds[6] = {-1, -1, -1, -1, -1, -1};
+    size_t map_len = sizeof(struct mem_hdr) + shm_map_len(MEM_RING_SIZE);
+    void *map = aligned_alloc(64, map_len);
+    if (map == NULL)
+        return -1;
+    memset(map, 0, sizeof(struct mem_hdr) + sizeof(struct shm_hdr));
+    ((struct mem_hdr *)map)->refcnt = 2;
+    struct shm_hdr *hdr = (struct shm_hdr *)((uint8_t *)map + sizeof(struct mem_hdr));
+    hdr->magic = SHM_MAGIC;
+    hdr->ring_size = MEM_RING_SIZE;
+    memset(shm_ring(hdr, MEM_RING_SIZE, 0), 0, sizeof(struct ring));
+    memset(shm_ring(hdr, MEM_RING_SIZE, 1), 0, sizeof(struct ring));
+
+    // rx and wake end of each side, then a dup of the wake end for the peer
+    if (wake_pair(fds) == -1 || wake_pair(fds + 2) == -1)
+        goto err_out;
+    fds[4] = fcntl(fds[1], F_DUPFD_CLOEXEC, 0);
+    fds[5] = fcntl(fds[3], F_DUPFD_CLOEXEC, 0);
+    if (fds[4] == -1 || fds[5] == -1)
+        goto err_out;
+
+    int accepted[3] = { fds[0], fds[1], fds[5] };
+    int connected[3] = { fds[2], fds[3], fds[4] };
+    pair[0] = mem_stream_new(addr, CIOS_T_ACCEPT, 0, map, accepted);
+    pair[1] = mem_stream_new(addr, CIOS_T_CONNECT, 1, map, connected);
+    return 0;
+
+err_out:
+    perror("socketpair");
+    close_fds(fds, 6);
+    free(map);
+    return -1;
+}
+
+static struct mem_listener *mem_listener_find(const char *addr)
+{
+    struct mem_listener *pos;
+    list_for_each_entry(pos, &mem_listeners, ln) {
+        if (strcmp(pos->stream.addr, addr) == 0)
+            return pos;
+    }
+    return NULL;
+}
+
+static struct cio_stream *mem_stream_connect(const char *addr)
+{
+    pthread_mutex_lock(&mem_lock);
+    struct mem_listener *listener = mem_listener_find(addr);
+    if (listener == NULL) {
+        pthread_mutex_unlock(&mem_lock);
+        errno = ECONNREFUSED;
+        return NULL;
+    }
+
+    struct mem_stream *pair[2];
+    if (mem_pair(addr, pair) == -1) {
+        pthread_mutex_unlock(&mem_lock);
+        return NULL;
+    }
+    if (list_empty(&listener->backlog))
+        efd_signal(listener->stream.fd);
+    list_add_tail(&pair[0]->ln, &listener->backlog);
+    pthread_mutex_unlock(&mem_lock);
+
+    return &pair[1]->shm.stream;
+}
+
+/**
+ * mem_listener: the fd is an eventfd readable as long as the backlog is not
+ * empty, accept blocks on it unless the listener is nonblocking
+ */
+
+static struct cio_stream *mem_listener_accept(struct cio_listener *listener)
+{
+    struct mem_listener *ml = (struct mem_listener *)listener;
+    for (;;) {
+        struct mem_stream *mem = NULL;
+        pthread_mutex_lock(&mem_lock);
+        if (!list_empty(&ml->backlog)) {
+            mem = list_first_entry(&ml->backlog, struct mem_stream, ln);
+            list_del_init(&mem->ln);
+            if (list_empty(&ml->backlog))
+                efd_clear(ml->stream.fd);
+        }
+        pthread_mutex_unlock(&mem_lock);
+        if (mem)
+            return &mem->shm.stream;
+
+        if (fcntl(ml->stream.fd, F_GETFL) & O_NONBLOCK) {
+            errno = EAGAIN;
+            return NULL;
+        }
+        struct pollfd pfd = { ml->stream.fd, POLLIN, 0 };
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            perror("poll");
+            return NULL;
+        }
+    }
+}
+
+static void mem_listener_drop(struct cio_stream *stream)
+{
+    struct mem_listener *ml = (struct mem_listener *)stream;
+    pthread_mutex_lock(&mem_lock);
+    list_del(&ml->ln);
+    pthread_mutex_unlock(&mem_lock);
+
+    // connected peers see the close of streams never accepted
+    struct mem_stream *pos, *n;
+    list_for_each_entry_safe(pos, n, &ml->backlog, ln) {
+        list_del(&pos->ln);
+        cio_stream_drop(&pos->shm.stream);
+    }
+    __cio_stream_drop(stream);
+}
+
+static struct cio_stream_operations mem_listener_ops = {
+    .drop = mem_listener_drop,
+    .getfd = __cio_stream_getfd,
+    .send = NULL,
+    .sendv = NULL,
+    .recv = NULL,
+    .accept = mem_listener_accept,
+};
+
+static struct cio_listener *mem_listener_bind(const char *addr)
+{
+    int fd = eventfd(0, EFD_CLOEXEC);
+    if (fd == -1) {
+        perror("eventfd");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&mem_lock);
+    if (mem_listener_find(addr)) {
+        pthread_mutex_unlock(&mem_lock);
+        close(fd);
+        errno = EADDRINUSE;
+        return NULL;
+    }
+    struct mem_listener *ml = (struct mem_listener *)__cio_stream_alloc(
+        sizeof(struct mem_listener), addr, fd, CIOS_T_LISTEN, &mem_listener_ops);
+    INIT_LIST_HEAD(&ml->backlog);
+    list_add(&ml->ln, &mem_listeners);
+    pthread_mutex_unlock(&mem_lock);
+
+    return (struct cio_listener *)&ml->stream;
+}
+
+#endif
+
+/**
+ * tls_stream: tls over tcp, accepted streams are nonblocking and their
+ * handshake is driven by recv and send as the fd turns ready, so a stalled
+ * client never blocks the poller; kTLS is installed by openssl where available
+ */
+
+#if defined CIO_TLS && defined __unix__
+
+struct tls_stream {
+    struct cio_stream stream;
+    SSL_CTX *ssl_ctx; /* listener only */
+    SSL *ssl; /* stream only */
+};
+
+/**
+ * get the value of name from "host:port?name=value&..."
+ */
+static int tls_param(const char *addr, const char *name, char *buf, size_t size)
+{
+    const char *pos = strchr(addr, '?');
+    size_t name_len = strlen(name);
+
+    while (pos) {
+        pos++;
+        if (strncmp(pos, name, name_len) == 0 && pos[name_len] == '=') {
+            const char *start = pos + name_len + 1;
+            size_t len = strcspn(start, "&");
+            if (len >= size)
+                return -1;
+            memcpy(buf, start, len);
+            buf[len] = 0;
+            return 0;
+        }
+        pos = strchr(pos, '&');
+    }
+    return -1;
+}
+
+/**
+ * tls_set_host: the name the server cert must match, host of the param if
+ * given, which also goes out by sni, the ip of addr otherwise
+ */
+static int tls_set_host(SSL *ssl, const char *addr)
+{
+    char host[256];
+    if (tls_param(addr, "host", host, sizeof(host)) == 0) {
+        if (SSL_set1_host(ssl, host) != 1 || SSL_set_tlsext_host_name(ssl, host) != 1)
+            return -1;
+        return 0;
+    }
+
+    size_t len = strcspn(addr, ":?");
+    if (len >= sizeof(host))
+        return -1;
+    memcpy(host, addr, len);
+    host[len] = 0;
+    if (X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host) != 1)
+        return -1;
+    return 0;
+}
 
-    rc = bind(fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
-    if (rc == -1) {
-        perror("bind");
-        close(fd);
-        return NULL;
-    }
+static SSL_CTX *tls_ctx_new(const char *addr, int is_server)
+{
+    char cert[1024], key[1024], ca[1024];
+    int has_cert = tls_param(addr, "cert", cert, sizeof(cert)) == 0;
+    int has_key = tls_param(addr, "key", key, sizeof(key)) == 0;
+    int has_ca = tls_param(addr, "ca", ca, sizeof(ca)) == 0;
 
-    rc = listen(fd, 1000);
-    if (rc == -1) {
-        perror("listen");
-        close(fd);
+    if (is_server && !(has_cert && has_key)) {
+        fprintf(stderr, "tls: cert and key are required to listen\n");
         return NULL;
     }
 
-    return (struct cio_listener *)__cio_stream_new(
-        addr, fd, CIOS_T_LISTEN, &unix_listener_ops);
-}
+    SSL_CTX *ssl_ctx = SSL_CTX_new(is_server ? TLS_server_method() : TLS_client_method());
+    if (ssl_ctx == NULL)
+        return NULL;
 
+    SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                     SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
 #endif
 
-/**
- * com_stream
- */
-
-#if defined __unix__
+    if (has_cert && SSL_CTX_use_certificate_chain_file(ssl_ctx, cert) != 1)
+        goto err_out;
+    if (has_key && SSL_CTX_use_PrivateKey_file(ssl_ctx, key, SSL_FILETYPE_PEM) != 1)
+        goto err_out;
 
-static int param_get_int(const char *name, int *value, const char *param)
-{
-    char *start, *end;
+    // verify the peer against ca, a server then asks clients for certs;
+    // clients always verify the server, against the system cas without ca
+    if (has_ca) {
+        if (SSL_CTX_load_verify_locations(ssl_ctx, ca, NULL) != 1)
+            goto err_out;
+    } else if (!is_server) {
+        if (SSL_CTX_set_default_verify_paths(ssl_ctx) != 1)
+            goto err_out;
+    }
+    if (has_ca || !is_server) {
+        int mode = SSL_VERIFY_PEER;
+        if (is_server)
+            mode |= SSL_VERIFY_FAIL_IF_NO_PEER_CERT;
+        SSL_CTX_set_verify(ssl_ctx, mode, NULL);
+    }
 
-    assert(name && value);
-    if (!param) return -1;
+    return ssl_ctx;
 
-    start = strstr(param, name);
-    if (!start) return -1;
+err_out:
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(ssl_ctx);
+    return NULL;
+}
 
-    start = strchr(start, '=');
-    if (!start) return -1;
-    start++;
+/**
+ * openssl writes by its socket bio, which has no MSG_NOSIGNAL, a custom bio
+ * would lose kTLS, so SIGPIPE is blocked around the calls that may write and
+ * one raised by them is taken before unblocking
+ */
+struct tls_sigpipe {
+    sigset_t old;
+    int pending;
+};
 
-    end = strchr(start, ' ');
-    if (!end) end = strchr(start, '\0');
+static void tls_sigpipe_block(struct tls_sigpipe *sp)
+{
+    sigset_t set, pending;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, &sp->old);
+    sigpending(&pending);
+    sp->pending = sigismember(&pending, SIGPIPE);
+}
 
-    void *tmp = malloc(end - start + 1);
-    memset(tmp, 0, end - start + 1);
-    memcpy(tmp, start, end - start);
+static void tls_sigpipe_restore(struct tls_sigpipe *sp)
+{
+    // one pending before is not ours to take
+    if (!sp->pending) {
+        sigset_t set, pending;
+        sigemptyset(&set);
+        sigaddset(&set, SIGPIPE);
+        sigpending(&pending);
+        if (sigismember(&pending, SIGPIPE)) {
+            int err = errno;
+            struct timespec ts = {0};
+            while (sigtimedwait(&set, NULL, &ts) == -1 && errno == EINTR);
+            errno = err;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &sp->old, NULL);
+}
 
-    *value = atoi(tmp);
-    free(tmp);
-    return 0;
+/**
+ * map the result of SSL_read or SSL_write to the recv/send convention
+ */
+static int tls_result(struct tls_stream *ts, int rc)
+{
+    if (rc > 0)
+        return rc;
+
+    switch (SSL_get_error(ts->ssl, rc)) {
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_SYSCALL:
+        // eof without close_notify
+        if (errno == 0)
+            return 0;
+        return -1;
+    default:
+        ERR_clear_error();
+        errno = EPROTO;
+        return -1;
+    }
 }
 
-static int param_get_string(const char *name, void *buf, size_t size, const char *param)
+/**
+ * tls_handshake: a step of the handshake, the fd may need to turn readable
+ * or writable before the next one
+ * @return: 1 if done, 0 if the peer closed, -1 if error, EAGAIN if not yet
+ */
+static int tls_handshake(struct tls_stream *ts)
 {
-    char *start, *end;
+    if (SSL_is_init_finished(ts->ssl))
+        return 1;
+
+    struct tls_sigpipe sp;
+    tls_sigpipe_block(&sp);
+    errno = 0;
+    int rc = SSL_do_handshake(ts->ssl);
+    tls_sigpipe_restore(&sp);
+    if (rc == 1)
+        return 1;
+    return tls_result(ts, rc);
+}
 
-    assert(name && buf && size);
-    if (!param) return -1;
+static int tls_stream_recv(struct cio_stream *stream, void *buf, size_t len)
+{
+    struct tls_stream *ts = (struct tls_stream *)stream;
+    int rc = tls_handshake(ts);
+    if (rc != 1)
+        return rc;
+
+    // a read may answer a key update
+    struct tls_sigpipe sp;
+    tls_sigpipe_block(&sp);
+    errno = 0;
+    rc = tls_result(ts, SSL_read(ts->ssl, buf, len));
+    tls_sigpipe_restore(&sp);
+
+    // the rest of a record is buffered by openssl, the fd won't turn readable
+    // for it, so bound streams get the event posted, others read until EAGAIN
+    if (rc > 0 && stream->ctx && SSL_pending(ts->ssl) > 0)
+        cio_post(stream->ctx, stream->fd, CIOF_READABLE);
+    return rc;
+}
 
-    start = strstr(param, name);
-    if (!start) return -1;
+static int tls_stream_send(struct cio_stream *stream, const void *buf, size_t len)
+{
+    struct tls_stream *ts = (struct tls_stream *)stream;
+    int rc = tls_handshake(ts);
+    if (rc == 0)
+        errno = EPIPE;
+    if (rc != 1)
+        return -1;
 
-    start = strchr(start, '=');
-    if (!start) return -1;
-    start++;
+    struct tls_sigpipe sp;
+    tls_sigpipe_block(&sp);
+    errno = 0;
+    rc = tls_result(ts, SSL_write(ts->ssl, buf, len));
+    tls_sigpipe_restore(&sp);
 
-    if (*start == '"') {
-        start++;
-        end = strchr(start, '"');
-        if (!end) return -1;
-    } else {
-        end = strchr(start, ' ');
-        if (!end) end = strchr(start, '\0');
+    // 0 is no error to send callers, the peer has closed
+    if (rc == 0) {
+        errno = EPIPE;
+        return -1;
     }
-
-    memset(buf, 0, size);
-    memcpy(buf, start, size - 1 < (size_t)(end - start) ? size - 1 : (size_t)(end - start));
-    return 0;
+    return rc;
 }
 
-static int com_stream_recv(struct cio_stream *stream, void *buf, size_t len)
+static int tls_stream_sendfile(struct cio_stream *stream, int in_fd,
+                               int64_t *offset, size_t count)
 {
-    assert(stream->type == CIOS_T_CONNECT);
-    return read(stream->fd, buf, len);
+    struct tls_stream *ts = (struct tls_stream *)stream;
+    int rc = tls_handshake(ts);
+    if (rc == 0)
+        errno = EPIPE;
+    if (rc != 1)
+        return -1;
+
+#ifdef TLS_KTLS
+    if (BIO_get_ktls_send(SSL_get_wbio(ts->ssl))) {
+        struct tls_sigpipe sp;
+        tls_sigpipe_block(&sp);
+        errno = 0;
+        ossl_ssize_t nr = SSL_sendfile(ts->ssl, in_fd, *offset, count, 0);
+        tls_sigpipe_restore(&sp);
+        if (nr > 0)
+            *offset += nr;
+        else if (errno == 0)
+            errno = EIO;
+        return nr;
+    }
+#else
+    (void)ts;
+#endif
+    return sendfile_copy(stream, in_fd, offset, count);
 }
 
-static int com_stream_send(struct cio_stream *stream, const void *buf, size_t len)
+static void tls_stream_drop(struct cio_stream *stream)
 {
-    assert(stream->type == CIOS_T_CONNECT);
-    return write(stream->fd, buf, len);
+    struct tls_stream *ts = (struct tls_stream *)stream;
+    if (ts->ssl) {
+        // best effort close_notify, never wait for the peer
+        if (SSL_is_init_finished(ts->ssl)) {
+            struct tls_sigpipe sp;
+            tls_sigpipe_block(&sp);
+            SSL_shutdown(ts->ssl);
+            tls_sigpipe_restore(&sp);
+        }
+        SSL_free(ts->ssl);
+    }
+    if (ts->ssl_ctx)
+        SSL_CTX_free(ts->ssl_ctx);
+    __cio_stream_drop(stream);
 }
 
-static struct cio_stream_operations com_stream_ops = {
-    .drop = __cio_stream_drop,
+static struct cio_stream_operations tls_stream_ops = {
+    .drop = tls_stream_drop,
     .getfd = __cio_stream_getfd,
-    .send = com_stream_send,
-    .recv = com_stream_recv,
+    .send = tls_stream_send,
+    .sendv = NULL,
+    .recv = tls_stream_recv,
     .accept = NULL,
+    .sendfile = tls_stream_sendfile,
 };
 
-static struct cio_stream *com_stream_connect(const char *addr)
+static struct tls_stream *tls_stream_new(
+    const char *addr, int fd, int type, SSL_CTX *ssl_ctx)
 {
-    int baud = 9600;
-    int data_bit = 8;
-    int stop_bit = 1;
-    char parity[2] = "n";
-    char com_addr[1024] = {0};
+    SSL *ssl = SSL_new(ssl_ctx);
+    if (ssl == NULL || SSL_set_fd(ssl, fd) != 1) {
+        SSL_free(ssl);
+        close(fd);
+        return NULL;
+    }
 
-    assert(addr);
-    param_get_int("baud", &baud, addr);
-    param_get_int("data_bit", &data_bit, addr);
-    param_get_int("stop_bit", &stop_bit, addr);
-    param_get_string("parity", parity, sizeof parity, addr);
-    assert(sscanf(addr, "%1023[^?]", com_addr) == 1);
+    struct tls_stream *ts = (struct tls_stream *)__cio_stream_alloc(
+        sizeof(struct tls_stream), addr, fd, type, &tls_stream_ops);
+    ts->ssl = ssl;
+    return ts;
+}
 
-    int fd = open(com_addr, O_RDWR | O_NOCTTY | O_NDELAY);
-    if (fd == -1)
+static struct cio_stream *tls_stream_connect(const char *addr)
+{
+    SSL_CTX *ssl_ctx = tls_ctx_new(addr, 0);
+    if (ssl_ctx == NULL)
         return NULL;
 
-    struct termios newtio, oldtio;
-
-    if (tcgetattr(fd, &oldtio) != 0)
-        goto err_out;
+    int fd = tcp_connect_fd(addr);
+    if (fd == -1) {
+        SSL_CTX_free(ssl_ctx);
+        return NULL;
+    }
 
-    memset(&newtio, 0, sizeof(newtio));
-    newtio.c_cflag |= (CLOCAL | CREAD);
-    newtio.c_cflag &= ~CSIZE;
+    // the ssl holds its own reference of ssl_ctx
+    struct tls_stream *ts = tls_stream_new(addr, fd, CIOS_T_CONNECT, ssl_ctx);
+    SSL_CTX_free(ssl_ctx);
+    if (ts == NULL)
+        return NULL;
 
-    if (baud == 110) {
-        cfsetispeed(&newtio, B110);
-    } else if (baud == 300) {
-        cfsetispeed(&newtio, B300);
-    } else if (baud == 600) {
-        cfsetispeed(&newtio, B600);
-    } else if (baud == 1200) {
-        cfsetispeed(&newtio, B1200);
-    } else if (baud == 2400) {
-        cfsetispeed(&newtio, B2400);
-    } else if (baud == 4800) {
-        cfsetispeed(&newtio, B4800);
-    } else if (baud == 9600) {
-        cfsetispeed(&newtio, B9600);
-    } else if (baud == 19200) {
-        cfsetispeed(&newtio, B19200);
-    } else if (baud == 38400) {
-        cfsetispeed(&newtio, B38400);
-    } else if (baud == 57600) {
-        cfsetispeed(&newtio, B57600);
-    } else if (baud == 115200) {
-        cfsetispeed(&newtio, B115200);
-    } else {
-        goto err_out;
+    if (tls_set_host(ts->ssl, addr) == -1) {
+        ERR_print_errors_fp(stderr);
+        tls_stream_drop(&ts->stream);
+        return NULL;
     }
 
-    if (data_bit == 5) {
-        newtio.c_cflag |= CS5;
-    } else if (data_bit == 6) {
-        newtio.c_cflag |= CS6;
-    } else if (data_bit == 7) {
-        newtio.c_cflag |= CS7;
-    } else if (data_bit == 8) {
-        newtio.c_cflag |= CS8;
-    } else {
-        goto err_out;
+    // blocking like tcp connect, kTLS is set up once it's done
+    struct tls_sigpipe sp;
+    tls_sigpipe_block(&sp);
+    int rc = SSL_connect(ts->ssl);
+    tls_sigpipe_restore(&sp);
+    if (rc != 1) {
+        ERR_print_errors_fp(stderr);
+        tls_stream_drop(&ts->stream);
+        return NULL;
     }
+    return &ts->stream;
+}
 
-    if (parity[0] == 'O') {
-        newtio.c_cflag |= PARENB;
-        newtio.c_cflag |= PARODD;
-        newtio.c_cflag |= (INPCK | ISTRIP);
-    } else if (parity[0] == 'E') {
-        newtio.c_cflag |= PARENB;
-        newtio.c_cflag &= ~PARODD;
-        newtio.c_cflag |= (INPCK | ISTRIP);
-    } else if (parity[0] == 'N') {
-        newtio.c_cflag &= ~PARENB;
-    } else {
-        goto err_out;
+static struct cio_stream *tls_listener_accept(struct cio_listener *listener)
+{
+    struct tls_stream *tl = (struct tls_stream *)listener;
+    int fd = accept(tl->stream.fd, NULL, NULL);
+    if (fd == -1) {
+        // the end of a batch on a nonblocking listener
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("accept");
+        return NULL;
     }
 
-    if (stop_bit == 1) {
-        newtio.c_cflag &= ~CSTOPB;
-    } else if (stop_bit == 2) {
-        newtio.c_cflag |= CSTOPB;
-    } else {
-        goto err_out;
+    struct tls_stream *ts = tls_stream_new(tl->stream.addr, fd, CIOS_T_ACCEPT, tl->ssl_ctx);
+    if (ts == NULL)
+        return NULL;
+    if (cio_stream_set_nonblock(&ts->stream, 1) == -1) {
+        tls_stream_drop(&ts->stream);
+        return NULL;
     }
+    SSL_set_accept_state(ts->ssl);
+    return &ts->stream;
+}
 
-    /* Raw input */
-    newtio.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
+static struct cio_stream_operations tls_listener_ops = {
+    .drop = tls_stream_drop,
+    .getfd = __cio_stream_getfd,
+    .send = NULL,
+    .sendv = NULL,
+    .recv = NULL,
+    .accept = tls_listener_accept,
+};
 
-    /*
-     * C_OFLAG      Output options
-     * OPOST        Postprocess output (not set = raw output)
-     * ONLCR        Map NL to CR-NL
-     *
-     * ONCLR ant others needs OPOST to be enabled
-     */
+static struct cio_listener *tls_listener_bind(const char *addr)
+{
+    SSL_CTX *ssl_ctx = tls_ctx_new(addr, 1);
+    if (ssl_ctx == NULL)
+        return NULL;
 
-    /* Raw ouput */
-    newtio.c_oflag &= ~OPOST;
+    int fd = tcp_listen_fd(addr);
+    if (fd == -1) {
+        SSL_CTX_free(ssl_ctx);
+        return NULL;
+    }
 
-    /* Software flow control is disabled */
-    newtio.c_iflag &= ~(IXON | IXOFF | IXANY);
+    struct tls_stream *tl = (struct tls_stream *)__cio_stream_alloc(
+        sizeof(struct tls_stream), addr, fd, CIOS_T_LISTEN, &tls_listener_ops);
+    tl->ssl_ctx = ssl_ctx;
+    return (struct cio_listener *)tl;
+}
 
-    newtio.c_cc[VTIME] = 0;
-    newtio.c_cc[VMIN] = 0;
-    tcflush(fd, TCIFLUSH);
+int cio_stream_get_ktls(struct cio_stream *stream)
+{
+    if (stream->ops != &tls_stream_ops)
+        return -1;
 
-    if (tcsetattr(fd, TCSANOW, &newtio) != 0)
-        goto err_out;
+    int flags = 0;
+#ifdef TLS_KTLS
+    struct tls_stream *ts = (struct tls_stream *)stream;
+    if (BIO_get_ktls_send(SSL_get_wbio(ts->ssl)))
+        flags |= CIO_KTLS_TX;
+    if (BIO_get_ktls_recv(SSL_get_rbio(ts->ssl)))
+        flags |= CIO_KTLS_RX;
+#endif
+    return flags;
+}
 
-    return __cio_stream_new(addr, fd, CIOS_T_CONNECT, &com_stream_ops);
+#else
 
-err_out:
-    close(fd);
-    return NULL;
+int cio_stream_get_ktls(struct cio_stream *stream)
+{
+    (void)stream;
+    return -1;
 }
 
 #endif
@@ -563,6 +2841,22 @@ struct cio_stream *cio_stream_connect(const char *addr)
     }
 #endif
 
+#if defined __linux__
+    if (strstr(addr, "shm://") == addr) {
+        return shm_stream_connect(addr + strlen("shm://"));
+    }
+
+    if (strstr(addr, "mem://") == addr) {
+        return mem_stream_connect(addr + strlen("mem://"));
+    }
+#endif
+
+#if defined CIO_TLS && defined __unix__
+    if (strstr(addr, "tls://") == addr) {
+        return tls_stream_connect(addr + strlen("tls://"));
+    }
+#endif
+
     return NULL;
 }
 
@@ -578,5 +2872,21 @@ struct cio_listener *cio_listener_bind(const char *addr)
     }
 #endif
 
+#if defined __linux__
+    if (strstr(addr, "shm://") == addr) {
+        return shm_listener_bind(addr + strlen("shm://"));
+    }
+
+    if (strstr(addr, "mem://") == addr) {
+        return mem_listener_bind(addr + strlen("mem://"));
+    }
+#endif
+
+#if defined CIO_TLS && defined __unix__
+    if (strstr(addr, "tls://") == addr) {
+        return tls_listener_bind(addr + strlen("tls://"));
+    }
+#endif
+
     return NULL;
 }
@@ -2,19 +2,38 @@
 #define __CIO_STREAM_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+struct cio;
+struct cio_buf;
+struct cio_bufpool;
 struct cio_stream;
 struct cio_listener;
 
+struct cio_iovec {
+    void *base;
+    size_t len;
+};
+
 /**
  * cio_stream_connect
  * @addr: tcp://127.0.0.1:3824
  * @addr: unix:///tmp/cio
  * @addr: unix://./text-cio
+ * @addr: shm:///tmp/cio-shm, same host only, addr is the unix socket to meet,
+ *        blocks until the listener accepts, as the rings come with the accept
+ * @addr: mem://name, same process only, linux, ECONNREFUSED if name is not
+ *        bound, no syscall but a socketpair write on wakeups and when a
+ *        full ring gets room
+ * @addr: tls://127.0.0.1:3824?ca=ca.pem&cert=cert.pem&key=key.pem&host=name,
+ *        built with BUILD_TLS, the server is verified against ca, or the
+ *        system cas without ca, and its cert must match host, which also
+ *        goes out by sni, or the ip without host; cert and key are for
+ *        client auth
  * @addr: com:///dev/ttyUSB0?baud=9600&data_bit=8&stop_bit=1&parity=N
  * @addr: com://COM1?baud=9600&data_bit=8&stop_bit=1&parity=N
  * @baud: 110,300,600,1200,2400,4800,9600(default),19200,38400,57600,115200
@@ -26,19 +45,222 @@ struct cio_stream *cio_stream_connect(const char *addr);
 
 void cio_stream_drop(struct cio_stream *stream);
 int cio_stream_getfd(struct cio_stream *stream);
+
+/**
+ * cio_stream_set_nonblock: recv and send return -1 with errno EAGAIN instead
+ * of blocking, streams are blocking by default
+ */
+int cio_stream_set_nonblock(struct cio_stream *stream, int on);
 int cio_stream_recv(struct cio_stream *stream, void *buf, size_t len);
 int cio_stream_send(struct cio_stream *stream, const void *buf, size_t len);
 
+/**
+ * cio_stream_recv_buf: recv into a buf taken from pool, so idle streams hold
+ * no receive memory; the handler owns *buf and unrefs it when done, it may
+ * also be passed on to cio_broadcast without copying
+ * @buf: set to a buf holding the bytes received, NULL if none
+ * @return: as cio_stream_recv
+ */
+int cio_stream_recv_buf(struct cio_stream *stream, struct cio_bufpool *pool,
+                        struct cio_buf **buf);
+
+/**
+ * cio_stream_sendv: vectored cio_stream_send, one syscall where supported, iov
+ * is one message to the send queue, which CIO_SENDQ_DROP_OLDEST drops whole;
+ * a bounded queue takes what the socket can't, as cio_stream_send
+ * @return: nr bytes sent, -1 if error
+ */
+int cio_stream_sendv(struct cio_stream *stream, const struct cio_iovec *iov, int iovcnt);
+
+/**
+ * cio_stream_set_keepalive: tcp keepalive, so dead peers are found by the
+ * kernel, see cio_set_timeout for idle peers
+ * @idle_sec: idle seconds before probing, 0 to turn keepalive off
+ * @intvl_sec: seconds between probes, 0 for the system default
+ * @cnt: probes before the connection is dropped, 0 for the system default
+ * @return: 0, -1 if error or not a tcp or tls stream
+ */
+int cio_stream_set_keepalive(
+    struct cio_stream *stream, int idle_sec, int intvl_sec, int cnt);
+
+/**
+ * cio_stream_migrate: cio_migrate for streams, the send queue, rate limits and
+ * the binding of cio_stream_bind follow the stream to ctx to; call it on the
+ * thread polling from and leave the stream to the thread of to afterwards
+ * @return: 0, -1 if error or the stream is bound to another ctx
+ */
+int cio_stream_migrate(struct cio_stream *stream, struct cio *from, struct cio *to);
+
+/**
+ * cio_stream_set_zerocopy: SO_ZEROCOPY, needed by cio_stream_send_zerocopy,
+ * tcp streams on linux only; while sends are in flight or just completed,
+ * cio_stream_recv doesn't block and fails with EAGAIN if there is no data
+ * @return: 0, -1 if error or not supported
+ */
+int cio_stream_set_zerocopy(struct cio_stream *stream, int on);
+
+/**
+ * cio_stream_send_zerocopy: MSG_ZEROCOPY send, the kernel pins buf instead of
+ * copying it, so buf must be kept intact until the send completes; pays off
+ * for large bufs only, say 10KB and more
+ * @id: set to the id of this send, ids count up from 0 per stream
+ * @return: nr bytes sent, -1 if error, EAGAIN if the stream is corked or has
+ *          queued bytes, ENOBUFS if the kernel is out of pinned pages
+ */
+int cio_stream_send_zerocopy(struct cio_stream *stream, const void *buf,
+                             size_t len, uint32_t *id);
+
+/**
+ * cio_stream_reap_zerocopy: read completions of zerocopy sends from the error
+ * queue, post a CIOF_ZEROCOPY event if any and the stream is bound by
+ * cio_stream_bind; completions make the socket readable, and
+ * cio_stream_recv reaps them as well
+ * @done: set to nr sends completed, which complete in order, so bufs of sends
+ *        with id < done can be reused
+ * @return: nr sends completed by this call, -1 if error
+ */
+int cio_stream_reap_zerocopy(struct cio_stream *stream, uint32_t *done);
+
+/**
+ * cio_stream_get_incoming_cpu: SO_INCOMING_CPU, the cpu which processed the
+ * last packets of the stream, see CIO_BALANCE_CPU of cio_acceptor
+ * @return: cpu, -1 if unknown or not supported
+ */
+int cio_stream_get_incoming_cpu(struct cio_stream *stream);
+
+/**
+ * cio_stream_set_busy_poll: SO_BUSY_POLL, the driver is polled up to usec
+ * for packets on blocking reads and selects, see cio_set_busy_poll
+ * @usec: 0 to turn it off, raising it may need CAP_NET_ADMIN
+ * @return: 0, -1 if error or not supported
+ */
+int cio_stream_set_busy_poll(struct cio_stream *stream, int usec);
+
+/**
+ * cio_stream_sendfile: send up to count bytes of in_fd from *offset, which is
+ * advanced by the bytes sent, zero-copy by sendfile for tcp, unix and tls
+ * streams with kTLS, other streams and queued sends copy
+ * @return: nr bytes sent, -1 if error
+ */
+int cio_stream_sendfile(struct cio_stream *stream, int in_fd, int64_t *offset,
+                        size_t count);
+
+enum cio_ktls_flag {
+    CIO_KTLS_TX = (1 << 0),
+    CIO_KTLS_RX = (1 << 1),
+};
+
+/**
+ * cio_stream_get_ktls: whether the kernel does the tls records of the stream,
+ * known after the handshake, which recv and send drive on accepted streams
+ * @return: cio_ktls_flag, -1 if not a tls stream
+ */
+int cio_stream_get_ktls(struct cio_stream *stream);
+
+/**
+ * cio_stream_bind: bind the stream to the context polling it, so its queues,
+ * timers and budgets work with ctx, a stream binds to one ctx only; cork,
+ * set_sendq and set_rate bind it too; cio_drop of ctx unbinds the stream,
+ * queued data is kept until it binds to another ctx
+ */
+int cio_stream_bind(struct cio_stream *stream, struct cio *ctx);
+
+/**
+ * cio_stream_cork: queue data of cio_stream_send instead of sending it, all
+ * queued data is flushed with one writev at the beginning of next cio_poll
+ * @ctx: the context polling the stream, a stream can only cork on one ctx
+ */
+int cio_stream_cork(struct cio_stream *stream, struct cio *ctx);
+
+/**
+ * cio_stream_uncork: leave cork mode and flush queued data now, data not
+ * flushed is still sent by cio_poll before any later data
+ * @return: same as cio_stream_flush
+ */
+int cio_stream_uncork(struct cio_stream *stream);
+
+/**
+ * cio_stream_flush: flush queued data without blocking
+ * @return: nr bytes still queued, capped at INT_MAX, -1 if error
+ */
+int cio_stream_flush(struct cio_stream *stream);
+
+enum cio_sendq_policy {
+    CIO_SENDQ_SIGNAL = 0, /* reject with EAGAIN, CIOF_DRAINED when drained */
+    CIO_SENDQ_DROP_OLDEST, /* drop whole queued messages from the head */
+    CIO_SENDQ_DISCONNECT, /* shutdown the stream, sends fail with ENOBUFS */
+};
+
+/**
+ * cio_stream_set_sendq: bound the send queue, cio_stream_send then sends what
+ * the socket takes now and queues the rest, which is flushed by cio_poll of ctx
+ * @limit: max bytes queued, 0 for unbounded, a message always fits an empty
+ *         queue, so the queue may exceed limit by one message
+ * @low_watermark: CIOF_DRAINED is posted to the fd registered in ctx when the
+ *                 queue goes from above it to not above it
+ * @policy: cio_sendq_policy, what a send doesn't fit the limit does
+ */
+int cio_stream_set_sendq(struct cio_stream *stream, struct cio *ctx,
+                         size_t limit, size_t low_watermark, int policy);
+
+/**
+ * cio_stream_set_rate: cap bytes per second with token buckets, recv and send
+ * take no more than the bucket holds, an empty bucket fails them with EAGAIN
+ * and suspends the fd in ctx until it refills, see cio_suspend
+ * @rx_rate: bytes per second of cio_stream_recv, 0 for unlimited
+ * @tx_rate: bytes per second of sends, including the send queue, 0 for unlimited
+ * @burst: bucket size in bytes, 0 for one second worth of the rate
+ */
+int cio_stream_set_rate(struct cio_stream *stream, struct cio *ctx,
+                        uint64_t rx_rate, uint64_t tx_rate, uint64_t burst);
+
+/**
+ * cio_broadcast: send buf to n streams without copying it, each stream sends
+ * what its socket takes now and queues a reference to the rest, which is
+ * flushed by cio_poll of ctx, the caller still owns its reference of buf
+ * @return: nr streams which took buf, a stream fails on error or by the
+ *          policy of its bounded send queue
+ */
+int cio_broadcast(struct cio *ctx, struct cio_stream **streams, int n,
+                  struct cio_buf *buf);
+
+/**
+ * cio_stream_submit_send: thread safe, copy buf and send it on the thread
+ * polling ctx, data the socket can't take at once is queued as by cork
+ */
+int cio_stream_submit_send(
+    struct cio *ctx, struct cio_stream *stream, const void *buf, size_t len);
+
+/**
+ * cio_stream_submit_close: thread safe, unregister the stream from ctx and
+ * drop it on the thread polling ctx
+ */
+int cio_stream_submit_close(struct cio *ctx, struct cio_stream *stream);
+
 /**
  * cio_listener_bind
  * @addr: tcp://127.0.0.1:3824
  * @addr: unix:///tmp/cio
  * @addr: unix://./text-cio
+ * @addr: shm:///tmp/cio-shm
+ * @addr: mem://name, EADDRINUSE if name is bound by another listener
+ * @addr: tls://127.0.0.1:3824?cert=cert.pem&key=key.pem&ca=ca.pem, built with
+ *        BUILD_TLS, cert and key are required, ca requires client certs;
+ *        accepted streams are nonblocking, their recv and send drive the
+ *        handshake and fail with EAGAIN until it is done; a recv leaving the
+ *        rest of a record buffered posts CIOF_READABLE if the stream is bound
+ *        by cio_stream_bind, unbound streams recv until EAGAIN
  */
 struct cio_listener *cio_listener_bind(const char *addr);
 
 void cio_listener_drop(struct cio_listener *listener);
 int cio_listener_getfd(struct cio_listener *listener);
+
+/**
+ * cio_listener_set_nonblock: cio_listener_accept returns NULL with errno
+ * EAGAIN instead of blocking, so pending connections can be accepted in a batch
+ */
+int cio_listener_set_nonblock(struct cio_listener *listener, int on);
 struct cio_stream *cio_listener_accept(struct cio_listener *listener);
 
 #ifdef __cplusplus
@@ -1,20 +1,69 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <unistd.h>
 
 #ifndef WIN32
+#include <fcntl.h>
 #include <sys/select.h>
+#include <sys/time.h>
 #else
 #include <Winsock2.h>
 #endif
 
+#ifdef __linux__
+#include <sched.h>
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 
 #include "cio.h"
 #include "cio-event.h"
 #include "stream.h"
 
+#define LOAD_WINDOW_USEC (100 * 1000)
+
+struct defer {
+    void (*fn)(void *arg); /* NULL if canceled while running */
+    void *arg;
+    struct list_head ln;
+};
+
+struct timer {
+    uint64_t deadline; /* usec */
+    uint64_t seq; /* fifo within the same deadline */
+    int index; /* in the heap, -1 if expired */
+    void (*fn)(void *arg); /* NULL if canceled after expired */
+    void *arg;
+    struct list_head ln; /* expired */
+};
+
+struct submit {
+    void (*fn)(struct cio *ctx, void *arg);
+    void *arg;
+    struct submit *next;
+};
+
+struct submit_register {
+    int fd;
+    int token;
+    int flags;
+    void *wrapper;
+};
+
+struct migrate {
+    struct stream *stream; /* detached from its ctx */
+    struct cio *from; /* NULL once sent back to it */
+    int events; /* cio_flag of events not fetched yet */
+    void (*fn)(struct cio *ctx, void *arg);
+    void *arg;
+};
+
 struct cio {
     fd_set fds_read;
     int nfds_read;
@@ -22,35 +71,210 @@ struct cio {
     int nfds_write;
 
     struct list_head streams;
+    struct stream **fd_table; /* streams indexed by fd */
+    int cap_fd_table;
     struct list_head events;
+    struct list_head defers;
+    struct list_head running; /* defers detached by run_defer */
+    struct list_head drops; /* defers of cio_drop */
+
+    /* min heap by deadline */
+    struct timer **timers;
+    int nr_timers;
+    int cap_timers;
+    uint64_t timer_seq;
+    struct list_head expired;
+
+    /* streams of cio_register_cb with pending events, called in order */
+    struct stream **ready;
+    int nr_ready;
+    int cap_ready;
+    struct list_head zombies; /* released while in ready */
+    int ready_retry; /* streams with pending left out of ready */
+    int stop; /* cio_run */
+
+    /* lock-free stack pushed by any thread, popped by the polling thread */
+    struct submit *submits;
+    int wake_pending;
+    int wake_fds[2];
 
     struct timeval poll_ts;
     unsigned long idle_usec;
+    uint64_t busy_poll_usec; /* spin before sleeping, 0 to always sleep */
+
+    int cpu; /* pinned by cio_set_cpu, -1 if not */
+
+    /* load, read by other threads, see cio_get_load */
+    int nr_fds;
+    uint64_t window_start; /* usec */
+    int window_events;
+    int event_rate; /* events per second of the last window */
+
+    /* per round budgets, a round is one cio_poll */
+    uint64_t round;
+    int round_events;
+    int max_events;
+    size_t max_bytes;
 };
 
-static void add_event(struct cio *ctx, struct stream *stream)
+static int state_flags(union stream_state state);
+static union stream_state flags_state(int events);
+static uint64_t cio_now(void);
+
+/**
+ * queue the stream for its handler, events merge until it is called
+ */
+static void ready_add(struct cio *ctx, struct stream *stream, int events)
+{
+    stream->pending |= events;
+    if (stream->queued)
+        return;
+
+    if (ctx->nr_ready == ctx->cap_ready) {
+        int cap = ctx->cap_ready ? ctx->cap_ready * 2 : 64;
+        struct stream **ready = realloc(ctx->ready, cap * sizeof(*ready));
+        if (ready == NULL) {
+            // run_handlers queues it again
+            ctx->ready_retry = 1;
+            return;
+        }
+        ctx->ready = ready;
+        ctx->cap_ready = cap;
+    }
+    ctx->ready[ctx->nr_ready++] = stream;
+    stream->queued = 1;
+}
+
+/**
+ * a stream leaving ctx, the one queued in ready is freed after the handlers
+ */
+static void stream_release(struct cio *ctx, struct stream *stream)
+{
+    if (stream->queued) {
+        stream->dead = 1;
+        list_add(&stream->ln, &ctx->zombies);
+    } else {
+        stream_drop(stream);
+    }
+}
+
+static struct stream *find_stream(struct cio *ctx, int fd)
+{
+    if (fd < 0 || fd >= ctx->cap_fd_table)
+        return NULL;
+    return ctx->fd_table[fd];
+}
+
+static int reserve_fd_table(struct cio *ctx, int nr)
 {
+    if (nr <= ctx->cap_fd_table)
+        return 0;
+
+    int cap = ctx->cap_fd_table ? ctx->cap_fd_table : 64;
+    while (cap < nr)
+        cap *= 2;
+    struct stream **table = realloc(ctx->fd_table, cap * sizeof(*table));
+    if (table == NULL)
+        return -1;
+    memset(table + ctx->cap_fd_table, 0, (cap - ctx->cap_fd_table) * sizeof(*table));
+    ctx->fd_table = table;
+    ctx->cap_fd_table = cap;
+    return 0;
+}
+
+static void add_event(struct cio *ctx, struct stream *stream, union stream_state state)
+{
+    if (stream->handler) {
+        ready_add(ctx, stream, state_flags(state));
+        return;
+    }
+
     //printf("[%p:add_event]: fd:%d, readable:%d, writable:%d\n",
     //       ctx, stream->fd, stream->state.bits.readable, stream->state.bits.writable);
 
     struct cio_event *pos;
     list_for_each_entry(pos, &ctx->events, ln) {
         if (pos->fin == 0 && pos->stream == stream &&
-            pos->state.byte == stream->state.byte)
+            pos->view.events == state_flags(state))
             return;
     }
 
     pos = malloc(sizeof(*pos));
     memset(pos, 0, sizeof(*pos));
+    ctx->window_events++;
+    pos->view.token = stream->token;
+    pos->view.fd = stream->fd;
+    pos->view.events = state_flags(state);
+    pos->view.wrapper = stream->wrapper;
+    pos->view.ts = cio_now();
     pos->fin = 0;
-    pos->token = stream->token;
-    pos->fd = stream->fd;
-    pos->wrapper = stream->wrapper;
-    pos->state.byte = stream->state.byte;
-    gettimeofday(&pos->ts, NULL);
+    pos->prio = stream->prio;
     pos->stream = stream;
     INIT_LIST_HEAD(&pos->ln);
-    list_add_tail(&pos->ln, &ctx->events);
+
+    // keep events sorted by prio, fifo within the same prio
+    struct cio_event *prev;
+    list_for_each_entry_reverse(prev, &ctx->events, ln) {
+        if (prev->prio >= pos->prio)
+            break;
+    }
+    list_add(&pos->ln, &prev->ln);
+}
+
+/**
+ * drop events not fetched yet of a stream going away
+ */
+static void drop_event(struct cio *ctx, struct stream *stream)
+{
+    struct cio_event *pos, *n;
+    list_for_each_entry_safe(pos, n, &ctx->events, ln) {
+        if (pos->fin == 0 && pos->stream == stream) {
+            list_del(&pos->ln);
+            free(pos);
+        }
+    }
+}
+
+/**
+ * hand events not fetched yet over to the stream re-registered
+ */
+static void move_event(struct cio *ctx, struct stream *from, struct stream *to)
+{
+    struct cio_event *pos;
+    list_for_each_entry(pos, &ctx->events, ln) {
+        if (pos->fin == 0 && pos->stream == from) {
+            pos->stream = to;
+            pos->view.token = to->token;
+            pos->view.wrapper = to->wrapper;
+        }
+    }
+}
+
+static int state_flags(union stream_state state)
+{
+    return (state.bits.readable ? CIOF_READABLE : 0) |
+        (state.bits.writable ? CIOF_WRITABLE : 0) |
+        (state.bits.drained ? CIOF_DRAINED : 0) |
+        (state.bits.timeout ? CIOF_TIMEOUT : 0) |
+        (state.bits.zerocopy ? CIOF_ZEROCOPY : 0);
+}
+
+static union stream_state flags_state(int events)
+{
+    union stream_state state = { 0 };
+    state.bits.readable = !!(events & CIOF_READABLE);
+    state.bits.writable = !!(events & CIOF_WRITABLE);
+    state.bits.drained = !!(events & CIOF_DRAINED);
+    state.bits.timeout = !!(events & CIOF_TIMEOUT);
+    state.bits.zerocopy = !!(events & CIOF_ZEROCOPY);
+    return state;
+}
+
+static uint64_t cio_now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 * 1000 + tv.tv_usec;
 }
 
 static void clear_event(struct cio *ctx)
@@ -74,11 +298,260 @@ struct cio *cio_new()
     ctx->nfds_write = 0;
     INIT_LIST_HEAD(&ctx->streams);
     INIT_LIST_HEAD(&ctx->events);
+    INIT_LIST_HEAD(&ctx->defers);
+    INIT_LIST_HEAD(&ctx->running);
+    INIT_LIST_HEAD(&ctx->drops);
+    INIT_LIST_HEAD(&ctx->expired);
+    INIT_LIST_HEAD(&ctx->zombies);
+    ctx->cpu = -1;
+
+    ctx->submits = NULL;
+    ctx->wake_pending = 0;
+    ctx->wake_fds[0] = -1;
+    ctx->wake_fds[1] = -1;
+#ifndef WIN32
+    if (pipe(ctx->wake_fds) == 0) {
+        for (int i = 0; i < 2; i++) {
+            fcntl(ctx->wake_fds[i], F_SETFL, O_NONBLOCK);
+            fcntl(ctx->wake_fds[i], F_SETFD, FD_CLOEXEC);
+        }
+    }
+#endif
+
     return ctx;
 }
 
+static void run_defer(struct cio *ctx)
+{
+    if (list_empty(&ctx->defers))
+        return;
+
+    // detach the pending ones, so fn can defer itself to next poll, the
+    // detached ones stay on ctx, where cio_undefer cancels them
+    list_splice_tail_init(&ctx->defers, &ctx->running);
+
+    while (!list_empty(&ctx->running)) {
+        struct defer *pos = list_first_entry(&ctx->running, struct defer, ln);
+        list_del(&pos->ln);
+        if (pos->fn)
+            pos->fn(pos->arg);
+        free(pos);
+    }
+}
+
+static int timer_before(struct timer *a, struct timer *b)
+{
+    return a->deadline < b->deadline ||
+        (a->deadline == b->deadline && a->seq < b->seq);
+}
+
+static void timer_set(struct cio *ctx, int i, struct timer *timer)
+{
+    ctx->timers[i] = timer;
+    timer->index = i;
+}
+
+static void timer_up(struct cio *ctx, int i)
+{
+    struct timer *timer = ctx->timers[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!timer_before(timer, ctx->timers[parent]))
+            break;
+        timer_set(ctx, i, ctx->timers[parent]);
+        i = parent;
+    }
+    timer_set(ctx, i, timer);
+}
+
+static void timer_down(struct cio *ctx, int i)
+{
+    struct timer *timer = ctx->timers[i];
+    for (;;) {
+        int child = i * 2 + 1;
+        if (child >= ctx->nr_timers)
+            break;
+        if (child + 1 < ctx->nr_timers &&
+            timer_before(ctx->timers[child + 1], ctx->timers[child]))
+            child++;
+        if (!timer_before(ctx->timers[child], timer))
+            break;
+        timer_set(ctx, i, ctx->timers[child]);
+        i = child;
+    }
+    timer_set(ctx, i, timer);
+}
+
+static struct timer *timer_add(
+    struct cio *ctx, uint64_t deadline, void (*fn)(void *arg), void *arg)
+{
+    if (ctx->nr_timers == ctx->cap_timers) {
+        int cap = ctx->cap_timers ? ctx->cap_timers * 2 : 16;
+        struct timer **timers = realloc(ctx->timers, cap * sizeof(*timers));
+        if (timers == NULL)
+            return NULL;
+        ctx->timers = timers;
+        ctx->cap_timers = cap;
+    }
+
+    struct timer *timer = malloc(sizeof(*timer));
+    if (timer == NULL)
+        return NULL;
+    timer->deadline = deadline;
+    timer->seq = ctx->timer_seq++;
+    timer->fn = fn;
+    timer->arg = arg;
+    INIT_LIST_HEAD(&timer->ln);
+
+    timer_set(ctx, ctx->nr_timers++, timer);
+    timer_up(ctx, timer->index);
+    return timer;
+}
+
+static void timer_remove(struct cio *ctx, struct timer *timer)
+{
+    int i = timer->index;
+    struct timer *last = ctx->timers[--ctx->nr_timers];
+    if (last != timer) {
+        timer_set(ctx, i, last);
+        timer_down(ctx, i);
+        timer_up(ctx, last->index);
+    }
+    timer->index = -1;
+}
+
+static void timer_cancel(struct cio *ctx, struct timer *timer)
+{
+    // an expired one is freed by run_timer
+    if (timer->index == -1) {
+        timer->fn = NULL;
+        return;
+    }
+    timer_remove(ctx, timer);
+    free(timer);
+}
+
+static uint64_t stream_deadline(struct stream *stream)
+{
+    uint64_t deadline = UINT64_MAX;
+    if (stream->idle_usec && stream->last_active + stream->idle_usec < deadline)
+        deadline = stream->last_active + stream->idle_usec;
+    if (stream->read_usec && (stream->flags & CIOF_READABLE) &&
+        stream->last_read + stream->read_usec < deadline)
+        deadline = stream->last_read + stream->read_usec;
+    if (stream->write_usec && (stream->flags & CIOF_WRITABLE) &&
+        stream->last_write + stream->write_usec < deadline)
+        deadline = stream->last_write + stream->write_usec;
+    return deadline;
+}
+
+static void stream_timeout_fn(void *arg);
+
+/**
+ * one timer per stream at its earliest deadline, activity only updates the
+ * timestamps and the timer checks them lazily when it fires
+ */
+static void arm_timeout(struct cio *ctx, struct stream *stream)
+{
+    uint64_t deadline = stream_deadline(stream);
+    if (deadline != UINT64_MAX)
+        stream->timer = timer_add(ctx, deadline, stream_timeout_fn, stream);
+}
+
+static void stream_timeout_fn(void *arg)
+{
+    struct stream *stream = arg;
+    stream->timer = NULL;
+
+    uint64_t now = cio_now();
+    if (stream_deadline(stream) <= now) {
+        union stream_state state = { 0 };
+        state.bits.timeout = 1;
+        add_event(stream->ctx, stream, state);
+        // fires again after another period without activity
+        stream->last_active = now;
+        stream->last_read = now;
+        stream->last_write = now;
+    }
+
+    arm_timeout(stream->ctx, stream);
+}
+
+static void run_timer(struct cio *ctx)
+{
+    // detach the expired ones, so fn can arm itself again
+    uint64_t now = cio_now();
+    while (ctx->nr_timers && ctx->timers[0]->deadline <= now) {
+        struct timer *timer = ctx->timers[0];
+        timer_remove(ctx, timer);
+        list_add_tail(&timer->ln, &ctx->expired);
+    }
+
+    while (!list_empty(&ctx->expired)) {
+        struct timer *timer = list_first_entry(&ctx->expired, struct timer, ln);
+        list_del(&timer->ln);
+        if (timer->fn)
+            timer->fn(timer->arg);
+        free(timer);
+    }
+}
+
+static void run_submit(struct cio *ctx)
+{
+    // drain before clearing, a wakeup in between would leave the flag set
+    // with its byte eaten, and later wakeups would skip the write
+    if (__atomic_load_n(&ctx->wake_pending, __ATOMIC_ACQUIRE)) {
+        char buf[64];
+        while (read(ctx->wake_fds[0], buf, sizeof(buf)) > 0);
+        // an exchange, so it acquires the submits of wakeups it clears
+        __atomic_exchange_n(&ctx->wake_pending, 0, __ATOMIC_ACQ_REL);
+    }
+
+    struct submit *head = __atomic_exchange_n(&ctx->submits, NULL, __ATOMIC_ACQUIRE);
+
+    // the stack pops in reverse order, reverse it back to fifo
+    struct submit *fifo = NULL;
+    while (head) {
+        struct submit *next = head->next;
+        head->next = fifo;
+        fifo = head;
+        head = next;
+    }
+
+    while (fifo) {
+        struct submit *next = fifo->next;
+        fifo->fn(ctx, fifo->arg);
+        free(fifo);
+        fifo = next;
+    }
+}
+
 void cio_drop(struct cio *ctx)
 {
+    // submissions own their args, run them rather than leak
+    run_submit(ctx);
+
+    // give deferred flushes the last chance
+    run_defer(ctx);
+
+    struct defer *defer, *n_defer;
+    list_for_each_entry_safe(defer, n_defer, &ctx->defers, ln) {
+        list_del(&defer->ln);
+        free(defer);
+    }
+
+    // whatever still points at ctx forgets it
+    while (!list_empty(&ctx->drops)) {
+        defer = list_first_entry(&ctx->drops, struct defer, ln);
+        list_del(&defer->ln);
+        defer->fn(defer->arg);
+        free(defer);
+    }
+
+    for (int i = 0; i < ctx->nr_timers; i++)
+        free(ctx->timers[i]);
+    free(ctx->timers);
+
     struct stream *stream, *n_stream;
     list_for_each_entry_safe(stream, n_stream, &ctx->streams, ln) {
         FD_CLR(stream->fd, &ctx->fds_read);
@@ -86,6 +559,13 @@ void cio_drop(struct cio *ctx)
         list_del(&stream->ln);
         stream_drop(stream);
     }
+    free(ctx->fd_table);
+
+    list_for_each_entry_safe(stream, n_stream, &ctx->zombies, ln) {
+        list_del(&stream->ln);
+        stream_drop(stream);
+    }
+    free(ctx->ready);
 
     struct cio_event *event, *n_event;
     list_for_each_entry_safe(event, n_event, &ctx->events, ln) {
@@ -93,26 +573,21 @@ void cio_drop(struct cio *ctx)
         free(event);
     }
 
+    if (ctx->wake_fds[0] != -1) {
+        close(ctx->wake_fds[0]);
+        close(ctx->wake_fds[1]);
+    }
+
     free(ctx);
 }
 
-int cio_register(struct cio *ctx, int fd, int token, int flags, void *wrapper)
+static void update_fds(struct cio *ctx, struct stream *stream)
 {
-    struct stream *pos;
-    list_for_each_entry(pos, &ctx->streams, ln) {
-        if (pos->fd == fd) {
-            FD_CLR(fd, &ctx->fds_read);
-            FD_CLR(fd, &ctx->fds_write);
-            list_del(&pos->ln);
-            stream_drop(pos); // it's safe as we break at next line
-            break;
-        }
-    }
+    int fd = stream->fd;
+    int flags = stream->flags & ~stream->suspended;
 
-    struct stream *stream = stream_new(ctx, fd, token, wrapper);
-    if (stream == NULL)
-        return -1;
-    list_add(&stream->ln, &ctx->streams);
+    FD_CLR(fd, &ctx->fds_read);
+    FD_CLR(fd, &ctx->fds_write);
 
     if ((flags & CIOF_READABLE) == CIOF_READABLE) {
         FD_SET(fd, &ctx->fds_read);
@@ -125,30 +600,605 @@ int cio_register(struct cio *ctx, int fd, int token, int flags, void *wrapper)
         if (fd + 1 > ctx->nfds_write)
             ctx->nfds_write = fd + 1;
     }
+}
 
+static int __cio_register(struct cio *ctx, int fd, int token, int flags,
+                          void *wrapper, int *prio, cio_handler_fn handler)
+{
+#ifndef WIN32
+    // fd_set has no room beyond
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        errno = EBADF;
+        return -1;
+    }
+#endif
+    if (reserve_fd_table(ctx, fd + 1) == -1)
+        return -1;
+
+    struct stream *old = ctx->fd_table[fd];
+    if (old) {
+        FD_CLR(fd, &ctx->fds_read);
+        FD_CLR(fd, &ctx->fds_write);
+        list_del(&old->ln);
+        ctx->fd_table[fd] = NULL;
+    }
+
+    struct stream *stream = stream_new(ctx, fd, token, wrapper);
+    if (stream == NULL) {
+        if (old) {
+            __atomic_sub_fetch(&ctx->nr_fds, 1, __ATOMIC_RELAXED);
+            drop_event(ctx, old);
+            if (old->timer)
+                timer_cancel(ctx, old->timer);
+            stream_release(ctx, old);
+        }
+        return -1;
+    }
+    if (old == NULL)
+        __atomic_add_fetch(&ctx->nr_fds, 1, __ATOMIC_RELAXED);
+    stream->flags = flags;
+    stream->handler = handler;
+    stream->suspended = old ? old->suspended : 0;
+    stream->prio = prio ? *prio : (old ? old->prio : CIO_PRIO_NORMAL);
+    list_add_tail(&stream->ln, &ctx->streams);
+    ctx->fd_table[fd] = stream;
+    update_fds(ctx, stream);
+
+    if (old) {
+        move_event(ctx, old, stream);
+
+        // timeouts count from now, flags may have changed
+        stream->idle_usec = old->idle_usec;
+        stream->read_usec = old->read_usec;
+        stream->write_usec = old->write_usec;
+        stream->last_active = stream->last_read = stream->last_write = cio_now();
+        stream->timer = old->timer;
+        if (stream->timer)
+            stream->timer->arg = stream;
+
+        // calls the handler didn't get yet go to the new registration
+        if (old->pending)
+            add_event(ctx, stream, flags_state(old->pending));
+        stream_release(ctx, old);
+    }
     return 0;
 }
 
+int cio_register(struct cio *ctx, int fd, int token, int flags, void *wrapper)
+{
+    return __cio_register(ctx, fd, token, flags, wrapper, NULL, NULL);
+}
+
+int cio_register_prio(
+    struct cio *ctx, int fd, int token, int flags, void *wrapper, int prio)
+{
+    return __cio_register(ctx, fd, token, flags, wrapper, &prio, NULL);
+}
+
+int cio_register_cb(struct cio *ctx, int fd, int flags, cio_handler_fn fn, void *arg)
+{
+    assert(fn);
+    return __cio_register(ctx, fd, 0, flags, arg, NULL, fn);
+}
+
+int cio_register_many(struct cio *ctx, const struct cio_reg *regs, int n)
+{
+    int max_fd = -1;
+    for (int i = 0; i < n; i++) {
+        if (regs[i].fd > max_fd)
+            max_fd = regs[i].fd;
+    }
+#ifndef WIN32
+    if (max_fd >= FD_SETSIZE)
+        max_fd = FD_SETSIZE - 1;
+#endif
+    if (reserve_fd_table(ctx, max_fd + 1) == -1)
+        return 0;
+
+    int i;
+    for (i = 0; i < n; i++) {
+        if (__cio_register(ctx, regs[i].fd, regs[i].token, regs[i].flags,
+                           regs[i].wrapper, NULL, NULL) == -1)
+            break;
+    }
+    return i;
+}
+
 int cio_unregister(struct cio *ctx, int fd)
 {
-    struct stream *pos, *n;
-    list_for_each_entry_safe(pos, n, &ctx->streams, ln) {
-        if (pos->fd == fd) {
-            FD_CLR(fd, &ctx->fds_read);
-            FD_CLR(fd, &ctx->fds_write);
+    struct stream *pos = find_stream(ctx, fd);
+    if (pos == NULL)
+        return -1;
+
+    FD_CLR(fd, &ctx->fds_read);
+    FD_CLR(fd, &ctx->fds_write);
+    list_del(&pos->ln);
+    ctx->fd_table[fd] = NULL;
+    __atomic_sub_fetch(&ctx->nr_fds, 1, __ATOMIC_RELAXED);
+    drop_event(ctx, pos);
+    if (pos->timer)
+        timer_cancel(ctx, pos->timer);
+    stream_release(ctx, pos);
+    return 0;
+}
+
+int cio_defer(struct cio *ctx, void (*fn)(void *arg), void *arg)
+{
+    struct defer *defer = malloc(sizeof(*defer));
+    if (defer == NULL)
+        return -1;
+    defer->fn = fn;
+    defer->arg = arg;
+    INIT_LIST_HEAD(&defer->ln);
+    list_add_tail(&defer->ln, &ctx->defers);
+    return 0;
+}
+
+void cio_undefer(struct cio *ctx, void (*fn)(void *arg), void *arg)
+{
+    struct defer *pos, *n;
+    list_for_each_entry_safe(pos, n, &ctx->defers, ln) {
+        if (pos->fn == fn && pos->arg == arg) {
             list_del(&pos->ln);
-            stream_drop(pos);
-            return 0;
+            free(pos);
+        }
+    }
+
+    // run_defer frees them
+    list_for_each_entry(pos, &ctx->running, ln) {
+        if (pos->fn == fn && pos->arg == arg)
+            pos->fn = NULL;
+    }
+
+    // a removal may sift the last one up past the scan, so compact the heap
+    // in one pass and rebuild it bottom up, O(n) for any nr of matches
+    int nr_kept = 0;
+    for (int i = 0; i < ctx->nr_timers; i++) {
+        struct timer *timer = ctx->timers[i];
+        if (timer->fn == fn && timer->arg == arg)
+            free(timer);
+        else
+            timer_set(ctx, nr_kept++, timer);
+    }
+    if (nr_kept != ctx->nr_timers) {
+        ctx->nr_timers = nr_kept;
+        for (int i = nr_kept / 2 - 1; i >= 0; i--)
+            timer_down(ctx, i);
+    }
+
+    struct timer *timer;
+    list_for_each_entry(timer, &ctx->expired, ln) {
+        if (timer->fn == fn && timer->arg == arg)
+            timer->fn = NULL;
+    }
+}
+
+int cio_defer_drop(struct cio *ctx, void (*fn)(void *arg), void *arg)
+{
+    struct defer *defer = malloc(sizeof(*defer));
+    if (defer == NULL)
+        return -1;
+    defer->fn = fn;
+    defer->arg = arg;
+    INIT_LIST_HEAD(&defer->ln);
+    list_add_tail(&defer->ln, &ctx->drops);
+    return 0;
+}
+
+void cio_undefer_drop(struct cio *ctx, void (*fn)(void *arg), void *arg)
+{
+    struct defer *pos, *n;
+    list_for_each_entry_safe(pos, n, &ctx->drops, ln) {
+        if (pos->fn == fn && pos->arg == arg) {
+            list_del(&pos->ln);
+            free(pos);
+        }
+    }
+}
+
+int cio_defer_after(struct cio *ctx, uint64_t usec, void (*fn)(void *arg), void *arg)
+{
+    return timer_add(ctx, cio_now() + usec, fn, arg) ? 0 : -1;
+}
+
+int cio_suspend(struct cio *ctx, int fd, int flags)
+{
+    struct stream *pos = find_stream(ctx, fd);
+    if (pos == NULL)
+        return -1;
+    pos->suspended |= flags;
+    update_fds(ctx, pos);
+    return 0;
+}
+
+int cio_resume(struct cio *ctx, int fd, int flags)
+{
+    struct stream *pos = find_stream(ctx, fd);
+    if (pos == NULL)
+        return -1;
+    pos->suspended &= ~flags;
+    update_fds(ctx, pos);
+    return 0;
+}
+
+void cio_wakeup(struct cio *ctx)
+{
+    if (__atomic_exchange_n(&ctx->wake_pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (ctx->wake_fds[1] != -1) {
+            char c = 0;
+            if (write(ctx->wake_fds[1], &c, 1) == -1)
+                assert(errno == EAGAIN);
         }
     }
+}
+
+int cio_submit(struct cio *ctx, void (*fn)(struct cio *ctx, void *arg), void *arg)
+{
+    struct submit *submit = malloc(sizeof(*submit));
+    if (submit == NULL)
+        return -1;
+    submit->fn = fn;
+    submit->arg = arg;
+
+    submit->next = __atomic_load_n(&ctx->submits, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&ctx->submits, &submit->next, submit, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    cio_wakeup(ctx);
+    return 0;
+}
+
+static void submit_register_fn(struct cio *ctx, void *arg)
+{
+    struct submit_register *reg = arg;
+    cio_register(ctx, reg->fd, reg->token, reg->flags, reg->wrapper);
+    free(reg);
+}
+
+int cio_submit_register(struct cio *ctx, int fd, int token, int flags, void *wrapper)
+{
+    struct submit_register *reg = malloc(sizeof(*reg));
+    if (reg == NULL)
+        return -1;
+    reg->fd = fd;
+    reg->token = token;
+    reg->flags = flags;
+    reg->wrapper = wrapper;
+
+    if (cio_submit(ctx, submit_register_fn, reg) == -1) {
+        free(reg);
+        return -1;
+    }
+    return 0;
+}
+
+static void submit_unregister_fn(struct cio *ctx, void *arg)
+{
+    cio_unregister(ctx, (int)(intptr_t)arg);
+}
+
+int cio_submit_unregister(struct cio *ctx, int fd)
+{
+    return cio_submit(ctx, submit_unregister_fn, (void *)(intptr_t)fd);
+}
+
+/**
+ * adopt the detached stream, which only fails on growing the fd table, so
+ * never on the ctx it came from
+ */
+static int migrate_attach(struct cio *ctx, struct migrate *m)
+{
+    struct stream *stream = m->stream;
+    int fd = stream->fd;
+    if (reserve_fd_table(ctx, fd + 1) == -1)
+        return -1;
+    if (ctx->fd_table[fd])
+        cio_unregister(ctx, fd);
+
+    // timeouts keep counting from the last activity
+    stream->ctx = ctx;
+    stream->state.byte = 0;
+    stream->pending = 0;
+    stream->queued = 0;
+    stream->dead = 0;
+    stream->timer = NULL;
+    INIT_LIST_HEAD(&stream->ln);
+    list_add_tail(&stream->ln, &ctx->streams);
+    ctx->fd_table[fd] = stream;
+    __atomic_add_fetch(&ctx->nr_fds, 1, __ATOMIC_RELAXED);
+    update_fds(ctx, stream);
+    arm_timeout(ctx, stream);
+
+    if (m->events)
+        cio_post(ctx, fd, m->events);
+    return 0;
+}
+
+static void migrate_fn(struct cio *ctx, void *arg)
+{
+    struct migrate *m = arg;
+    if (migrate_attach(ctx, m) == -1) {
+        // back to where it came from, whose fd table has room for it
+        struct cio *from = m->from;
+        m->from = NULL;
+        if (from && cio_submit(from, migrate_fn, m) == 0)
+            return;
+        perror("cio_migrate");
+        stream_drop(m->stream);
+        free(m);
+        return;
+    }
+
+    if (m->fn)
+        m->fn(ctx, m->arg);
+    free(m);
+}
+
+int cio_migrate(struct cio *from, int fd, struct cio *to,
+                void (*fn)(struct cio *ctx, void *arg), void *arg)
+{
+    struct stream *stream = find_stream(from, fd);
+    if (stream == NULL)
+        return -1;
+
+    struct migrate *m = malloc(sizeof(*m));
+    if (m == NULL)
+        return -1;
+    m->stream = stream;
+    m->from = from;
+    m->events = 0;
+    m->fn = fn;
+    m->arg = arg;
+
+    // queued for its handler, so the stream stays here and a copy moves
+    if (stream->queued) {
+        m->stream = malloc(sizeof(*m->stream));
+        if (m->stream == NULL) {
+            free(m);
+            return -1;
+        }
+        memcpy(m->stream, stream, sizeof(*stream));
+        m->stream->pending = 0;
+        m->stream->queued = 0;
+    }
+    m->events = stream->pending;
+
+    // events not fetched yet go along, nothing is left to fire on from
+    struct cio_event *ev;
+    list_for_each_entry(ev, &from->events, ln) {
+        if (ev->fin == 0 && ev->stream == stream)
+            m->events |= ev->view.events;
+    }
+    drop_event(from, stream);
+
+    FD_CLR(fd, &from->fds_read);
+    FD_CLR(fd, &from->fds_write);
+    list_del(&stream->ln);
+    from->fd_table[fd] = NULL;
+    __atomic_sub_fetch(&from->nr_fds, 1, __ATOMIC_RELAXED);
+    if (stream->timer) {
+        timer_cancel(from, stream->timer);
+        stream->timer = NULL;
+        m->stream->timer = NULL;
+    }
+    if (m->stream != stream)
+        stream_release(from, stream);
+
+    if (cio_submit(to, migrate_fn, m) == -1) {
+        // stay on from as if nothing happened
+        int rc = migrate_attach(from, m);
+        assert(rc == 0);
+        (void)rc;
+        free(m);
+        return -1;
+    }
+    return 0;
+}
+
+static void cio_wait(struct cio *ctx, unsigned long usec)
+{
+#ifndef WIN32
+    // sleep on the wake pipe, so cio_submit cuts the idle short
+    if (ctx->wake_fds[0] != -1) {
+        struct timeval tv = { usec / (1000 * 1000), usec % (1000 * 1000) };
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(ctx->wake_fds[0], &fds);
+        select(ctx->wake_fds[0] + 1, &fds, NULL, NULL, &tv);
+        return;
+    }
+#endif
+    usleep(usec);
+}
 
+int cio_post(struct cio *ctx, int fd, int events)
+{
+    struct stream *pos = find_stream(ctx, fd);
+    if (pos == NULL)
+        return -1;
+    add_event(ctx, pos, flags_state(events));
+    return 0;
+}
+
+int cio_set_timeout(struct cio *ctx, int fd,
+                    uint64_t idle_usec, uint64_t read_usec, uint64_t write_usec)
+{
+    struct stream *pos = find_stream(ctx, fd);
+    if (pos == NULL)
+        return -1;
+
+    if (pos->timer) {
+        timer_cancel(ctx, pos->timer);
+        pos->timer = NULL;
+    }
+    pos->idle_usec = idle_usec;
+    pos->read_usec = read_usec;
+    pos->write_usec = write_usec;
+    pos->last_active = pos->last_read = pos->last_write = cio_now();
+    arm_timeout(ctx, pos);
+    return 0;
+}
+
+void cio_set_budget(struct cio *ctx, int max_events, size_t max_bytes)
+{
+    ctx->max_events = max_events;
+    ctx->max_bytes = max_bytes;
+}
+
+void cio_set_busy_poll(struct cio *ctx, uint64_t usec)
+{
+    ctx->busy_poll_usec = usec;
+}
+
+size_t cio_get_byte_budget(struct cio *ctx)
+{
+    return ctx->max_bytes;
+}
+
+uint64_t cio_get_round(struct cio *ctx)
+{
+    return ctx->round;
+}
+
+int cio_set_cpu(struct cio *ctx, int cpu)
+{
+#ifdef __linux__
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1)
+        return -1;
+    __atomic_store_n(&ctx->cpu, cpu, __ATOMIC_RELAXED);
+    return 0;
+#else
+    (void)ctx;
+    (void)cpu;
+    errno = ENOTSUP;
     return -1;
+#endif
+}
+
+int cio_get_cpu(struct cio *ctx)
+{
+    return __atomic_load_n(&ctx->cpu, __ATOMIC_RELAXED);
+}
+
+int cio_get_load(struct cio *ctx, int *event_rate)
+{
+    if (event_rate)
+        *event_rate = __atomic_load_n(&ctx->event_rate, __ATOMIC_RELAXED);
+    return __atomic_load_n(&ctx->nr_fds, __ATOMIC_RELAXED);
+}
+
+int cio_get_flags(struct cio *ctx, int fd)
+{
+    struct stream *pos = find_stream(ctx, fd);
+    return pos ? pos->flags : -1;
+}
+
+/**
+ * spin on zero timeout selects, return 1 as soon as a fd is readable or a
+ * submit is pending, writable is left to the regular poll as most fds are
+ * writable all the time
+ */
+static int cio_spin(struct cio *ctx, uint64_t usec)
+{
+    uint64_t deadline = cio_now() + usec;
+    int nfds = ctx->nfds_read;
+#ifndef WIN32
+    if (ctx->wake_fds[0] != -1 && ctx->wake_fds[0] + 1 > nfds)
+        nfds = ctx->wake_fds[0] + 1;
+#else
+    if (ctx->fds_read.fd_count == 0)
+        return 0;
+#endif
+
+    do {
+        struct timeval tv = { 0, 0 };
+        fd_set fds_read;
+        memcpy(&fds_read, &ctx->fds_read, sizeof(fds_read));
+#ifndef WIN32
+        if (ctx->wake_fds[0] != -1)
+            FD_SET(ctx->wake_fds[0], &fds_read);
+#endif
+        int nr = select(nfds, &fds_read, NULL, NULL, &tv);
+        if (nr > 0)
+            return 1;
+        if (nr == -1 && errno != EINTR)
+            return 0;
+    } while (cio_now() < deadline);
+
+    return 0;
+}
+
+static void run_handlers(struct cio *ctx)
+{
+    if (ctx->ready_retry) {
+        ctx->ready_retry = 0;
+        struct stream *pos;
+        list_for_each_entry(pos, &ctx->streams, ln) {
+            if (pos->handler && pos->pending && !pos->queued)
+                ready_add(ctx, pos, 0);
+        }
+    }
+
+    // those queued by the handlers wait for next round
+    int nr = ctx->nr_ready;
+    int i;
+    for (i = 0; i < nr; i++) {
+        if (ctx->max_events && ctx->round_events >= ctx->max_events)
+            break;
+        struct stream *stream = ctx->ready[i];
+        if (stream->dead)
+            continue;
+        int events = stream->pending;
+        stream->pending = 0;
+        stream->queued = 0;
+        ctx->round_events++;
+        ctx->window_events++;
+        stream->handler(ctx, stream->fd, events, stream->wrapper);
+    }
+
+    int left = 0;
+    for (; i < ctx->nr_ready; i++) {
+        if (!ctx->ready[i]->dead)
+            ctx->ready[left++] = ctx->ready[i];
+    }
+    ctx->nr_ready = left;
+
+    struct stream *pos, *n;
+    list_for_each_entry_safe(pos, n, &ctx->zombies, ln) {
+        list_del(&pos->ln);
+        stream_drop(pos);
+    }
 }
 
 static void cio_idle(struct cio *ctx, unsigned long usec)
 {
-    if (list_empty(&ctx->events)) {
-        usleep(ctx->idle_usec);
+    if (list_empty(&ctx->events) && ctx->nr_ready == 0 && !ctx->ready_retry) {
+        // never sleep past the next timer
+        unsigned long wait = ctx->idle_usec;
+        if (ctx->nr_timers) {
+            uint64_t now = cio_now();
+            struct timer *next = ctx->timers[0];
+            uint64_t left = next->deadline > now ? next->deadline - now : 0;
+            if (left < wait)
+                wait = left;
+        }
+
+        // burn the cpu first, a hit skips the sleep and its wakeup latency
+        if (ctx->busy_poll_usec) {
+            unsigned long spin = ctx->busy_poll_usec < wait ? ctx->busy_poll_usec : wait;
+            if (cio_spin(ctx, spin))
+                return;
+            wait -= spin;
+        }
+
+        cio_wait(ctx, wait);
         if (ctx->idle_usec != usec) {
             ctx->idle_usec += usec / 10;
             if (ctx->idle_usec > usec)
@@ -162,7 +1212,20 @@ static void cio_idle(struct cio *ctx, unsigned long usec)
 int cio_poll(struct cio *ctx, uint64_t usec)
 {
     gettimeofday(&ctx->poll_ts, NULL);
+    uint64_t now = (uint64_t)ctx->poll_ts.tv_sec * 1000 * 1000 + ctx->poll_ts.tv_usec;
+    if (now - ctx->window_start >= LOAD_WINDOW_USEC) {
+        int rate = ctx->window_start ?
+            (uint64_t)ctx->window_events * 1000 * 1000 / (now - ctx->window_start) : 0;
+        __atomic_store_n(&ctx->event_rate, rate, __ATOMIC_RELAXED);
+        ctx->window_start = now;
+        ctx->window_events = 0;
+    }
+    ctx->round++;
+    ctx->round_events = 0;
     clear_event(ctx);
+    run_submit(ctx);
+    run_defer(ctx);
+    run_timer(ctx);
 
     struct timeval tv = { 0, 0 };
     fd_set fds_read;
@@ -229,58 +1292,136 @@ int cio_poll(struct cio *ctx, uint64_t usec)
         //printf("[%p:poll]: fd:%d, readable:%d, writable:%d\n",
         //       ctx, pos->fd, pos->state.bits.readable, pos->state.bits.writable);
 
+        // activity for timeouts, only timestamps here
+        if (pos->state.bits.readable)
+            pos->last_read = now;
+        if (pos->state.bits.writable)
+            pos->last_write = now;
+
         // if readable or writable from 0 to 1
         if (pos->state.bits.readable ||
             (pos->state.bits.writable && !pre_writable)) {
-            add_event(ctx, pos);
+            pos->last_active = now;
+            add_event(ctx, pos, pos->state);
         }
     }
 
     assert(nr_fds_read == 0);
     assert(nr_fds_write == 0);
 
+    run_handlers(ctx);
     cio_idle(ctx, usec);
     return 0;
 }
 
+static void stop_fn(struct cio *ctx, void *arg)
+{
+    (void)arg;
+    ctx->stop = 1;
+}
+
+int cio_stop(struct cio *ctx)
+{
+    return cio_submit(ctx, stop_fn, NULL);
+}
+
+int cio_run(struct cio *ctx, uint64_t usec)
+{
+    while (!ctx->stop) {
+        if (cio_poll(ctx, usec) == -1)
+            return -1;
+
+        struct cio_event *pos;
+        list_for_each_entry(pos, &ctx->events, ln)
+            pos->fin = 1;
+    }
+    ctx->stop = 0;
+    return 0;
+}
+
 struct cio_event *cio_iter(struct cio *ctx)
 {
+    // the rest is left to next round
+    if (ctx->max_events && ctx->round_events >= ctx->max_events)
+        return NULL;
+
     struct cio_event *pos;
     list_for_each_entry(pos, &ctx->events, ln) {
         if (pos->fin == 0) {
             pos->fin = 1;
+            ctx->round_events++;
             return pos;
         }
     }
     return NULL;
 }
 
+int cio_iter_batch(struct cio *ctx, struct cio_event_view *views, int n)
+{
+    if (ctx->max_events && n > ctx->max_events - ctx->round_events)
+        n = ctx->max_events - ctx->round_events;
+
+    int i = 0;
+    struct cio_event *pos;
+    list_for_each_entry(pos, &ctx->events, ln) {
+        if (i == n)
+            break;
+        if (pos->fin)
+            continue;
+        pos->fin = 1;
+        views[i] = pos->view;
+        i++;
+    }
+    ctx->round_events += i;
+    return i;
+}
+
+int cio_get_event_abi(void)
+{
+    return CIO_EVENT_ABI;
+}
+
 int cioe_is_readable(struct cio_event *ev)
 {
-    return ev->state.bits.readable;
+    return !!(ev->view.events & CIOF_READABLE);
 }
 
 int cioe_is_writable(struct cio_event *ev)
 {
-    return ev->state.bits.writable;
+    return !!(ev->view.events & CIOF_WRITABLE);
+}
+
+int cioe_is_drained(struct cio_event *ev)
+{
+    return !!(ev->view.events & CIOF_DRAINED);
+}
+
+int cioe_is_timeout(struct cio_event *ev)
+{
+    return !!(ev->view.events & CIOF_TIMEOUT);
+}
+
+int cioe_is_zerocopy(struct cio_event *ev)
+{
+    return !!(ev->view.events & CIOF_ZEROCOPY);
 }
 
 int cioe_get_token(struct cio_event *ev)
 {
-    return ev->token;
+    return ev->view.token;
 }
 
 int cioe_getfd(struct cio_event *ev)
 {
-    return ev->fd;
+    return ev->view.fd;
 }
 
 void *cioe_get_wrapper(struct cio_event *ev)
 {
-    return ev->wrapper;
+    return ev->view.wrapper;
 }
 
 uint64_t cioe_get_ts(struct cio_event *ev)
 {
-    return ev->ts.tv_sec * 1000 * 1000 + ev->ts.tv_usec;
+    return ev->view.ts;
 }
@@ -10,9 +10,40 @@ extern "C" {
 struct cio;
 struct cio_event;
 
+/**
+ * CIO_EVENT_ABI: version of the layout of struct cio_event_view, bumped on
+ * any change, see cio_get_event_abi
+ */
+#define CIO_EVENT_ABI 1
+
+/**
+ * cio_event_view: plain copy of an event, filled by cio_iter_batch, it is
+ * also the head of every struct cio_event, which is 64 bytes on 64-bit
+ * targets, so cioe_view reads an event in place
+ */
+struct cio_event_view {
+    int token;
+    int fd;
+    int events; /* cio_flag */
+    void *wrapper;
+    uint64_t ts; /* usec */
+};
+
 enum cio_flag {
     CIOF_READABLE = (1 << 0),
     CIOF_WRITABLE = (1 << 1),
+    CIOF_DRAINED = (1 << 2), /* event only, see cio_stream_set_sendq */
+    CIOF_TIMEOUT = (1 << 3), /* event only, see cio_set_timeout */
+    CIOF_ZEROCOPY = (1 << 4), /* event only, see cio_stream_send_zerocopy */
+};
+
+/**
+ * priorities of cio_register_prio, any int works, higher is fetched first
+ */
+enum cio_prio {
+    CIO_PRIO_LOW = -1,
+    CIO_PRIO_NORMAL = 0,
+    CIO_PRIO_HIGH = 1,
 };
 
 /**
@@ -27,27 +58,241 @@ void cio_drop(struct cio *ctx);
 
 /**
  * cio_register: next call with same fd will just update the type & flag & wrapper
+ * @fd: below FD_SETSIZE, -1 with EBADF otherwise
  * @token: any value defined by user, maybe 1:LISENTER, 2:STREAM, 3:ACCEPT_STREAM
  * @flags: cio_fd_flag, CIOF_READABLE:(1<<0), CIOF_WRITABLE:(1<<1)
  * @wrapper: the wrapper of fd, maybe tcp_stream or something else
  */
 int cio_register(struct cio *ctx, int fd, int token, int flags, void *wrapper);
 
+/**
+ * cio_register_prio: cio_register with a priority, events of higher prio are
+ * fetched first by cio_iter and cio_iter_batch, events of the same prio in
+ * registration order, cio_register later keeps the prio of fd
+ * @prio: cio_prio, CIO_PRIO_NORMAL for fds registered by cio_register
+ */
+int cio_register_prio(
+    struct cio *ctx, int fd, int token, int flags, void *wrapper, int prio);
+
+/**
+ * cio_reg: one entry of cio_register_many, as args of cio_register
+ */
+struct cio_reg {
+    int fd;
+    int token;
+    int flags; /* cio_flag */
+    void *wrapper;
+};
+
+/**
+ * cio_register_many: cio_register of each entry in order, with the fd table
+ * sized once for the largest fd, e.g. to restore fds handed off by another
+ * process; fds must be below FD_SETSIZE, as for cio_register
+ * @return: number of entries registered, less than n if one fails
+ */
+int cio_register_many(struct cio *ctx, const struct cio_reg *regs, int n);
+
+/**
+ * cio_handler_fn: called by cio_poll for fds of cio_register_cb, it may
+ * register, unregister or migrate any fd, including its own
+ * @events: cio_flag
+ */
+typedef void (*cio_handler_fn)(struct cio *ctx, int fd, int events, void *arg);
+
+/**
+ * cio_register_cb: register fd with a handler, which cio_poll calls at the
+ * end of the round instead of queueing events for cio_iter, so there is no
+ * token to switch on and no event to fetch; re-registering by cio_register
+ * takes the handler away; prio is ignored, max_events of cio_set_budget
+ * applies, calls beyond it are left to the next round
+ */
+int cio_register_cb(struct cio *ctx, int fd, int flags, cio_handler_fn fn, void *arg);
+
 /**
  * cio_unregister
  */
 int cio_unregister(struct cio *ctx, int fd);
 
+/**
+ * cio_post: queue an event of a registered fd which doesn't come from
+ * polling, it is fetched by cio_iter like others
+ * @events: cio_flag, e.g. CIOF_DRAINED
+ */
+int cio_post(struct cio *ctx, int fd, int events);
+
+/**
+ * cio_suspend: stop polling fd for flags until cio_resume, without changing
+ * its registered flags, which cio_get_flags still returns
+ * @flags: cio_flag, CIOF_READABLE and/or CIOF_WRITABLE
+ */
+int cio_suspend(struct cio *ctx, int fd, int flags);
+
+/**
+ * cio_resume: poll fd again for the suspended flags it's registered with
+ */
+int cio_resume(struct cio *ctx, int fd, int flags);
+
+/**
+ * cio_get_flags
+ * @return: the flags of fd at registration, -1 if fd is not registered
+ */
+int cio_get_flags(struct cio *ctx, int fd);
+
 /**
  * cio_poll
  */
 int cio_poll(struct cio *ctx, uint64_t usec);
 
+/**
+ * cio_run: cio_poll until cio_stop, for ctxs driven by cio_register_cb;
+ * events of fds registered by cio_register are dropped as nobody fetches them
+ * @return: 0 when stopped, -1 if error
+ */
+int cio_run(struct cio *ctx, uint64_t usec);
+
+/**
+ * cio_stop: thread safe, cio_run returns after the current round
+ */
+int cio_stop(struct cio *ctx);
+
+/**
+ * cio_set_timeout: post a CIOF_TIMEOUT event of fd when it is idle too long,
+ * it fires again after each further period without activity, timestamps are
+ * updated per event and checked by one timer per fd, no scan of all fds
+ * @idle_usec: no readable or newly writable event for it, 0 for none
+ * @read_usec: registered readable but not readable for it, 0 for none
+ * @write_usec: registered writable but not writable for it, 0 for none
+ * @return: 0, -1 if fd is not registered, timeouts are kept by cio_register
+ */
+int cio_set_timeout(struct cio *ctx, int fd,
+                    uint64_t idle_usec, uint64_t read_usec, uint64_t write_usec);
+
+/**
+ * cio_set_budget: bound the work of a round, which is one cio_poll, so one
+ * busy fd can't hold up the others; what exceeds the budget is left to the
+ * next round, events keep their order and fds stay readable
+ * @max_events: max events fetched by cio_iter and cio_iter_batch, 0 for no limit
+ * @max_bytes: max bytes cio_stream_recv returns per stream, for streams bound
+ *             to ctx by cio_stream_bind, 0 for no limit
+ */
+void cio_set_budget(struct cio *ctx, int max_events, size_t max_bytes);
+
+/**
+ * cio_set_busy_poll: when a round finds nothing, spin on readiness up to usec
+ * before sleeping, trading a core for wakeup latency; see
+ * cio_stream_set_busy_poll for spinning in the driver as well
+ * @usec: max spin per cio_poll, 0 to always sleep, which is the default
+ */
+void cio_set_busy_poll(struct cio *ctx, uint64_t usec);
+
+/**
+ * cio_get_byte_budget
+ * @return: max_bytes of cio_set_budget
+ */
+size_t cio_get_byte_budget(struct cio *ctx);
+
+/**
+ * cio_get_round
+ * @return: nr cio_poll called so far
+ */
+uint64_t cio_get_round(struct cio *ctx);
+
+/**
+ * cio_set_cpu: pin the thread polling ctx to cpu, call it on that thread
+ * before it allocates; linux places pages on the node of the cpu touching
+ * them first, so bufpools, send queues and events of ctx stay node local
+ * @return: 0, -1 if error or not supported, errno EINVAL if cpu is out of range
+ */
+int cio_set_cpu(struct cio *ctx, int cpu);
+
+/**
+ * cio_get_cpu: thread safe
+ * @return: cpu of cio_set_cpu, -1 if not pinned
+ */
+int cio_get_cpu(struct cio *ctx);
+
+/**
+ * cio_get_load: thread safe, e.g. for placing new fds on the least loaded ctx
+ * @event_rate: set to events per second over the last 100ms polled, or NULL
+ * @return: nr fds registered
+ */
+int cio_get_load(struct cio *ctx, int *event_rate);
+
+/**
+ * cio_defer: call fn(arg) once at the beginning of next cio_poll, before
+ * polling fds; fn may defer itself again to run at the poll after
+ */
+int cio_defer(struct cio *ctx, void (*fn)(void *arg), void *arg);
+
+/**
+ * cio_defer_after: call fn(arg) once at the beginning of the first cio_poll
+ * after usec, the idle wait of cio_poll never sleeps past it
+ */
+int cio_defer_after(struct cio *ctx, uint64_t usec, void (*fn)(void *arg), void *arg);
+
+/**
+ * cio_undefer: cancel pending calls of fn(arg), by cio_defer or cio_defer_after
+ */
+void cio_undefer(struct cio *ctx, void (*fn)(void *arg), void *arg);
+
+/**
+ * cio_defer_drop: call fn(arg) from cio_drop, after the last deferred calls
+ * and before anything of ctx is freed, so objects keeping ctx can forget it
+ */
+int cio_defer_drop(struct cio *ctx, void (*fn)(void *arg), void *arg);
+
+/**
+ * cio_undefer_drop: cancel calls of fn(arg) by cio_defer_drop
+ */
+void cio_undefer_drop(struct cio *ctx, void (*fn)(void *arg), void *arg);
+
+/**
+ * cio_submit: thread safe, queue fn(ctx, arg) to run on the thread calling
+ * cio_poll at the beginning of next cio_poll, and wake up its idle wait;
+ * submissions from one thread run in order
+ */
+int cio_submit(struct cio *ctx, void (*fn)(struct cio *ctx, void *arg), void *arg);
+
+/**
+ * cio_submit_register: thread safe version of cio_register
+ */
+int cio_submit_register(struct cio *ctx, int fd, int token, int flags, void *wrapper);
+
+/**
+ * cio_submit_unregister: thread safe version of cio_unregister
+ */
+int cio_submit_unregister(struct cio *ctx, int fd);
+
+/**
+ * cio_migrate: move fd from the ctx polled by this thread to another ctx,
+ * with its token, flags, wrapper, prio, suspension, timeouts and the events
+ * not fetched yet; fd leaves from at once and shows up in to at its next
+ * cio_poll, so no event is lost or seen twice on the way
+ * @fn: called as fn(to, arg) on the thread of to once fd is attached, e.g. to
+ *      move state of the wrapper, NULL for none; see cio_stream_migrate; if to
+ *      is out of memory for fd, fd goes back to from and fn(from, arg) is
+ *      called on the thread of from instead
+ * @return: 0, -1 if fd is not registered in from or error, fd stays in from
+ */
+int cio_migrate(struct cio *from, int fd, struct cio *to,
+                void (*fn)(struct cio *ctx, void *arg), void *arg);
+
+/**
+ * cio_wakeup: thread safe, cut the idle wait of cio_poll short
+ */
+void cio_wakeup(struct cio *ctx);
+
 /**
  * cioe_iter
  */
 struct cio_event *cio_iter(struct cio *ctx);
 
+/**
+ * cio_iter_batch: fetch up to n events at once as plain copies
+ * @return: nr events fetched, 0 if no more events
+ */
+int cio_iter_batch(struct cio *ctx, struct cio_event_view *views, int n);
+
 /**
  * cioe_is_readable
  */
@@ -58,6 +303,23 @@ int cioe_is_readable(struct cio_event *ev);
  */
 int cioe_is_writable(struct cio_event *ev);
 
+/**
+ * cioe_is_drained: the send queue of the stream has drained below its low
+ * watermark, see cio_stream_set_sendq
+ */
+int cioe_is_drained(struct cio_event *ev);
+
+/**
+ * cioe_is_timeout: fd is idle, see cio_set_timeout
+ */
+int cioe_is_timeout(struct cio_event *ev);
+
+/**
+ * cioe_is_zerocopy: zerocopy sends of the stream have completed, see
+ * cio_stream_reap_zerocopy
+ */
+int cioe_is_zerocopy(struct cio_event *ev);
+
 /**
  * cioe_get_token
  * @return: token
@@ -82,6 +344,37 @@ void *cioe_get_wrapper(struct cio_event *ev);
  */
 uint64_t cioe_get_ts(struct cio_event *ev);
 
+/**
+ * cio_get_event_abi: check it once against CIO_EVENT_ABI before reading
+ * events by cioe_view, in case the library was built from other headers
+ * @return: CIO_EVENT_ABI of the library
+ */
+int cio_get_event_abi(void);
+
+/**
+ * cioe_view: the event in place, no call into the library
+ */
+static inline const struct cio_event_view *cioe_view(struct cio_event *ev)
+{
+    return (const struct cio_event_view *)(const void *)ev;
+}
+
+/*
+ * define CIO_EVENT_INLINE before including cio.h to inline the cioe_*
+ * accessors by cioe_view, the functions stay exported for others
+ */
+#ifdef CIO_EVENT_INLINE
+#define cioe_is_readable(ev) (!!(cioe_view(ev)->events & CIOF_READABLE))
+#define cioe_is_writable(ev) (!!(cioe_view(ev)->events & CIOF_WRITABLE))
+#define cioe_is_drained(ev) (!!(cioe_view(ev)->events & CIOF_DRAINED))
+#define cioe_is_timeout(ev) (!!(cioe_view(ev)->events & CIOF_TIMEOUT))
+#define cioe_is_zerocopy(ev) (!!(cioe_view(ev)->events & CIOF_ZEROCOPY))
+#define cioe_get_token(ev) (cioe_view(ev)->token)
+#define cioe_getfd(ev) (cioe_view(ev)->fd)
+#define cioe_get_wrapper(ev) (cioe_view(ev)->wrapper)
+#define cioe_get_ts(ev) (cioe_view(ev)->ts)
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,12 +1,22 @@
 use std::ffi::{CString, c_void};
-use std::io::Error;
+use std::io::{Error, IoSlice};
+use std::marker::PhantomData;
+use std::mem::MaybeUninit;
 use log::trace;
 
+pub mod buffer;
+pub mod reactor;
+pub use buffer::{BufferPool, PooledBuf};
+pub use reactor::{Reactor, AsyncCioStream, AsyncCioListener};
+
 pub struct CioFlag;
 
 impl CioFlag {
     pub const READABLE: i32 = (1<<0);
     pub const WRITABLE: i32 = (1<<1);
+    pub const DRAINED: i32 = (1<<2);
+    pub const TIMEOUT: i32 = (1<<3);
+    pub const ZEROCOPY: i32 = (1<<4);
 }
 
 pub trait CioWrapper {
@@ -77,6 +87,52 @@ impl CioStream {
                 self.stream, buf.as_ptr() as *const c_void, buf.len() as u64);
         }
     }
+
+    /// Recv into uninitialized memory, returns the initialized part.
+    pub fn recv_uninit<'a>(&self, buf: &'a mut [MaybeUninit<u8>]) -> Result<&'a mut [u8], Error> {
+        unsafe {
+            let nr = cio_sys::cio_stream_recv(
+                self.stream, buf.as_mut_ptr() as *mut c_void, buf.len() as u64);
+            if nr < 0 {
+                Err(Error::last_os_error())
+            } else {
+                Ok(std::slice::from_raw_parts_mut(buf.as_mut_ptr() as *mut u8, nr as usize))
+            }
+        }
+    }
+
+    /// Recv appending to the spare capacity of buf, no zeroing.
+    pub fn recv_into(&self, buf: &mut Vec<u8>) -> i32 {
+        let nr = match self.recv_uninit(buf.spare_capacity_mut()) {
+            Ok(data) => data.len(),
+            Err(_) => return -1,
+        };
+        unsafe { buf.set_len(buf.len() + nr); }
+        nr as i32
+    }
+
+    /// Recv into a buffer taken from pool, it goes back to pool on drop.
+    pub fn recv_pooled(&self, pool: &BufferPool) -> Result<PooledBuf, Error> {
+        let mut buf = pool.get();
+        let nr = self.recv_uninit(buf.spare_capacity_mut())?.len();
+        unsafe { buf.advance(nr); }
+        Ok(buf)
+    }
+
+    /// Send a slice of slices with one syscall where supported.
+    pub fn send_vectored(&self, bufs: &[IoSlice<'_>]) -> i32 {
+        // IoSlice is ABI compatible with iovec, and so with cio_iovec, on unix
+        #[cfg(unix)]
+        let iov = bufs.as_ptr() as *const cio_sys::cio_iovec;
+        #[cfg(not(unix))]
+        let vec: Vec<cio_sys::cio_iovec> = bufs.iter().map(|b| cio_sys::cio_iovec {
+            base: b.as_ptr() as *mut c_void, len: b.len() as u64 }).collect();
+        #[cfg(not(unix))]
+        let iov = vec.as_ptr();
+        unsafe {
+            return cio_sys::cio_stream_sendv(self.stream, iov, bufs.len() as i32);
+        }
+    }
 }
 
 /**
@@ -176,6 +232,81 @@ impl CioEvent {
     }
 }
 
+/**
+ * CioEvents
+ */
+
+const EVENTS_BATCH: usize = 64;
+
+/// An event copied out of the context by batch, no FFI per access.
+pub struct CioEventRef<'a> {
+    pub token: i32,
+    pub fd: i32,
+    pub events: i32,
+    pub wrapper: *mut c_void,
+    pub ts: u64,
+    _cio: PhantomData<&'a Cio>,
+}
+
+impl<'a> CioEventRef<'a> {
+    pub fn is_readable(&self) -> bool {
+        self.events & CioFlag::READABLE != 0
+    }
+
+    pub fn is_writable(&self) -> bool {
+        self.events & CioFlag::WRITABLE != 0
+    }
+
+    pub fn is_drained(&self) -> bool {
+        self.events & CioFlag::DRAINED != 0
+    }
+
+    pub fn is_timeout(&self) -> bool {
+        self.events & CioFlag::TIMEOUT != 0
+    }
+
+    pub fn is_zerocopy(&self) -> bool {
+        self.events & CioFlag::ZEROCOPY != 0
+    }
+}
+
+/// Events of the last poll, fetched from the context in batches.
+pub struct CioEvents<'a> {
+    cio: &'a Cio,
+    views: [MaybeUninit<cio_sys::cio_event_view>; EVENTS_BATCH],
+    len: usize,
+    pos: usize,
+}
+
+impl<'a> Iterator for CioEvents<'a> {
+    type Item = CioEventRef<'a>;
+
+    fn next(&mut self) -> Option<CioEventRef<'a>> {
+        if self.pos == self.len {
+            self.len = unsafe {
+                cio_sys::cio_iter_batch(self.cio.ctx, self.views.as_mut_ptr()
+                                        as *mut cio_sys::cio_event_view,
+                                        EVENTS_BATCH as i32) as usize
+            };
+            self.pos = 0;
+            if self.len == 0 {
+                return None;
+            }
+        }
+
+        let view = unsafe { self.views[self.pos].assume_init_ref() };
+        self.pos += 1;
+        Some(CioEventRef {
+            token: view.token,
+            fd: view.fd,
+            events: view.events,
+            wrapper: view.wrapper,
+            ts: view.ts,
+            _cio: PhantomData,
+        })
+    }
+}
+
 /**
  * Cio
  */
@@ -217,6 +348,16 @@ impl Cio {
         }
     }
 
+    /// Events of fds with higher `prio` are yielded first, 0 for normal.
+    pub fn register_prio<T>(&self, wr: &T, token: i32, flags: i32, prio: i32) -> i32
+    where T: CioWrapper,
+    {
+        unsafe {
+            return cio_sys::cio_register_prio(
+                self.ctx, wr.getfd(), token, flags, wr.get_wrapper(), prio);
+        }
+    }
+
     pub fn unregister<T>(&self, wr: &T) -> i32
     where T: CioWrapper,
     {
@@ -229,6 +370,15 @@ impl Cio {
         }
     }
 
+    pub fn events(&self) -> CioEvents<'_> {
+        CioEvents {
+            cio: self,
+            views: unsafe { MaybeUninit::uninit().assume_init() },
+            len: 0,
+            pos: 0,
+        }
+    }
+
     pub fn cio_iter(&self) -> Option<CioEvent> {
         unsafe {
             let ev = cio_sys::cio_iter(self.ctx);
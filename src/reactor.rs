@@ -0,0 +1,410 @@
+//! Async adapters over Cio, CioStream and CioListener.
+//!
+//! A `Reactor` owns a `Cio` context and a single threaded executor. Futures
+//! register their waker per fd and direction, `cio_poll` readiness wakes
+//! them, so thousands of connections multiplex on one thread.
+
+use std::cell::RefCell;
+use std::collections::{HashMap, VecDeque};
+use std::ffi::c_void;
+use std::future::Future;
+use std::io::{Error, ErrorKind};
+use std::pin::Pin;
+use std::rc::Rc;
+use std::sync::{Arc, Mutex};
+use std::task::{Context, Poll, Wake, Waker};
+use log::trace;
+
+use crate::{Cio, CioFlag, CioListener, CioStream, CioWrapper};
+
+const MAIN_TASK: usize = usize::MAX;
+const POLL_USEC: u64 = 10 * 1000;
+
+type Task = Pin<Box<dyn Future<Output = ()>>>;
+
+struct TaskWaker {
+    id: usize,
+    ready: Arc<Mutex<VecDeque<usize>>>,
+}
+
+impl Wake for TaskWaker {
+    fn wake(self: Arc<Self>) {
+        self.wake_by_ref();
+    }
+
+    fn wake_by_ref(self: &Arc<Self>) {
+        self.ready.lock().unwrap().push_back(self.id);
+    }
+}
+
+#[derive(Default)]
+struct FdState {
+    wrapper: usize,
+    registered: i32,
+    readable: bool,
+    writable: bool,
+    read_waker: Option<Waker>,
+    write_waker: Option<Waker>,
+}
+
+impl FdState {
+    fn interest(&self) -> i32 {
+        let mut flags = 0;
+        if self.read_waker.is_some() {
+            flags |= CioFlag::READABLE;
+        }
+        if self.write_waker.is_some() {
+            flags |= CioFlag::WRITABLE;
+        }
+        flags
+    }
+}
+
+struct Inner {
+    cio: Cio,
+    fds: RefCell<HashMap<i32, FdState>>,
+    tasks: RefCell<Vec<Option<Task>>>,
+    free: RefCell<Vec<usize>>,
+    ready: Arc<Mutex<VecDeque<usize>>>,
+}
+
+/**
+ * Reactor
+ */
+
+#[derive(Clone)]
+pub struct Reactor {
+    inner: Rc<Inner>,
+}
+
+impl Reactor {
+    pub fn new() -> Result<Reactor, Error> {
+        Ok(Reactor {
+            inner: Rc::new(Inner {
+                cio: Cio::new()?,
+                fds: RefCell::new(HashMap::new()),
+                tasks: RefCell::new(Vec::new()),
+                free: RefCell::new(Vec::new()),
+                ready: Arc::new(Mutex::new(VecDeque::new())),
+            }),
+        })
+    }
+
+    pub fn cio(&self) -> &Cio {
+        &self.inner.cio
+    }
+
+    /// Run `fut` concurrently with others, it starts at next poll round.
+    pub fn spawn<F>(&self, fut: F)
+    where F: Future<Output = ()> + 'static,
+    {
+        let mut tasks = self.inner.tasks.borrow_mut();
+        let id = match self.inner.free.borrow_mut().pop() {
+            Some(id) => {
+                tasks[id] = Some(Box::pin(fut));
+                id
+            }
+            None => {
+                tasks.push(Some(Box::pin(fut)));
+                tasks.len() - 1
+            }
+        };
+        self.inner.ready.lock().unwrap().push_back(id);
+    }
+
+    /// Drive `fut` and all spawned tasks until `fut` completes.
+    pub fn block_on<F: Future>(&self, fut: F) -> F::Output {
+        let mut fut = Box::pin(fut);
+        let main_waker = self.waker(MAIN_TASK);
+        let mut main_ready = true;
+
+        loop {
+            if main_ready {
+                let mut cx = Context::from_waker(&main_waker);
+                if let Poll::Ready(output) = fut.as_mut().poll(&mut cx) {
+                    return output;
+                }
+            }
+
+            // never sleep in cio_poll while something is ready to run
+            main_ready = self.run_ready();
+            let busy = main_ready || !self.inner.ready.lock().unwrap().is_empty();
+            self.poll_events(if busy { 0 } else { POLL_USEC });
+            main_ready |= self.run_ready();
+        }
+    }
+
+    fn waker(&self, id: usize) -> Waker {
+        Waker::from(Arc::new(TaskWaker { id: id, ready: self.inner.ready.clone() }))
+    }
+
+    /// Poll tasks woken so far, return true if the main task is woken.
+    fn run_ready(&self) -> bool {
+        let ready: Vec<usize> = self.inner.ready.lock().unwrap().drain(..).collect();
+        let mut main_ready = false;
+
+        for id in ready {
+            if id == MAIN_TASK {
+                main_ready = true;
+                continue;
+            }
+
+            // take the task out, so it can spawn or register while polled
+            let task = match self.inner.tasks.borrow_mut().get_mut(id) {
+                Some(slot) => slot.take(),
+                None => None,
+            };
+            if let Some(mut task) = task {
+                let waker = self.waker(id);
+                let mut cx = Context::from_waker(&waker);
+                if task.as_mut().poll(&mut cx).is_pending() {
+                    self.inner.tasks.borrow_mut()[id] = Some(task);
+                } else {
+                    self.inner.free.borrow_mut().push(id);
+                }
+            }
+        }
+
+        main_ready
+    }
+
+    fn poll_events(&self, usec: u64) {
+        assert!(self.inner.cio.poll(usec) != -1);
+
+        while let Some(ev) = self.inner.cio.cio_iter() {
+            let fd = ev.getfd();
+            let mut fds = self.inner.fds.borrow_mut();
+            if let Some(state) = fds.get_mut(&fd) {
+                // one-shot, a woken direction drops out of interest until
+                // the next pending poll arms it again
+                if ev.is_readable() {
+                    state.readable = true;
+                    if let Some(waker) = state.read_waker.take() {
+                        waker.wake();
+                    }
+                }
+                if ev.is_writable() {
+                    state.writable = true;
+                    if let Some(waker) = state.write_waker.take() {
+                        waker.wake();
+                    }
+                }
+                let interest = state.interest();
+                if interest != state.registered {
+                    state.registered = interest;
+                    self.update(fd, state.wrapper, interest);
+                }
+            }
+        }
+    }
+
+    fn update(&self, fd: i32, wrapper: usize, interest: i32) {
+        unsafe {
+            cio_sys::cio_register(self.inner.cio.ctx, fd, fd, interest, wrapper as *mut c_void);
+        }
+    }
+
+    fn add<T: CioWrapper>(&self, wr: &T) {
+        let fd = wr.getfd();
+        trace!("reactor add fd:{}", fd);
+        let mut state = FdState::default();
+        state.wrapper = wr.get_wrapper() as usize;
+        self.inner.fds.borrow_mut().insert(fd, state);
+    }
+
+    fn remove(&self, fd: i32) {
+        trace!("reactor remove fd:{}", fd);
+        if self.inner.fds.borrow_mut().remove(&fd).is_some() {
+            unsafe { cio_sys::cio_unregister(self.inner.cio.ctx, fd); }
+        }
+    }
+
+    /// Take the readiness of fd, or park the waker until it is ready.
+    fn poll_ready(&self, fd: i32, flag: i32, cx: &mut Context<'_>) -> Poll<()> {
+        let mut fds = self.inner.fds.borrow_mut();
+        let state = fds.get_mut(&fd).expect("fd not added to reactor");
+
+        let ready = if flag == CioFlag::READABLE { &mut state.readable } else { &mut state.writable };
+        if *ready {
+            return Poll::Ready(());
+        }
+
+        let slot = if flag == CioFlag::READABLE { &mut state.read_waker } else { &mut state.write_waker };
+        *slot = Some(cx.waker().clone());
+        // the registration persists, cio_register only when interest grows
+        let interest = state.interest();
+        if interest != state.registered {
+            state.registered = interest;
+            self.update(fd, state.wrapper, interest);
+        }
+        Poll::Pending
+    }
+
+    fn clear_ready(&self, fd: i32, flag: i32) {
+        if let Some(state) = self.inner.fds.borrow_mut().get_mut(&fd) {
+            if flag == CioFlag::READABLE {
+                state.readable = false;
+            } else {
+                state.writable = false;
+            }
+        }
+    }
+}
+
+fn would_block(nr: i32) -> Option<Error> {
+    if nr >= 0 {
+        return None;
+    }
+    let err = Error::last_os_error();
+    if err.kind() == ErrorKind::WouldBlock || err.kind() == ErrorKind::Interrupted {
+        None
+    } else {
+        Some(err)
+    }
+}
+
+/**
+ * AsyncCioStream
+ */
+
+pub struct AsyncCioStream {
+    stream: CioStream,
+    reactor: Reactor,
+}
+
+impl Drop for AsyncCioStream {
+    fn drop(&mut self) {
+        self.reactor.remove(self.stream.getfd());
+    }
+}
+
+impl AsyncCioStream {
+    pub fn new(stream: CioStream, reactor: &Reactor) -> Result<AsyncCioStream, Error> {
+        unsafe {
+            if cio_sys::cio_stream_set_nonblock(stream.stream, 1) == -1 {
+                return Err(Error::last_os_error());
+            }
+        }
+        reactor.add(&stream);
+        Ok(AsyncCioStream { stream: stream, reactor: reactor.clone() })
+    }
+
+    pub fn connect(addr: &str, reactor: &Reactor) -> Result<AsyncCioStream, Error> {
+        AsyncCioStream::new(CioStream::connect(addr)?, reactor)
+    }
+
+    pub fn get_ref(&self) -> &CioStream {
+        &self.stream
+    }
+
+    /// AsyncRead style, Ready(Ok(0)) means the peer has closed.
+    pub fn poll_recv(&self, cx: &mut Context<'_>, buf: &mut [u8]) -> Poll<Result<usize, Error>> {
+        let fd = self.stream.getfd();
+        loop {
+            if self.reactor.poll_ready(fd, CioFlag::READABLE, cx).is_pending() {
+                return Poll::Pending;
+            }
+            let nr = self.stream.recv(buf);
+            if nr >= 0 {
+                return Poll::Ready(Ok(nr as usize));
+            }
+            if let Some(err) = would_block(nr) {
+                return Poll::Ready(Err(err));
+            }
+            self.reactor.clear_ready(fd, CioFlag::READABLE);
+        }
+    }
+
+    /// AsyncWrite style, may send part of buf.
+    pub fn poll_send(&self, cx: &mut Context<'_>, buf: &[u8]) -> Poll<Result<usize, Error>> {
+        let fd = self.stream.getfd();
+        loop {
+            if self.reactor.poll_ready(fd, CioFlag::WRITABLE, cx).is_pending() {
+                return Poll::Pending;
+            }
+            let nr = self.stream.send(buf);
+            if nr >= 0 {
+                return Poll::Ready(Ok(nr as usize));
+            }
+            if let Some(err) = would_block(nr) {
+                return Poll::Ready(Err(err));
+            }
+            self.reactor.clear_ready(fd, CioFlag::WRITABLE);
+        }
+    }
+
+    pub async fn recv(&self, buf: &mut [u8]) -> Result<usize, Error> {
+        std::future::poll_fn(|cx| self.poll_recv(cx, buf)).await
+    }
+
+    pub async fn send(&self, buf: &[u8]) -> Result<usize, Error> {
+        std::future::poll_fn(|cx| self.poll_send(cx, buf)).await
+    }
+
+    pub async fn send_all(&self, mut buf: &[u8]) -> Result<(), Error> {
+        while !buf.is_empty() {
+            let nr = self.send(buf).await?;
+            buf = &buf[nr..];
+        }
+        Ok(())
+    }
+}
+
+/**
+ * AsyncCioListener
+ */
+
+pub struct AsyncCioListener {
+    listener: CioListener,
+    reactor: Reactor,
+}
+
+impl Drop for AsyncCioListener {
+    fn drop(&mut self) {
+        self.reactor.remove(self.listener.getfd());
+    }
+}
+
+impl AsyncCioListener {
+    pub fn new(listener: CioListener, reactor: &Reactor) -> Result<AsyncCioListener, Error> {
+        unsafe {
+            if cio_sys::cio_listener_set_nonblock(listener.listener, 1) == -1 {
+                return Err(Error::last_os_error());
+            }
+        }
+        reactor.add(&listener);
+        Ok(AsyncCioListener { listener: listener, reactor: reactor.clone() })
+    }
+
+    pub fn bind(addr: &str, reactor: &Reactor) -> Result<AsyncCioListener, Error> {
+        AsyncCioListener::new(CioListener::bind(addr)?, reactor)
+    }
+
+    pub fn get_ref(&self) -> &CioListener {
+        &self.listener
+    }
+
+    /// Stream style accept, yields one connection per call.
+    pub fn poll_accept(&self, cx: &mut Context<'_>) -> Poll<Result<AsyncCioStream, Error>> {
+        let fd = self.listener.getfd();
+        loop {
+            if self.reactor.poll_ready(fd, CioFlag::READABLE, cx).is_pending() {
+                return Poll::Pending;
+            }
+            // readable may be stale, a peer can reset before the accept
+            match self.listener.accept() {
+                Ok(stream) => return Poll::Ready(AsyncCioStream::new(stream, &self.reactor)),
+                Err(err) => {
+                    if err.kind() != ErrorKind::WouldBlock && err.kind() != ErrorKind::Interrupted {
+                        return Poll::Ready(Err(err));
+                    }
+                }
+            }
+            self.reactor.clear_ready(fd, CioFlag::READABLE);
+        }
+    }
+
+    pub async fn accept(&self) -> Result<AsyncCioStream, Error> {
+        std::future::poll_fn(|cx| self.poll_accept(cx)).await
+    }
+}
@@ -2,6 +2,7 @@
 #define __STREAM_H
 
 #include <stdint.h>
+#include "cio.h"
 #include "list.h"
 
 #ifdef __cplusplus
@@ -13,15 +14,37 @@ union stream_state {
     struct {
         uint8_t readable:1;
         uint8_t writable:1;
+        uint8_t drained:1; /* posted by cio_post */
+        uint8_t timeout:1;
+        uint8_t zerocopy:1; /* posted by cio_post */
     } bits;
 };
 
+struct timer;
+
 struct stream {
     int fd;
     int token;
-    void *wrapper; /* the fd wrapper */
+    int flags; /* cio_flag */
+    int suspended; /* cio_flag, taken out of polling by cio_suspend */
+    int prio; /* events of higher prio are fetched first */
+    void *wrapper; /* the fd wrapper, arg of handler */
+    cio_handler_fn handler; /* NULL if events go to cio_iter */
+    int pending; /* cio_flag for handler */
+    int queued; /* in ctx->ready, pending may wait for a retry if not */
+    int dead; /* released while queued in ctx->ready */
     union stream_state state;
     struct cio *ctx;
+
+    /* usec, 0 for none, see cio_set_timeout */
+    uint64_t idle_usec;
+    uint64_t read_usec;
+    uint64_t write_usec;
+    uint64_t last_active;
+    uint64_t last_read;
+    uint64_t last_write;
+    struct timer *timer;
+
     struct list_head ln;
 };
 
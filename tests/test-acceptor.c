@@ -0,0 +1,127 @@
+#include <sched.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "cio.h"
+#include "cio-stream.h"
+#include "cio-acceptor.h"
+
+#define UNIX_ADDR "unix:///tmp/cio-acceptor-test"
+#define TOKEN_LISTENER 1
+#define TOKEN_STREAM 2
+#define NR_WORKERS 3
+#define NR_BUSY_FDS 10
+#define NR_CLIENTS 12
+
+static struct cio *workers[NR_WORKERS];
+static int nr_placed[NR_WORKERS];
+static struct cio_stream *streams[NR_CLIENTS];
+static int nr_taken = 0;
+static int stop = 0;
+
+static void on_stream(struct cio *ctx, struct cio_stream *stream, void *arg)
+{
+    assert_true(arg == &nr_taken);
+    assert_true(cio_register(ctx, cio_stream_getfd(stream), TOKEN_STREAM,
+                             CIOF_READABLE, stream) == 0);
+    for (int i = 0; i < NR_WORKERS; i++) {
+        if (workers[i] == ctx)
+            nr_placed[i]++;
+    }
+    int nr = __atomic_fetch_add(&nr_taken, 1, __ATOMIC_ACQ_REL);
+    streams[nr] = stream;
+}
+
+static void *worker_thread(void *args)
+{
+    struct cio *ctx = args;
+    while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+        assert_true(cio_poll(ctx, 10 * 1000) == 0);
+        while (cio_iter(ctx));
+    }
+    return NULL;
+}
+
+static void test_acceptor(void **status)
+{
+    (void)status;
+
+    // worker 0 is busy with fds of its own already
+    int pipes[NR_BUSY_FDS][2];
+    for (int i = 0; i < NR_WORKERS; i++)
+        workers[i] = cio_new();
+    for (int i = 0; i < NR_BUSY_FDS; i++) {
+        assert_true(pipe(pipes[i]) == 0);
+        cio_register(workers[0], pipes[i][0], TOKEN_STREAM, CIOF_READABLE, NULL);
+    }
+
+    pthread_t pids[NR_WORKERS];
+    for (int i = 0; i < NR_WORKERS; i++)
+        pthread_create(&pids[i], NULL, worker_thread, workers[i]);
+
+    struct cio_listener *listener = cio_listener_bind(UNIX_ADDR);
+    assert_true(listener);
+    struct cio *ctx = cio_new();
+    cio_register(ctx, cio_listener_getfd(listener), TOKEN_LISTENER, CIOF_READABLE, listener);
+    struct cio_acceptor *acc = cio_acceptor_new(
+        listener, workers, NR_WORKERS, CIO_BALANCE_FDS, on_stream, &nr_taken);
+    assert_true(acc);
+
+    struct cio_stream *clients[NR_CLIENTS];
+    for (int i = 0; i < NR_CLIENTS; i++) {
+        clients[i] = cio_stream_connect(UNIX_ADDR);
+        assert_true(clients[i]);
+    }
+
+    // streams not taken by workers yet count as load, so a burst spreads
+    int nr_dispatched = 0;
+    while (nr_dispatched < NR_CLIENTS) {
+        assert_true(cio_poll(ctx, 10 * 1000) == 0);
+        struct cio_event *ev;
+        while ((ev = cio_iter(ctx))) {
+            assert_true(cioe_get_token(ev) == TOKEN_LISTENER);
+            nr_dispatched += cio_acceptor_run(acc, 0);
+        }
+    }
+    assert_true(cio_acceptor_run(acc, 0) == 0);
+    cio_acceptor_drop(acc);
+
+    while (__atomic_load_n(&nr_taken, __ATOMIC_ACQUIRE) != NR_CLIENTS)
+        usleep(1000);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < NR_WORKERS; i++)
+        pthread_join(pids[i], NULL);
+
+    printf("[acceptor]: placed %d, %d, %d\n", nr_placed[0], nr_placed[1], nr_placed[2]);
+    assert_true(nr_placed[0] == 0);
+    assert_true(nr_placed[1] == NR_CLIENTS / 2 && nr_placed[2] == NR_CLIENTS / 2);
+    for (int i = 0; i < NR_WORKERS; i++)
+        assert_true(cio_get_load(workers[i], NULL) == (i == 0 ? NR_BUSY_FDS : NR_CLIENTS / 2));
+
+    for (int i = 0; i < NR_CLIENTS; i++) {
+        cio_stream_drop(streams[i]);
+        cio_stream_drop(clients[i]);
+    }
+    for (int i = 0; i < NR_BUSY_FDS; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+    for (int i = 0; i < NR_WORKERS; i++)
+        cio_drop(workers[i]);
+    cio_drop(ctx);
+    cio_listener_drop(listener);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_acceptor),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
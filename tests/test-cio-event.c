@@ -0,0 +1,63 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <unistd.h>
+#define CIO_EVENT_INLINE
+#include "cio.h"
+
+/**
+ * the inline accessors read what the exported functions return, other tests
+ * keep calling the functions
+ */
+static void test_cio_event_view(void **status)
+{
+    (void)status;
+
+    assert_true(cio_get_event_abi() == CIO_EVENT_ABI);
+
+    int fds[2];
+    assert_true(pipe(fds) == 0);
+    assert_true(write(fds[1], "x", 1) == 1);
+
+    struct cio *ctx = cio_new();
+    assert_true(cio_register(ctx, fds[0], 7, CIOF_READABLE, fds) == 0);
+    assert_true(cio_poll(ctx, 10 * 1000) == 0);
+
+    struct cio_event *ev = cio_iter(ctx);
+    assert_true(ev);
+    // parenthesized names call the exported functions, not the macros
+    assert_true(cioe_is_readable(ev) && (cioe_is_readable)(ev));
+    assert_true(!cioe_is_writable(ev) && !(cioe_is_writable)(ev));
+    assert_true(!cioe_is_drained(ev) && !(cioe_is_drained)(ev));
+    assert_true(!cioe_is_timeout(ev) && !(cioe_is_timeout)(ev));
+    assert_true(!cioe_is_zerocopy(ev) && !(cioe_is_zerocopy)(ev));
+    assert_true(cioe_get_token(ev) == 7 && (cioe_get_token)(ev) == 7);
+    assert_true(cioe_getfd(ev) == fds[0] && (cioe_getfd)(ev) == fds[0]);
+    assert_true(cioe_get_wrapper(ev) == fds && (cioe_get_wrapper)(ev) == fds);
+    assert_true(cioe_get_ts(ev) != 0 && cioe_get_ts(ev) == (cioe_get_ts)(ev));
+    assert_true(cio_iter(ctx) == NULL);
+
+    // a posted event sets no readiness bits
+    char c;
+    assert_true(read(fds[0], &c, 1) == 1);
+    assert_true(cio_post(ctx, fds[0], CIOF_DRAINED) == 0);
+    assert_true(cio_poll(ctx, 0) == 0);
+    ev = cio_iter(ctx);
+    assert_true(ev);
+    assert_true(cioe_is_drained(ev) && (cioe_is_drained)(ev));
+    assert_true(!cioe_is_readable(ev) && !(cioe_is_readable)(ev));
+    assert_true(cio_iter(ctx) == NULL);
+
+    cio_drop(ctx);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_cio_event_view),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -1,3 +1,7 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <sched.h>
 #include <stdarg.h>
 #include <stddef.h>
@@ -8,6 +12,9 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
@@ -206,10 +213,506 @@ static void test_cio(void **status)
     pthread_join(server_pid, NULL);
 }
 
+#define NR_PRODUCERS 4
+#define NR_SUBMITS 10000
+
+static struct cio *defer_ctx;
+static int defer_calls[3];
+
+static void defer_fn(void *arg)
+{
+    int i = (int)(intptr_t)arg;
+    defer_calls[i]++;
+    // the first one cancels the last one queued in the same round
+    if (i == 0)
+        cio_undefer(defer_ctx, defer_fn, (void *)(intptr_t)2);
+}
+
+static void test_cio_defer(void **status)
+{
+    (void)status;
+
+    defer_ctx = cio_new();
+    for (int i = 0; i < 3; i++)
+        assert_true(cio_defer(defer_ctx, defer_fn, (void *)(intptr_t)i) == 0);
+    assert_true(cio_poll(defer_ctx, 0) == 0);
+    assert_true(defer_calls[0] == 1 && defer_calls[1] == 1 && defer_calls[2] == 0);
+
+    assert_true(cio_poll(defer_ctx, 0) == 0);
+    assert_true(defer_calls[2] == 0);
+
+    // cancels every timer of fn(arg), wherever the heap moves them
+    memset(defer_calls, 0, sizeof(defer_calls));
+    for (int i = 0; i < 64; i++) {
+        uint64_t usec = 1000 + (i * 37 % 64) * 100;
+        assert_true(cio_defer_after(defer_ctx, usec, defer_fn,
+                                    (void *)(intptr_t)(1 + i % 2)) == 0);
+    }
+    cio_undefer(defer_ctx, defer_fn, (void *)(intptr_t)2);
+    usleep(10 * 1000);
+    assert_true(cio_poll(defer_ctx, 0) == 0);
+    assert_true(defer_calls[1] == 32 && defer_calls[2] == 0);
+    cio_drop(defer_ctx);
+}
+
+static int submit_seqs[NR_PRODUCERS];
+static int submit_count = 0;
+
+static void submit_fn(struct cio *ctx, void *arg)
+{
+    (void)ctx;
+    intptr_t val = (intptr_t)arg;
+    int producer = val / NR_SUBMITS;
+    // submissions of one producer keep their order
+    assert_true(val % NR_SUBMITS == submit_seqs[producer]);
+    submit_seqs[producer]++;
+    submit_count++;
+}
+
+struct producer_args {
+    struct cio *ctx;
+    int id;
+};
+
+static void *producer_thread(void *args)
+{
+    struct producer_args *pa = args;
+    for (int i = 0; i < NR_SUBMITS; i++) {
+        intptr_t val = pa->id * NR_SUBMITS + i;
+        assert_true(cio_submit(pa->ctx, submit_fn, (void *)val) == 0);
+    }
+    return NULL;
+}
+
+static void test_cio_submit(void **status)
+{
+    (void)status;
+
+    struct cio *ctx = cio_new();
+    pthread_t pids[NR_PRODUCERS];
+    struct producer_args args[NR_PRODUCERS];
+    for (int i = 0; i < NR_PRODUCERS; i++) {
+        args[i].ctx = ctx;
+        args[i].id = i;
+        pthread_create(&pids[i], NULL, producer_thread, &args[i]);
+    }
+
+    // the idle wait is 1 second, submissions must wake it up
+    int nr_polls = 0;
+    while (submit_count != NR_PRODUCERS * NR_SUBMITS) {
+        assert_true(cio_poll(ctx, 1000 * 1000) == 0);
+        nr_polls++;
+    }
+    printf("[submit]: %d submissions in %d polls\n", submit_count, nr_polls);
+
+    for (int i = 0; i < NR_PRODUCERS; i++)
+        pthread_join(pids[i], NULL);
+    cio_drop(ctx);
+}
+
+#define NR_PRIO_FDS 6
+
+static void test_cio_prio(void **status)
+{
+    (void)status;
+
+    int prios[NR_PRIO_FDS] = {
+        CIO_PRIO_LOW, CIO_PRIO_NORMAL, CIO_PRIO_HIGH,
+        CIO_PRIO_NORMAL, CIO_PRIO_HIGH, CIO_PRIO_LOW,
+    };
+    int expected[NR_PRIO_FDS] = { 2, 4, 1, 3, 0, 5 };
+
+    struct cio *ctx = cio_new();
+    int pipes[NR_PRIO_FDS][2];
+    for (int i = 0; i < NR_PRIO_FDS; i++) {
+        assert_true(pipe(pipes[i]) == 0);
+        assert_true(write(pipes[i][1], "x", 1) == 1);
+        assert_true(cio_register_prio(ctx, pipes[i][0], i, CIOF_READABLE,
+                                      NULL, prios[i]) == 0);
+    }
+
+    // re-registered by cio_register, the prio is kept
+    assert_true(cio_register(ctx, pipes[4][0], 4, CIOF_READABLE, NULL) == 0);
+
+    assert_true(cio_poll(ctx, 0) == 0);
+    struct cio_event *ev;
+    int i = 0;
+    while ((ev = cio_iter(ctx))) {
+        assert_true(i < NR_PRIO_FDS);
+        assert_true(cioe_get_token(ev) == expected[i]);
+        i++;
+    }
+    assert_true(i == NR_PRIO_FDS);
+
+    for (int i = 0; i < NR_PRIO_FDS; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+    cio_drop(ctx);
+}
+
+#define TIMEOUT_USEC (50 * 1000)
+
+#define NR_REGS 200
+
+static void test_cio_register_many(void **status)
+{
+    (void)status;
+
+    int pipes[NR_REGS][2];
+    struct cio_reg regs[NR_REGS];
+    for (int i = 0; i < NR_REGS; i++) {
+        assert_true(pipe(pipes[i]) == 0);
+        regs[i].fd = pipes[i][0];
+        regs[i].token = i;
+        regs[i].flags = CIOF_READABLE;
+        regs[i].wrapper = pipes[i];
+    }
+
+    struct cio *ctx = cio_new();
+    assert_true(cio_register_many(ctx, regs, NR_REGS) == NR_REGS);
+    assert_true(cio_get_load(ctx, NULL) == NR_REGS);
+    // registered again, the same as cio_register
+    assert_true(cio_register_many(ctx, regs, NR_REGS) == NR_REGS);
+    assert_true(cio_get_load(ctx, NULL) == NR_REGS);
+
+    for (int i = 0; i < NR_REGS; i += 7)
+        assert_true(write(pipes[i][1], "x", 1) == 1);
+    assert_true(cio_poll(ctx, 10 * 1000) == 0);
+
+    int nr = 0;
+    struct cio_event *ev;
+    while ((ev = cio_iter(ctx))) {
+        int i = cioe_get_token(ev);
+        assert_true(i % 7 == 0);
+        assert_true(cioe_getfd(ev) == pipes[i][0]);
+        assert_true(cioe_get_wrapper(ev) == pipes[i]);
+        nr++;
+    }
+    assert_true(nr == (NR_REGS + 6) / 7);
+
+    // stops at the first fd select can't take
+    struct cio_reg bad[2] = {
+        { pipes[0][1], 0, CIOF_WRITABLE, NULL },
+        { -1, 0, CIOF_READABLE, NULL },
+    };
+    assert_true(cio_register_many(ctx, bad, 2) == 1);
+    assert_true(cio_get_flags(ctx, pipes[0][1]) == CIOF_WRITABLE);
+    assert_true(cio_register(ctx, FD_SETSIZE, 0, CIOF_READABLE, NULL) == -1);
+
+    for (int i = 0; i < NR_REGS; i++)
+        assert_true(cio_unregister(ctx, pipes[i][0]) == 0);
+    assert_true(cio_unregister(ctx, pipes[0][0]) == -1);
+    assert_true(cio_get_load(ctx, NULL) == 1);
+
+    cio_drop(ctx);
+    for (int i = 0; i < NR_REGS; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+}
+
+static void test_cio_timeout(void **status)
+{
+    (void)status;
+
+    int idle[2], busy[2];
+    assert_true(pipe(idle) == 0);
+    assert_true(pipe(busy) == 0);
+
+    struct cio *ctx = cio_new();
+    assert_true(cio_register(ctx, idle[0], 1, CIOF_READABLE, NULL) == 0);
+    assert_true(cio_register(ctx, busy[0], 2, CIOF_READABLE, NULL) == 0);
+    assert_true(cio_set_timeout(ctx, idle[0], TIMEOUT_USEC, 0, 0) == 0);
+    assert_true(cio_set_timeout(ctx, busy[0], TIMEOUT_USEC, 0, 0) == 0);
+    assert_true(cio_set_timeout(ctx, 1024, TIMEOUT_USEC, 0, 0) == -1);
+
+    struct timeval start, now;
+    gettimeofday(&start, NULL);
+    int nr_idle = 0, nr_busy = 0;
+    for (;;) {
+        gettimeofday(&now, NULL);
+        uint64_t elapsed = (now.tv_sec - start.tv_sec) * 1000 * 1000 +
+            now.tv_usec - start.tv_usec;
+        if (elapsed > 4 * TIMEOUT_USEC + TIMEOUT_USEC / 2)
+            break;
+
+        assert_true(write(busy[1], "x", 1) == 1);
+        assert_true(cio_poll(ctx, 10 * 1000) == 0);
+
+        struct cio_event *ev;
+        while ((ev = cio_iter(ctx))) {
+            if (cioe_is_readable(ev)) {
+                char c;
+                assert_true(read(cioe_getfd(ev), &c, 1) == 1);
+            }
+            if (cioe_is_timeout(ev)) {
+                if (cioe_get_token(ev) == 1)
+                    nr_idle++;
+                else
+                    nr_busy++;
+            }
+        }
+    }
+
+    printf("[timeout]: idle:%d, busy:%d\n", nr_idle, nr_busy);
+    assert_true(nr_idle >= 3 && nr_idle <= 4);
+    assert_true(nr_busy == 0);
+
+    // unregistered fds leave no timer behind
+    assert_true(cio_unregister(ctx, idle[0]) == 0);
+    cio_drop(ctx);
+    close(idle[0]);
+    close(idle[1]);
+    close(busy[0]);
+    close(busy[1]);
+}
+
+static void test_cio_migrate(void **status)
+{
+    (void)status;
+
+    int fds[2];
+    assert_true(pipe(fds) == 0);
+    struct cio *from = cio_new();
+    struct cio *to = cio_new();
+    int wrapper;
+    assert_true(cio_register_prio(from, fds[0], 7, CIOF_READABLE, &wrapper, CIO_PRIO_HIGH) == 0);
+    assert_true(cio_set_timeout(from, fds[0], 1000 * 1000, 0, 0) == 0);
+    assert_true(cio_migrate(from, 1024, to, NULL, NULL) == -1);
+
+    // the event polled on from is not fetched there, it moves along
+    assert_true(write(fds[1], "x", 1) == 1);
+    assert_true(cio_poll(from, 0) == 0);
+    assert_true(cio_migrate(from, fds[0], to, NULL, NULL) == 0);
+    assert_true(cio_iter(from) == NULL);
+    assert_true(cio_get_flags(from, fds[0]) == -1);
+
+    assert_true(cio_poll(to, 0) == 0);
+    assert_true(cio_get_flags(to, fds[0]) == CIOF_READABLE);
+    int nr = 0;
+    struct cio_event *ev;
+    while ((ev = cio_iter(to))) {
+        assert_true(cioe_getfd(ev) == fds[0]);
+        assert_true(cioe_get_token(ev) == 7);
+        assert_true(cioe_get_wrapper(ev) == &wrapper);
+        assert_true(cioe_is_readable(ev));
+        nr++;
+    }
+    assert_true(nr == 1);
+
+    assert_true(cio_poll(from, 0) == 0);
+    assert_true(cio_iter(from) == NULL);
+
+    assert_true(cio_unregister(to, fds[0]) == 0);
+    cio_drop(from);
+    cio_drop(to);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+#define NR_CB_FDS 4
+#define NR_CB_ROUNDS 20
+
+struct cb_pipe {
+    int fds[2];
+    int nr_calls;
+};
+
+static struct cb_pipe cb_pipes[NR_CB_FDS];
+static int cb_total = 0;
+
+static void cb_handler(struct cio *ctx, int fd, int events, void *arg)
+{
+    struct cb_pipe *p = arg;
+    assert_true(fd == p->fds[0]);
+    assert_true(events & CIOF_READABLE);
+    char c;
+    assert_true(read(fd, &c, 1) == 1);
+    p->nr_calls++;
+
+    // the first one takes the last one away, even if it is queued already
+    if (p == &cb_pipes[0] && p->nr_calls == 1)
+        assert_true(cio_unregister(ctx, cb_pipes[NR_CB_FDS - 1].fds[0]) == 0);
+
+    if (++cb_total == (NR_CB_FDS - 1) * NR_CB_ROUNDS)
+        assert_true(cio_stop(ctx) == 0);
+}
+
+static void test_cio_cb(void **status)
+{
+    (void)status;
+
+    struct cio *ctx = cio_new();
+    for (int i = 0; i < NR_CB_FDS; i++) {
+        assert_true(pipe(cb_pipes[i].fds) == 0);
+        assert_true(cio_register_cb(ctx, cb_pipes[i].fds[0], CIOF_READABLE,
+                                    cb_handler, &cb_pipes[i]) == 0);
+        for (int j = 0; j < NR_CB_ROUNDS; j++)
+            assert_true(write(cb_pipes[i].fds[1], "x", 1) == 1);
+    }
+
+    // nothing for cio_iter, the handlers are called in the round
+    assert_true(cio_poll(ctx, 0) == 0);
+    assert_true(cio_iter(ctx) == NULL);
+    assert_true(cb_pipes[NR_CB_FDS - 1].nr_calls == 0);
+
+    assert_true(cio_run(ctx, 10 * 1000) == 0);
+    printf("[cb]: %d calls\n", cb_total);
+    for (int i = 0; i < NR_CB_FDS - 1; i++)
+        assert_true(cb_pipes[i].nr_calls == NR_CB_ROUNDS);
+    assert_true(cb_pipes[NR_CB_FDS - 1].nr_calls == 0);
+
+    // handler calls are events too, they show in the rate once the window ends
+    int rate = 0;
+    usleep(110 * 1000);
+    assert_true(cio_poll(ctx, 0) == 0);
+    cio_get_load(ctx, &rate);
+    assert_true(rate > 0);
+
+    for (int i = 0; i < NR_CB_FDS; i++) {
+        cio_unregister(ctx, cb_pipes[i].fds[0]);
+        close(cb_pipes[i].fds[0]);
+        close(cb_pipes[i].fds[1]);
+    }
+    cio_drop(ctx);
+}
+
+static void *cpu_thread(void *args)
+{
+    struct cio *ctx = args;
+    assert_true(cio_get_cpu(ctx) == -1);
+#ifdef __linux__
+    assert_true(cio_set_cpu(ctx, -1) == -1 && errno == EINVAL);
+    assert_true(cio_set_cpu(ctx, CPU_SETSIZE) == -1 && errno == EINVAL);
+    assert_true(cio_get_cpu(ctx) == -1);
+
+    // cpu 0 may be outside of the affinity we run with, take one we have
+    cpu_set_t set;
+    assert_true(sched_getaffinity(0, sizeof(set), &set) == 0);
+    int cpu = 0;
+    while (!CPU_ISSET(cpu, &set))
+        cpu++;
+    assert_true(cio_set_cpu(ctx, cpu) == 0);
+    assert_true(cio_get_cpu(ctx) == cpu);
+#endif
+    return NULL;
+}
+
+static void test_cio_cpu(void **status)
+{
+    (void)status;
+
+    // pin a thread of its own, the test runner is left as is
+    struct cio *ctx = cio_new();
+    pthread_t pid;
+    pthread_create(&pid, NULL, cpu_thread, ctx);
+    pthread_join(pid, NULL);
+    cio_drop(ctx);
+}
+
+#define NR_PINGS 50
+
+struct ping_args {
+    int fd;
+    volatile uint64_t sent_usec;
+};
+
+static uint64_t now_usec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 * 1000 + tv.tv_usec;
+}
+
+static void *ping_thread(void *args)
+{
+    struct ping_args *ping = args;
+    for (int i = 0; i < NR_PINGS; i++) {
+        usleep(2000);
+        while (ping->sent_usec)
+            usleep(100);
+        ping->sent_usec = now_usec();
+        assert_true(write(ping->fd, "x", 1) == 1);
+    }
+    return NULL;
+}
+
+/**
+ * wakeup latency of a ping, and the cpu burnt, mostly by the polling thread
+ */
+static void ping_latency(uint64_t busy_poll_usec, uint64_t *latency, uint64_t *cpu)
+{
+    int fds[2];
+    assert_true(pipe(fds) == 0);
+    struct cio *ctx = cio_new();
+    cio_set_busy_poll(ctx, busy_poll_usec);
+    assert_true(cio_register(ctx, fds[0], 1, CIOF_READABLE, NULL) == 0);
+
+    struct ping_args ping = { fds[1], 0 };
+    pthread_t pid;
+    pthread_create(&pid, NULL, ping_thread, &ping);
+
+    struct rusage ru_start, ru_end;
+    getrusage(RUSAGE_SELF, &ru_start);
+    uint64_t sum = 0;
+    int nr = 0;
+    while (nr < NR_PINGS) {
+        assert_true(cio_poll(ctx, 10 * 1000) == 0);
+        struct cio_event *ev;
+        while ((ev = cio_iter(ctx))) {
+            char c;
+            assert_true(read(cioe_getfd(ev), &c, 1) == 1);
+            sum += now_usec() - ping.sent_usec;
+            ping.sent_usec = 0;
+            nr++;
+        }
+    }
+    getrusage(RUSAGE_SELF, &ru_end);
+
+    pthread_join(pid, NULL);
+    cio_drop(ctx);
+    close(fds[0]);
+    close(fds[1]);
+
+    *latency = sum / NR_PINGS;
+    *cpu = (ru_end.ru_utime.tv_sec - ru_start.ru_utime.tv_sec) * 1000 * 1000 +
+        ru_end.ru_utime.tv_usec - ru_start.ru_utime.tv_usec +
+        (ru_end.ru_stime.tv_sec - ru_start.ru_stime.tv_sec) * 1000 * 1000 +
+        ru_end.ru_stime.tv_usec - ru_start.ru_stime.tv_usec;
+}
+
+static void test_cio_busy_poll(void **status)
+{
+    (void)status;
+
+    uint64_t sleep_latency, sleep_cpu, busy_latency, busy_cpu;
+    ping_latency(0, &sleep_latency, &sleep_cpu);
+    ping_latency(10 * 1000, &busy_latency, &busy_cpu);
+    printf("[busy_poll]: sleep latency:%luus cpu:%luus, busy latency:%luus cpu:%luus\n",
+           (unsigned long)sleep_latency, (unsigned long)sleep_cpu,
+           (unsigned long)busy_latency, (unsigned long)busy_cpu);
+    // which latency wins depends on the machine, but spinning through the
+    // 2ms gaps between pings burns cpu the sleeping poll never does, twice
+    // as much leaves room for the noise of a poll that never spins
+    assert_true(sleep_latency < 1000 * 1000);
+    assert_true(busy_latency < 1000 * 1000);
+    assert_true(busy_cpu > 2 * sleep_cpu);
+}
+
 int main(void)
 {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_cio),
+        cmocka_unit_test(test_cio_defer),
+        cmocka_unit_test(test_cio_submit),
+        cmocka_unit_test(test_cio_prio),
+        cmocka_unit_test(test_cio_register_many),
+        cmocka_unit_test(test_cio_timeout),
+        cmocka_unit_test(test_cio_migrate),
+        cmocka_unit_test(test_cio_cb),
+        cmocka_unit_test(test_cio_cpu),
+        cmocka_unit_test(test_cio_busy_poll),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
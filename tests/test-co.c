@@ -0,0 +1,159 @@
+#include <sched.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "cio.h"
+#include "cio-stream.h"
+#include "cio-co.h"
+
+#define UNIX_ADDR "unix:///tmp/cio-co-test"
+#define NR_CLIENTS 100
+#define NR_ROUNDS 10
+
+static struct cio_co_sched *sched;
+static struct cio_listener *listener;
+static int nr_sessions = 0;
+static int nr_clients_finished = 0;
+
+static void session_co(void *arg)
+{
+    struct cio_stream *stream = arg;
+    char buf[256];
+
+    for (;;) {
+        int nr = cio_co_recv(stream, buf, sizeof(buf));
+        if (nr == 0 || nr == -1)
+            break;
+        assert_true(cio_co_send(stream, buf, nr) == nr);
+    }
+
+    cio_stream_drop(stream);
+}
+
+static void server_co(void *arg)
+{
+    (void)arg;
+
+    while (nr_sessions < NR_CLIENTS) {
+        struct cio_stream *stream = cio_co_accept(listener);
+        assert_true(stream);
+        nr_sessions++;
+        assert_true(cio_co_spawn(sched, session_co, stream) == 0);
+    }
+}
+
+static void client_co(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+
+    struct cio_stream *stream = cio_stream_connect(UNIX_ADDR);
+    assert_true(stream);
+
+    for (int i = 0; i < NR_ROUNDS; i++) {
+        char payload[64];
+        int len = snprintf(payload, sizeof(payload), "client %d round %d", id, i);
+        assert_true(cio_co_send(stream, payload, len) == len);
+
+        char buf[64] = {0};
+        int nr = 0;
+        while (nr < len) {
+            int rc = cio_co_recv(stream, buf + nr, len - nr);
+            assert_true(rc > 0);
+            nr += rc;
+        }
+        assert_true(memcmp(buf, payload, len) == 0);
+        cio_co_sleep(1000);
+    }
+
+    cio_stream_drop(stream);
+    nr_clients_finished++;
+}
+
+static void test_co(void **status)
+{
+    (void)status;
+
+    listener = cio_listener_bind(UNIX_ADDR);
+    assert_true(listener);
+
+    struct cio *ctx = cio_new();
+    sched = cio_co_sched_new(ctx, 32 * 1024);
+
+    assert_true(cio_co_spawn(sched, server_co, NULL) == 0);
+    for (int i = 0; i < NR_CLIENTS; i++)
+        assert_true(cio_co_spawn(sched, client_co, (void *)(intptr_t)i) == 0);
+
+    while (cio_co_run(sched, 10 * 1000) > 0);
+    printf("[co]: sessions:%d, clients finished:%d\n",
+           nr_sessions, nr_clients_finished);
+    assert_true(nr_clients_finished == NR_CLIENTS);
+
+    cio_co_sched_drop(sched);
+    cio_drop(ctx);
+    cio_listener_drop(listener);
+}
+
+static struct cio *ready_ctx;
+static int ready_done = 0;
+
+static void ready_co(void *arg)
+{
+    struct cio_stream *stream = arg;
+
+    // the data is there already, so neither call waits for a round
+    uint64_t round = cio_get_round(ready_ctx);
+    assert_true(cio_co_send(stream, "ping", 4) == 4);
+    char buf[8] = {0};
+    int nr = 0;
+    while (nr < 4) {
+        int rc = cio_co_recv(stream, buf + nr, 4 - nr);
+        assert_true(rc > 0);
+        nr += rc;
+    }
+    assert_true(memcmp(buf, "pong", 4) == 0);
+    assert_true(cio_get_round(ready_ctx) == round);
+    ready_done = 1;
+}
+
+static void test_co_ready(void **status)
+{
+    (void)status;
+
+    listener = cio_listener_bind(UNIX_ADDR);
+    assert_true(listener);
+    struct cio_stream *client = cio_stream_connect(UNIX_ADDR);
+    assert_true(client);
+    struct cio_stream *server = cio_listener_accept(listener);
+    assert_true(server);
+    assert_true(cio_stream_send(server, "pong", 4) == 4);
+
+    ready_ctx = cio_new();
+    sched = cio_co_sched_new(ready_ctx, 32 * 1024);
+    assert_true(cio_co_spawn(sched, ready_co, client) == 0);
+    while (cio_co_run(sched, 10 * 1000) > 0);
+    assert_true(ready_done);
+
+    char buf[4];
+    assert_true(cio_stream_recv(server, buf, 4) == 4);
+    assert_true(memcmp(buf, "ping", 4) == 0);
+
+    cio_co_sched_drop(sched);
+    cio_drop(ready_ctx);
+    cio_stream_drop(client);
+    cio_stream_drop(server);
+    cio_listener_drop(listener);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_co),
+        cmocka_unit_test(test_co_ready),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,165 @@
+#include <sched.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include "cio.h"
+#include "cio-executor.h"
+
+#define TOKEN_STREAM 2
+#define NR_PAIRS 16
+#define NR_BYTES 200
+
+struct pair {
+    int fds[2];
+    int in_flight;
+    int next_seq;
+};
+
+static struct pair pairs[NR_PAIRS];
+static int nr_handled = 0;
+
+static int handler(struct cio *ctx, int fd, int token, int events, void *wrapper)
+{
+    (void)ctx;
+    (void)fd;
+    assert_true(token == TOKEN_STREAM);
+    assert_true(events & CIOF_READABLE);
+
+    struct pair *pair = wrapper;
+    // one-shot dispatch never runs one fd on two workers at once
+    assert_true(__atomic_exchange_n(&pair->in_flight, 1, __ATOMIC_ACQ_REL) == 0);
+
+    unsigned char c;
+    int nr = recv(pair->fds[0], &c, 1, 0);
+    assert_true(nr == 1);
+    assert_true(c == pair->next_seq % 256);
+    pair->next_seq++;
+    usleep(100); // pretend to decode
+
+    __atomic_store_n(&pair->in_flight, 0, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&nr_handled, 1, __ATOMIC_ACQ_REL);
+    return 0;
+}
+
+static void test_executor(void **status)
+{
+    (void)status;
+
+    struct cio *ctx = cio_new();
+    struct cio_executor *exec = cio_executor_new(ctx, 4, handler);
+
+    for (int i = 0; i < NR_PAIRS; i++) {
+        assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i].fds) == 0);
+        cio_register(ctx, pairs[i].fds[0], TOKEN_STREAM, CIOF_READABLE, &pairs[i]);
+        for (int j = 0; j < NR_BYTES; j++) {
+            unsigned char c = j % 256;
+            assert_true(send(pairs[i].fds[1], &c, 1, 0) == 1);
+        }
+    }
+
+    while (__atomic_load_n(&nr_handled, __ATOMIC_ACQUIRE) != NR_PAIRS * NR_BYTES) {
+        assert_true(cio_poll(ctx, 10 * 1000) == 0);
+        struct cio_event *ev;
+        while ((ev = cio_iter(ctx)))
+            assert_true(cio_executor_dispatch(exec, ev) == 0);
+    }
+    printf("[executor]: handled %d events\n", nr_handled);
+
+    cio_executor_drop(exec);
+    for (int i = 0; i < NR_PAIRS; i++) {
+        assert_true(pairs[i].next_seq == NR_BYTES);
+        cio_unregister(ctx, pairs[i].fds[0]);
+        close(pairs[i].fds[0]);
+        close(pairs[i].fds[1]);
+    }
+    cio_drop(ctx);
+}
+
+static int merge_in_flight = 0;
+static int merge_calls = 0;
+static int merge_events = 0;
+
+static int merge_handler(struct cio *ctx, int fd, int token, int events, void *wrapper)
+{
+    (void)ctx;
+    (void)token;
+    (void)wrapper;
+    __atomic_or_fetch(&merge_events, events, __ATOMIC_ACQ_REL);
+    assert_true(__atomic_exchange_n(&merge_in_flight, 1, __ATOMIC_ACQ_REL) == 0);
+
+    // long enough for a second task of fd to run alongside if dispatched
+    usleep(50 * 1000);
+    unsigned char c;
+    while (recv(fd, &c, 1, MSG_DONTWAIT) == 1);
+    assert_true(errno == EAGAIN);
+
+    __atomic_store_n(&merge_in_flight, 0, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&merge_calls, 1, __ATOMIC_ACQ_REL);
+    return 0;
+}
+
+/**
+ * a posted event and a polled one of the same fd in one round
+ */
+static void test_executor_merge(void **status)
+{
+    (void)status;
+
+    struct cio *ctx = cio_new();
+    struct cio_executor *exec = cio_executor_new(ctx, 4, merge_handler);
+    assert_true(exec);
+
+    int fds[2];
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    cio_register(ctx, fds[0], TOKEN_STREAM, CIOF_READABLE, NULL);
+    assert_true(send(fds[1], "x", 1, 0) == 1);
+    assert_true(cio_post(ctx, fds[0], CIOF_DRAINED) == 0);
+
+    assert_true(cio_poll(ctx, 0) == 0);
+    int nr_events = 0;
+    struct cio_event *ev;
+    while ((ev = cio_iter(ctx))) {
+        assert_true(cio_executor_dispatch(exec, ev) == 0);
+        nr_events++;
+    }
+    assert_true(nr_events == 2);
+
+    // the merged event runs once more, then the fd is armed again
+    while (__atomic_load_n(&merge_calls, __ATOMIC_ACQUIRE) != 2 ||
+           cio_get_flags(ctx, fds[0]) != CIOF_READABLE) {
+        assert_true(cio_poll(ctx, 10 * 1000) == 0);
+        while ((ev = cio_iter(ctx)))
+            assert_true(cio_executor_dispatch(exec, ev) == 0);
+    }
+    assert_true(merge_events == (CIOF_READABLE | CIOF_DRAINED));
+
+    assert_true(send(fds[1], "y", 1, 0) == 1);
+    while (__atomic_load_n(&merge_calls, __ATOMIC_ACQUIRE) != 3) {
+        assert_true(cio_poll(ctx, 10 * 1000) == 0);
+        while ((ev = cio_iter(ctx)))
+            assert_true(cio_executor_dispatch(exec, ev) == 0);
+    }
+
+    cio_executor_drop(exec);
+    cio_unregister(ctx, fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+    cio_drop(ctx);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_executor),
+        cmocka_unit_test(test_executor_merge),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,287 @@
+#include <sched.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include "cio.h"
+#include "cio-stream.h"
+
+#define MEM_ADDR "mem://cio-mem-stream-test"
+#define NR_CLIENTS 16
+#define BULK_LEN (4 * 1024 * 1024)
+#define TOKEN_LISTENER 1
+#define TOKEN_STREAM 2
+#define TOKEN_CLIENT 3
+
+static void test_mem_addr(void **status)
+{
+    (void)status;
+
+    assert_true(cio_stream_connect(MEM_ADDR) == NULL);
+    assert_true(errno == ECONNREFUSED);
+
+    struct cio_listener *listener = cio_listener_bind(MEM_ADDR);
+    assert_true(listener);
+    assert_true(cio_listener_bind(MEM_ADDR) == NULL);
+    assert_true(errno == EADDRINUSE);
+
+    // a peer never accepted sees the close when the listener goes
+    struct cio_stream *stream = cio_stream_connect(MEM_ADDR);
+    assert_true(stream);
+    cio_listener_drop(listener);
+    char c;
+    assert_true(cio_stream_recv(stream, &c, 1) == 0);
+    assert_true(cio_stream_send(stream, "x", 1) == -1 && errno == EPIPE);
+    cio_stream_drop(stream);
+
+    // the name is free again
+    listener = cio_listener_bind(MEM_ADDR);
+    assert_true(listener);
+    cio_listener_drop(listener);
+}
+
+/**
+ * clients and server on one ctx and one thread, nothing goes to the kernel
+ * but socketpair wakeups and select
+ */
+static void test_mem_echo(void **status)
+{
+    (void)status;
+
+    struct cio_listener *listener = cio_listener_bind(MEM_ADDR);
+    assert_true(listener);
+    assert_true(cio_listener_set_nonblock(listener, 1) == 0);
+
+    struct cio *ctx = cio_new();
+    cio_register(ctx, cio_listener_getfd(listener), TOKEN_LISTENER,
+                 CIOF_READABLE, listener);
+
+    struct cio_stream *clients[NR_CLIENTS];
+    for (int i = 0; i < NR_CLIENTS; i++) {
+        clients[i] = cio_stream_connect(MEM_ADDR);
+        assert_true(clients[i]);
+        cio_register(ctx, cio_stream_getfd(clients[i]), TOKEN_CLIENT,
+                     CIOF_READABLE, clients[i]);
+        char payload[32];
+        int len = snprintf(payload, sizeof(payload), "client %d", i);
+        assert_true(cio_stream_send(clients[i], payload, len) == len);
+    }
+
+    int nr_accepted = 0, nr_echoed = 0, nr_fin = 0;
+    while (nr_fin < NR_CLIENTS) {
+        assert_true(cio_poll(ctx, 100 * 1000) == 0);
+
+        struct cio_event *ev;
+        while ((ev = cio_iter(ctx))) {
+            switch (cioe_get_token(ev)) {
+                case TOKEN_LISTENER: {
+                    struct cio_stream *stream;
+                    while ((stream = cio_listener_accept(listener))) {
+                        cio_register(ctx, cio_stream_getfd(stream), TOKEN_STREAM,
+                                     CIOF_READABLE, stream);
+                        nr_accepted++;
+                    }
+                    assert_true(errno == EAGAIN);
+                    break;
+                }
+                case TOKEN_STREAM: {
+                    struct cio_stream *stream = cioe_get_wrapper(ev);
+                    char buf[64];
+                    int nr = cio_stream_recv(stream, buf, sizeof(buf));
+                    if (nr == -1 && errno == EAGAIN)
+                        break;
+                    if (nr == 0) {
+                        cio_unregister(ctx, cio_stream_getfd(stream));
+                        cio_stream_drop(stream);
+                        nr_fin++;
+                        break;
+                    }
+                    assert_true(cio_stream_send(stream, buf, nr) == nr);
+                    break;
+                }
+                case TOKEN_CLIENT: {
+                    struct cio_stream *stream = cioe_get_wrapper(ev);
+                    char buf[64] = {0};
+                    int nr = cio_stream_recv(stream, buf, sizeof(buf));
+                    if (nr == -1 && errno == EAGAIN)
+                        break;
+                    assert_true(nr > 0);
+                    assert_true(strncmp(buf, "client ", 7) == 0);
+                    nr_echoed++;
+                    cio_unregister(ctx, cio_stream_getfd(stream));
+                    cio_stream_drop(stream);
+                    break;
+                }
+            }
+        }
+    }
+
+    printf("[echo]: accepted:%d, echoed:%d, fin:%d\n", nr_accepted, nr_echoed, nr_fin);
+    assert_true(nr_accepted == NR_CLIENTS);
+    assert_true(nr_echoed == NR_CLIENTS);
+
+    cio_listener_drop(listener);
+    cio_drop(ctx);
+}
+
+static void *bulk_client_thread(void *args)
+{
+    (void)args;
+
+    struct cio_stream *stream = cio_stream_connect(MEM_ADDR);
+    assert_true(stream);
+
+    struct cio *ctx = cio_new();
+    int fd = cio_stream_getfd(stream);
+
+    // more than the rings hold, so both sides see them full and empty
+    static uint8_t buf[64 * 1024];
+    size_t sent = 0;
+    int nr_waits = 0;
+    while (sent < BULK_LEN) {
+        size_t len = BULK_LEN - sent < sizeof(buf) ? BULK_LEN - sent : sizeof(buf);
+        for (size_t i = 0; i < len; i++)
+            buf[i] = (sent + i) % 251;
+        int nr = cio_stream_send(stream, buf, len);
+        if (nr == -1) {
+            // the fd turns writable once the server makes room
+            assert_true(errno == EAGAIN);
+            cio_register(ctx, fd, TOKEN_CLIENT, CIOF_WRITABLE, stream);
+            assert_true(cio_poll(ctx, 100 * 1000) == 0);
+            while (cio_iter(ctx));
+            nr_waits++;
+            continue;
+        }
+        sent += nr;
+    }
+    printf("[bulk]: client waited for room %d times\n", nr_waits);
+    cio_register(ctx, fd, TOKEN_CLIENT, CIOF_READABLE, stream);
+
+    // the ack comes back once all is received
+    for (;;) {
+        assert_true(cio_poll(ctx, 100 * 1000) == 0);
+        struct cio_event *ev = cio_iter(ctx);
+        if (ev == NULL)
+            continue;
+        char ack[8] = {0};
+        int nr = cio_stream_recv(stream, ack, sizeof(ack));
+        if (nr == -1 && errno == EAGAIN)
+            continue;
+        assert_true(nr == 4 && strcmp(ack, "ack") == 0);
+        break;
+    }
+
+    cio_stream_drop(stream);
+    cio_drop(ctx);
+    return NULL;
+}
+
+/**
+ * a full ring takes the fd out of writable, a recv on the other side
+ * brings it back
+ */
+static void test_mem_writable(void **status)
+{
+    (void)status;
+
+    struct cio_listener *listener = cio_listener_bind(MEM_ADDR);
+    assert_true(listener);
+    struct cio_stream *client = cio_stream_connect(MEM_ADDR);
+    assert_true(client);
+    struct cio_stream *server = cio_listener_accept(listener);
+    assert_true(server);
+
+    struct cio *ctx = cio_new();
+    cio_register(ctx, cio_stream_getfd(client), TOKEN_CLIENT, CIOF_WRITABLE, client);
+    assert_true(cio_poll(ctx, 0) == 0);
+    assert_true(cio_iter(ctx) != NULL);
+
+    static uint8_t buf[64 * 1024];
+    size_t sent = 0;
+    int nr;
+    while ((nr = cio_stream_send(client, buf, sizeof(buf))) > 0)
+        sent += nr;
+    assert_true(errno == EAGAIN);
+    assert_true(cio_poll(ctx, 0) == 0);
+    assert_true(cio_iter(ctx) == NULL);
+
+    assert_true(cio_stream_recv(server, buf, sizeof(buf)) == sizeof(buf));
+    assert_true(cio_poll(ctx, 0) == 0);
+    struct cio_event *ev = cio_iter(ctx);
+    assert_true(ev && cioe_is_writable(ev));
+    assert_true(cio_stream_send(client, buf, sizeof(buf)) == sizeof(buf));
+    printf("[writable]: %zu bytes filled the ring\n", sent);
+
+    cio_unregister(ctx, cio_stream_getfd(client));
+    cio_stream_drop(client);
+    cio_stream_drop(server);
+    cio_listener_drop(listener);
+    cio_drop(ctx);
+}
+
+static void test_mem_bulk(void **status)
+{
+    (void)status;
+
+    struct cio_listener *listener = cio_listener_bind(MEM_ADDR);
+    assert_true(listener);
+
+    pthread_t client_pid;
+    pthread_create(&client_pid, NULL, bulk_client_thread, NULL);
+
+    // blocks until the client connects
+    struct cio_stream *stream = cio_listener_accept(listener);
+    assert_true(stream);
+
+    struct cio *ctx = cio_new();
+    cio_register(ctx, cio_stream_getfd(stream), TOKEN_STREAM, CIOF_READABLE, stream);
+
+    size_t received = 0;
+    int fin = 0;
+    while (!fin) {
+        assert_true(cio_poll(ctx, 100 * 1000) == 0);
+        struct cio_event *ev;
+        while ((ev = cio_iter(ctx))) {
+            static uint8_t buf[32 * 1024];
+            int nr = cio_stream_recv(stream, buf, sizeof(buf));
+            if (nr == -1 && errno == EAGAIN)
+                continue;
+            if (nr == 0) {
+                fin = 1;
+                break;
+            }
+            assert_true(nr > 0);
+            for (int i = 0; i < nr; i++)
+                assert_true(buf[i] == (received + i) % 251);
+            received += nr;
+            if (received == BULK_LEN)
+                assert_true(cio_stream_send(stream, "ack", 4) == 4);
+        }
+    }
+
+    pthread_join(client_pid, NULL);
+    printf("[bulk]: received:%zu\n", received);
+    assert_true(received == BULK_LEN);
+
+    cio_unregister(ctx, cio_stream_getfd(stream));
+    cio_stream_drop(stream);
+    cio_listener_drop(listener);
+    cio_drop(ctx);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_mem_addr),
+        cmocka_unit_test(test_mem_echo),
+        cmocka_unit_test(test_mem_writable),
+        cmocka_unit_test(test_mem_bulk),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
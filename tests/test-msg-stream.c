@@ -0,0 +1,293 @@
+#include <sched.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include "cio.h"
+#include "cio-stream.h"
+#include "cio-msg.h"
+
+#define UNIX_ADDR "unix:///tmp/cio-msg-stream-test"
+#define MEM_ADDR "mem://cio-msg-stream-test"
+#define TOKEN_LISTENER 1
+#define TOKEN_STREAM 2
+#define NR_MSGS 100
+#define MAX_MSG 1024
+
+static int client_finished = 0;
+static int server_finished = 0;
+
+static void *client_thread(void *args)
+{
+    (void)args;
+
+    struct cio_stream *stream = cio_stream_connect(UNIX_ADDR);
+    assert_true(stream);
+    struct cio_msg_stream *ms = cio_msg_stream_new(stream, MAX_MSG);
+
+    struct cio *ctx = cio_new();
+    cio_register(ctx, cio_msg_stream_getfd(ms), TOKEN_STREAM,
+                 CIOF_READABLE | CIOF_WRITABLE, ms);
+
+    for (;;) {
+        if (client_finished) break;
+        assert_true(cio_poll(ctx, 100 * 1000) == 0);
+
+        struct cio_event *ev;
+        while ((ev = cio_iter(ctx))) {
+            switch (cioe_get_token(ev)) {
+                case TOKEN_STREAM: {
+                    int fd = cioe_getfd(ev);
+                    struct cio_msg_stream *ms = cioe_get_wrapper(ev);
+                    if (cioe_is_writable(ev)) {
+                        char payload[MAX_MSG];
+                        for (int i = 0; i < NR_MSGS; i++) {
+                            memset(payload, 'a' + i % 26, i);
+                            assert_true(cio_msg_stream_send(ms, payload, i) == 0);
+                        }
+                        assert_true(cio_msg_stream_send(ms, payload, MAX_MSG + 1) == -1);
+                        // all messages go out with one send
+                        while (cio_msg_stream_pending(ms))
+                            assert_true(cio_msg_stream_flush(ms) > 0);
+                        printf("[client:send]: %d messages\n", NR_MSGS);
+                        cio_register(ctx, fd, TOKEN_STREAM, CIOF_READABLE, ms);
+                    }
+                    if (cioe_is_readable(ev)) {
+                        assert_true(cio_msg_stream_fill(ms) > 0);
+                        const void *msg;
+                        size_t len;
+                        if (cio_msg_stream_next(ms, &msg, &len) == 1) {
+                            assert_true(len == strlen("done"));
+                            assert_true(memcmp(msg, "done", len) == 0);
+                            printf("[client:recv]: done\n");
+                            client_finished = 1;
+                        }
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    cio_msg_stream_drop(ms);
+    cio_drop(ctx);
+    printf("[client]: eixt\n");
+    return NULL;
+}
+
+static void *server_thread(void *args)
+{
+    (void)args;
+
+    struct cio_listener *listener = cio_listener_bind(UNIX_ADDR);
+    assert_true(listener);
+
+    struct cio *ctx = cio_new();
+    cio_register(ctx, cio_listener_getfd(listener), TOKEN_LISTENER, CIOF_READABLE, listener);
+
+    int nr_msgs = 0;
+
+    for (;;) {
+        if (server_finished && client_finished) break;
+        assert_true(cio_poll(ctx, 100 * 1000) == 0);
+
+        struct cio_event *ev;
+        while ((ev = cio_iter(ctx))) {
+            switch (cioe_get_token(ev)) {
+                case TOKEN_LISTENER: {
+                    struct cio_listener *listener = cioe_get_wrapper(ev);
+                    if (cioe_is_readable(ev)) {
+                        struct cio_stream *new_stream = cio_listener_accept(listener);
+                        struct cio_msg_stream *ms = cio_msg_stream_new(new_stream, MAX_MSG);
+                        cio_register(ctx, cio_msg_stream_getfd(ms), TOKEN_STREAM,
+                                     CIOF_READABLE, ms);
+                    }
+                    break;
+                }
+                case TOKEN_STREAM: {
+                    struct cio_msg_stream *ms = cioe_get_wrapper(ev);
+                    if (cioe_is_readable(ev)) {
+                        int nr = cio_msg_stream_fill(ms);
+                        if (nr == 0 || nr == -1) {
+                            printf("[server:recv]: nr:%d, client fin\n", nr);
+                            cio_unregister(ctx, cio_msg_stream_getfd(ms));
+                            cio_msg_stream_drop(ms);
+                            server_finished = 1;
+                            break;
+                        }
+
+                        const void *msg;
+                        size_t len;
+                        while (cio_msg_stream_next(ms, &msg, &len) == 1) {
+                            assert_true(len == (size_t)nr_msgs);
+                            for (size_t i = 0; i < len; i++)
+                                assert_true(((char *)msg)[i] == 'a' + nr_msgs % 26);
+                            nr_msgs++;
+                        }
+                        printf("[server:recv]: nr:%d, msgs:%d\n", nr, nr_msgs);
+
+                        if (nr_msgs == NR_MSGS) {
+                            cio_msg_stream_send(ms, "done", strlen("done"));
+                            assert_true(cio_msg_stream_flush(ms) ==
+                                        CIO_MSG_HDR_LEN + (int)strlen("done"));
+                        }
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    cio_listener_drop(listener);
+    cio_drop(ctx);
+    printf("[server]: eixt\n");
+    return NULL;
+}
+
+static void test_msg_stream(void **status)
+{
+    (void)status;
+
+    pthread_t server_pid;
+    pthread_create(&server_pid, NULL, server_thread, NULL);
+    sleep(1);
+    pthread_t client_pid;
+    pthread_create(&client_pid, NULL, client_thread, NULL);
+
+    for (;;) {
+        if (client_finished && server_finished) {
+            break;
+        } else {
+            sleep(1);
+        }
+    }
+
+    pthread_join(client_pid, NULL);
+    pthread_join(server_pid, NULL);
+}
+
+static void test_msg_stream_limits(void **status)
+{
+    (void)status;
+
+    struct cio_listener *listener = cio_listener_bind(MEM_ADDR);
+    assert_true(listener);
+    struct cio_stream *stream = cio_stream_connect(MEM_ADDR);
+    assert_true(stream);
+
+    // the rx buffer would be too large, the stream stays with the caller
+    assert_true(cio_msg_stream_new(stream, (size_t)CIO_MSG_MAX + 1) == NULL);
+    assert_true(errno == EINVAL);
+
+    struct cio_msg_stream *ms = cio_msg_stream_new(stream, MAX_MSG);
+    assert_true(ms);
+
+    char payload[MAX_MSG + 1] = {0};
+    assert_true(cio_msg_stream_send(ms, payload, MAX_MSG + 1) == -1);
+    assert_true(errno == EMSGSIZE);
+
+    // nothing is flushed, so the queue fills up and stops growing
+    int nr = 0;
+    while (cio_msg_stream_send(ms, payload, MAX_MSG) == 0)
+        nr++;
+    assert_true(errno == ENOBUFS);
+    printf("[limits]: %d messages queued, %zu bytes\n", nr, cio_msg_stream_pending(ms));
+    assert_true(nr > 0);
+    assert_true(cio_msg_stream_pending(ms) == (size_t)nr * (CIO_MSG_HDR_LEN + MAX_MSG));
+
+    cio_msg_stream_drop(ms);
+    cio_listener_drop(listener);
+}
+
+/**
+ * fill until it fails for another reason than no data
+ */
+static int fill_full(struct cio_msg_stream *ms)
+{
+    for (;;) {
+        int nr = cio_msg_stream_fill(ms);
+        if (nr == -1 && errno != EAGAIN)
+            return -1;
+        assert_true(nr != 0);
+    }
+}
+
+static void send_all(struct cio_stream *stream, const void *buf, size_t len)
+{
+    while (len) {
+        int nr = cio_stream_send(stream, buf, len);
+        assert_true(nr > 0);
+        buf = (const uint8_t *)buf + nr;
+        len -= nr;
+    }
+}
+
+/**
+ * a buffer full of unfetched messages is not a protocol error
+ */
+static void test_msg_stream_full(void **status)
+{
+    (void)status;
+
+    struct cio_listener *listener = cio_listener_bind(MEM_ADDR);
+    assert_true(listener);
+    struct cio_stream *client = cio_stream_connect(MEM_ADDR);
+    assert_true(client);
+    struct cio_stream *server = cio_listener_accept(listener);
+    assert_true(server);
+    assert_true(cio_stream_set_nonblock(server, 1) == 0);
+    struct cio_msg_stream *ms = cio_msg_stream_new(server, MAX_MSG);
+    assert_true(ms);
+
+    // more complete messages than the 64KB rx buffer holds
+    static uint8_t frame[CIO_MSG_HDR_LEN + MAX_MSG];
+    frame[2] = MAX_MSG >> 8;
+    frame[3] = MAX_MSG & 0xff;
+    for (int i = 0; i < 96; i++)
+        send_all(client, frame, sizeof(frame));
+    assert_true(fill_full(ms) == -1 && errno == ENOBUFS);
+
+    // fetching one makes room
+    const void *msg;
+    size_t len;
+    assert_true(cio_msg_stream_next(ms, &msg, &len) == 1 && len == MAX_MSG);
+    assert_true(cio_msg_stream_fill(ms) > 0);
+    while (cio_msg_stream_next(ms, &msg, &len) == 1);
+    cio_msg_stream_drop(ms);
+    cio_stream_drop(client);
+
+    // a too long message fills it too, but that is a protocol error
+    client = cio_stream_connect(MEM_ADDR);
+    assert_true(client);
+    server = cio_listener_accept(listener);
+    assert_true(server);
+    assert_true(cio_stream_set_nonblock(server, 1) == 0);
+    ms = cio_msg_stream_new(server, MAX_MSG);
+    assert_true(ms);
+    memset(frame, 0xff, CIO_MSG_HDR_LEN);
+    for (int i = 0; i < 96; i++)
+        send_all(client, frame, sizeof(frame));
+    assert_true(fill_full(ms) == -1 && errno == EPROTO);
+    assert_true(cio_msg_stream_next(ms, &msg, &len) == -1);
+
+    cio_msg_stream_drop(ms);
+    cio_stream_drop(client);
+    cio_listener_drop(listener);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_msg_stream),
+        cmocka_unit_test(test_msg_stream_limits),
+        cmocka_unit_test(test_msg_stream_full),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
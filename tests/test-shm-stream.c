@@ -0,0 +1,278 @@
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include "cio.h"
+#include "cio-stream.h"
+
+#define SHM_ADDR "shm:///tmp/cio-shm-stream-test"
+#define TOKEN_LISTENER 1
+#define TOKEN_STREAM 2
+#define BAD_PEER_PATH "/tmp/cio-shm-stream-bad-peer"
+#define SHM_MAGIC 0x63696f73
+
+static int client_finished = 0;
+static int server_finished = 0;
+
+static void *client_thread(void *args)
+{
+    (void)args;
+
+    struct cio_stream *stream = cio_stream_connect(SHM_ADDR);
+    assert_true(stream);
+
+    struct cio *ctx = cio_new();
+    cio_register(ctx, cio_stream_getfd(stream), TOKEN_STREAM,
+                 CIOF_READABLE | CIOF_WRITABLE, stream);
+
+    for (;;) {
+        if (client_finished) break;
+        assert_true(cio_poll(ctx, 100 * 1000) == 0);
+
+        struct cio_event *ev;
+        while ((ev = cio_iter(ctx))) {
+            printf("[client:iter]: fetch a event on client: token:%d, read:%d, write:%d\n",
+                   cioe_get_token(ev), cioe_is_readable(ev), cioe_is_writable(ev));
+            switch (cioe_get_token(ev)) {
+                case TOKEN_STREAM: {
+                    int fd = cioe_getfd(ev);
+                    struct cio_stream *stream = cioe_get_wrapper(ev);
+                    if (cioe_is_writable(ev)) {
+                        char *payload = "from client";
+                        int nr = cio_stream_send(stream, payload, strlen(payload));
+                        assert_true(nr > 0);
+                        printf("[client:send]: nr:%d, buf:%s\n", nr, payload);
+                        // send once, then wait response
+                        cio_register(ctx, fd, TOKEN_STREAM, CIOF_READABLE, stream);
+                    }
+                    if (cioe_is_readable(ev)) {
+                        char buf[256] = {0};
+                        int nr = cio_stream_recv(stream, buf, sizeof(buf));
+                        if (nr == -1 && errno == EAGAIN)
+                            break;
+                        assert_true(nr > 0);
+                        printf("[client:recv]: nr:%d, buf:%s\n", nr, buf);
+                        client_finished = 1;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    cio_stream_drop(stream);
+    cio_drop(ctx);
+    printf("[client]: eixt\n");
+    return NULL;
+}
+
+static void *server_thread(void *args)
+{
+    (void)args;
+
+    struct cio_listener *listener = cio_listener_bind(SHM_ADDR);
+    assert_true(listener);
+
+    struct cio *ctx = cio_new();
+    cio_register(ctx, cio_listener_getfd(listener), TOKEN_LISTENER, CIOF_READABLE, listener);
+
+    for (;;) {
+        if (server_finished && client_finished) break;
+        assert_true(cio_poll(ctx, 100 * 1000) == 0);
+
+        struct cio_event *ev;
+        while ((ev = cio_iter(ctx))) {
+            printf("[server:iter]: fetch a event on server: token:%d, read:%d, write:%d\n",
+                   cioe_get_token(ev), cioe_is_readable(ev), cioe_is_writable(ev));
+            switch (cioe_get_token(ev)) {
+                case TOKEN_LISTENER: {
+                    struct cio_listener *listener = cioe_get_wrapper(ev);
+                    if (cioe_is_readable(ev)) {
+                        struct cio_stream *new_stream = cio_listener_accept(listener);
+                        cio_register(ctx, cio_stream_getfd(new_stream), TOKEN_STREAM,
+                                     CIOF_READABLE | CIOF_WRITABLE, new_stream);
+                    }
+                    break;
+                }
+                case TOKEN_STREAM: {
+                    struct cio_stream *stream =
+                        (struct cio_stream *)cioe_get_wrapper(ev);
+                    if (cioe_is_readable(ev)) {
+                        char buf[256] = {0};
+                        int nr = cio_stream_recv(stream, buf, sizeof(buf));
+                        if (nr == -1 && errno == EAGAIN)
+                            break;
+                        if (nr == 0 || nr == -1) {
+                            printf("[server:recv]: nr:%d, client fin\n", nr);
+                            cio_unregister(ctx, cio_stream_getfd(stream));
+                            cio_stream_drop(stream);
+                            server_finished = 1;
+                        } else {
+                            printf("[server:recv]: nr:%d, buf:%s\n", nr, buf);
+                            if (cioe_is_writable(ev)) {
+                                char *payload = "from server";
+                                cio_stream_send(stream, payload, strlen(payload));
+                                printf("[server:send]: nr:%d, buf:%s\n",
+                                       (int)strlen(payload), payload);
+                            }
+                        }
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    cio_listener_drop(listener);
+    cio_drop(ctx);
+    printf("[server]: eixt\n");
+    return NULL;
+}
+
+static void test_shm_stream(void **status)
+{
+    (void)status;
+
+    pthread_t server_pid;
+    pthread_create(&server_pid, NULL, server_thread, NULL);
+    sleep(1);
+    pthread_t client_pid;
+    pthread_create(&client_pid, NULL, client_thread, NULL);
+
+    for (;;) {
+        if (client_finished && server_finished) {
+            break;
+        } else {
+            sleep(1);
+        }
+    }
+
+    pthread_join(client_pid, NULL);
+    pthread_join(server_pid, NULL);
+}
+
+struct bad_peer {
+    int listen_fd;
+    uint32_t ring_size;     /* sent over the socket */
+    uint32_t hdr_ring_size; /* written to the shared header */
+    size_t memfd_len;
+    int nr_fds; /* passed, 5 unless it lies about them too */
+};
+
+static int count_fds(void)
+{
+    int n = 0;
+    DIR *dir = opendir("/proc/self/fd");
+    assert_true(dir);
+    while (readdir(dir))
+        n++;
+    closedir(dir);
+    return n;
+}
+
+/**
+ * the accept side of a shm stream done by hand, lying about the ring
+ */
+static void *bad_peer_thread(void *args)
+{
+    struct bad_peer *peer = args;
+    int fd = accept(peer->listen_fd, NULL, NULL);
+    assert_true(fd != -1);
+
+    // the memfd and a wake socketpair per side
+    int fds[5];
+    fds[0] = memfd_create("cio-shm-bad-peer", MFD_CLOEXEC);
+    assert_true(fds[0] != -1);
+    assert_true(ftruncate(fds[0], peer->memfd_len) == 0);
+    uint32_t *hdr = mmap(NULL, 8, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    assert_true(hdr != MAP_FAILED);
+    hdr[0] = SHM_MAGIC;
+    hdr[1] = peer->hdr_ring_size;
+    munmap(hdr, 8);
+    assert_true(socketpair(PF_UNIX, SOCK_STREAM, 0, fds + 1) == 0);
+    assert_true(socketpair(PF_UNIX, SOCK_STREAM, 0, fds + 3) == 0);
+
+    struct iovec iov = { &peer->ring_size, sizeof(peer->ring_size) };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(5 * sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(peer->nr_fds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, peer->nr_fds * sizeof(int));
+    msg.msg_controllen = CMSG_SPACE(peer->nr_fds * sizeof(int));
+    assert_true(sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(peer->ring_size));
+
+    for (int i = 0; i < 5; i++)
+        close(fds[i]);
+    close(fd);
+    return NULL;
+}
+
+static void test_shm_bad_peer(void **status)
+{
+    (void)status;
+
+    unlink(BAD_PEER_PATH);
+    int listen_fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    assert_true(listen_fd != -1);
+    struct sockaddr_un sockaddr = {0};
+    sockaddr.sun_family = PF_UNIX;
+    snprintf(sockaddr.sun_path, sizeof(sockaddr.sun_path), "%s", BAD_PEER_PATH);
+    assert_true(bind(listen_fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) == 0);
+    assert_true(listen(listen_fd, 1) == 0);
+
+    struct bad_peer peers[] = {
+        // not a power of two
+        { listen_fd, 3000, 3000, 1 << 20, 5 },
+        // the header says something else than the socket
+        { listen_fd, 4096, 8192, 1 << 20, 5 },
+        // the memfd is too short for the rings
+        { listen_fd, 1 << 20, 1 << 20, 4096, 5 },
+        // fds missing
+        { listen_fd, 4096, 4096, 1 << 20, 3 },
+    };
+    for (size_t i = 0; i < sizeof(peers) / sizeof(peers[0]); i++) {
+        int nr_open = count_fds();
+        pthread_t pid;
+        pthread_create(&pid, NULL, bad_peer_thread, &peers[i]);
+        assert_true(cio_stream_connect("shm://" BAD_PEER_PATH) == NULL);
+        assert_true(errno == EPROTO);
+        pthread_join(pid, NULL);
+        // nothing passed along is leaked
+        assert_true(count_fds() == nr_open);
+    }
+
+    close(listen_fd);
+    unlink(BAD_PEER_PATH);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_shm_stream),
+        cmocka_unit_test(test_shm_bad_peer),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
@@ -28,6 +29,7 @@ static void *client_thread(void *args)
 
     struct cio_stream *stream = cio_stream_connect(TCP_ADDR);
     assert_true(stream);
+    assert_true(cio_stream_set_keepalive(stream, 60, 10, 3) == 0);
 
     struct cio *ctx = cio_new();
     cio_register(ctx, cio_stream_getfd(stream), TOKEN_STREAM,
@@ -154,10 +156,108 @@ static void test_tcp_stream(void **status)
     pthread_join(server_pid, NULL);
 }
 
+#define ZC_ADDR "tcp://127.0.0.1:1227"
+#define ZC_CHUNK (64 * 1024)
+#define ZC_LEN (4 * 1024 * 1024)
+
+static void test_tcp_zerocopy(void **status)
+{
+    (void)status;
+
+    struct cio_listener *listener = cio_listener_bind(ZC_ADDR);
+    assert_true(listener);
+    struct cio_stream *client = cio_stream_connect(ZC_ADDR);
+    assert_true(client);
+    struct cio_stream *server = cio_listener_accept(listener);
+    assert_true(server);
+    assert_true(cio_stream_set_nonblock(client, 1) == 0);
+    assert_true(cio_stream_set_nonblock(server, 1) == 0);
+
+    if (cio_stream_set_zerocopy(client, 1) == -1) {
+        printf("[zerocopy]: not supported, skipped\n");
+        goto out;
+    }
+
+    uint8_t *payload = malloc(ZC_CHUNK);
+    for (int i = 0; i < ZC_CHUNK; i++)
+        payload[i] = i % 251;
+
+    struct cio *ctx = cio_new();
+    assert_true(cio_stream_bind(client, ctx) == 0);
+    cio_register(ctx, cio_stream_getfd(client), TOKEN_STREAM, CIOF_READABLE, client);
+
+    // one buf in flight at a time, it is reused once its send completes
+    size_t sent = 0, received = 0;
+    uint32_t nr_sends = 0, done = 0;
+    int nr_events = 0, inflight = 0;
+    while (sent < ZC_LEN || received < sent || done != nr_sends) {
+        if (!inflight && sent < ZC_LEN) {
+            uint32_t id;
+            int nr = cio_stream_send_zerocopy(client, payload, ZC_CHUNK, &id);
+            if (nr > 0) {
+                assert_true(id == nr_sends);
+                nr_sends++;
+                sent += nr;
+                inflight = 1;
+            }
+        }
+
+        char buf[ZC_CHUNK];
+        int nr = cio_stream_recv(server, buf, sizeof(buf));
+        if (nr > 0)
+            received += nr;
+
+        assert_true(cio_poll(ctx, 1000) == 0);
+        struct cio_event *ev;
+        while ((ev = cio_iter(ctx))) {
+            if (cioe_is_zerocopy(ev))
+                nr_events++;
+            // reaps the completions that made it readable
+            if (cioe_is_readable(ev))
+                cio_stream_recv(client, buf, sizeof(buf));
+        }
+        cio_stream_reap_zerocopy(client, &done);
+        if (done == nr_sends)
+            inflight = 0;
+    }
+
+    printf("[zerocopy]: sends:%u, done:%u, events:%d\n", nr_sends, done, nr_events);
+    assert_true(received == sent);
+    assert_true(nr_events > 0);
+#ifdef __linux__
+    // set by the packets received
+    assert_true(cio_stream_get_incoming_cpu(server) >= 0);
+#endif
+
+    // a completion alone makes a blocking stream readable, recv mustn't hang
+    assert_true(cio_stream_set_nonblock(client, 0) == 0);
+    assert_true(cio_stream_send_zerocopy(client, payload, ZC_CHUNK, NULL) > 0);
+    int readable = 0;
+    while (!readable) {
+        assert_true(cio_poll(ctx, 1000) == 0);
+        struct cio_event *ev;
+        while ((ev = cio_iter(ctx)))
+            readable |= cioe_is_readable(ev);
+    }
+    char c;
+    assert_true(cio_stream_recv(client, &c, 1) == -1 && errno == EAGAIN);
+    cio_stream_reap_zerocopy(client, &done);
+    assert_true(done == nr_sends + 1);
+
+    cio_unregister(ctx, cio_stream_getfd(client));
+    cio_drop(ctx);
+    free(payload);
+out:
+    cio_stream_drop(client);
+    cio_stream_drop(server);
+    cio_listener_drop(listener);
+}
+
 int main(void)
 {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_tcp_stream),
+        cmocka_unit_test(test_tcp_zerocopy),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
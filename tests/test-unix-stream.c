@@ -8,12 +8,15 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "cio.h"
 #include "cio-stream.h"
+#include "cio-buf.h"
 
 #define UNIX_ADDR "unix:///tmp/cio-unix-stream-test"
 #define TOKEN_LISTENER 1
@@ -155,10 +158,693 @@ static void test_unix_stream(void **status)
     pthread_join(server_pid, NULL);
 }
 
+#define CORK_ADDR "unix:///tmp/cio-unix-cork-test"
+
+static void test_unix_cork(void **status)
+{
+    (void)status;
+
+    struct cio_listener *listener = cio_listener_bind(CORK_ADDR);
+    assert_true(listener);
+    struct cio_stream *client = cio_stream_connect(CORK_ADDR);
+    assert_true(client);
+    struct cio_stream *stream = cio_listener_accept(listener);
+    assert_true(stream);
+    assert_true(cio_stream_set_nonblock(client, 1) == 0);
+
+    struct cio *ctx = cio_new();
+    struct cio *other = cio_new();
+    assert_true(cio_stream_cork(stream, ctx) == 0);
+    assert_true(cio_stream_cork(stream, other) == -1);
+
+    // nothing goes out while corked
+    struct cio_iovec iov[2] = { { "wor", 3 }, { "ld", 2 } };
+    assert_true(cio_stream_send(stream, "hello ", 6) == 6);
+    assert_true(cio_stream_sendv(stream, iov, 2) == 5);
+    char buf[64] = {0};
+    assert_true(cio_stream_recv(client, buf, sizeof(buf)) == -1 && errno == EAGAIN);
+
+    // the next poll flushes all of it in order
+    assert_true(cio_poll(ctx, 0) == 0);
+    assert_true(cio_stream_recv(client, buf, sizeof(buf)) == 11);
+    assert_true(strcmp(buf, "hello world") == 0);
+
+    // uncork flushes at once and later sends go straight out
+    assert_true(cio_stream_send(stream, "abc", 3) == 3);
+    assert_true(cio_stream_recv(client, buf, sizeof(buf)) == -1 && errno == EAGAIN);
+    assert_true(cio_stream_uncork(stream) == 0);
+    assert_true(cio_stream_send(stream, "def", 3) == 3);
+    assert_true(cio_stream_flush(stream) == 0);
+    memset(buf, 0, sizeof(buf));
+    int nr = 0;
+    while (nr < 6) {
+        int rc = cio_stream_recv(client, buf + nr, sizeof(buf) - nr);
+        assert_true(rc > 0);
+        nr += rc;
+    }
+    assert_true(strcmp(buf, "abcdef") == 0);
+
+    cio_stream_drop(stream);
+    cio_stream_drop(client);
+    cio_drop(other);
+    cio_drop(ctx);
+    cio_listener_drop(listener);
+}
+
+#define SENDQ_ADDR "unix:///tmp/cio-unix-sendq-test"
+#define SENDQ_LIMIT (64 * 1024)
+#define SENDQ_LOW (16 * 1024)
+
+static void test_unix_sendq(void **status)
+{
+    (void)status;
+
+    struct cio_listener *listener = cio_listener_bind(SENDQ_ADDR);
+    assert_true(listener);
+    struct cio_stream *client = cio_stream_connect(SENDQ_ADDR);
+    assert_true(client);
+    struct cio_stream *stream = cio_listener_accept(listener);
+    assert_true(stream);
+
+    struct cio *ctx = cio_new();
+    int fd = cio_stream_getfd(stream);
+    cio_register(ctx, fd, TOKEN_STREAM, CIOF_READABLE, stream);
+    assert_true(cio_stream_set_sendq(stream, ctx, SENDQ_LIMIT, SENDQ_LOW,
+                                     CIO_SENDQ_SIGNAL) == 0);
+
+    // the client doesn't read, so the socket fills and then the queue
+    char msg[4096];
+    memset(msg, 'x', sizeof(msg));
+    size_t sent = 0;
+    for (;;) {
+        int nr = cio_stream_send(stream, msg, sizeof(msg));
+        if (nr == -1) {
+            assert_true(errno == EAGAIN);
+            break;
+        }
+        assert_true(nr == sizeof(msg));
+        sent += nr;
+    }
+    int queued = cio_stream_flush(stream);
+    assert_true(queued > SENDQ_LOW && queued <= SENDQ_LIMIT);
+
+    // drain on the client until the producer is signaled
+    int drained = 0;
+    char buf[4096];
+    while (!drained) {
+        cio_stream_recv(client, buf, sizeof(buf));
+        assert_true(cio_poll(ctx, 0) == 0);
+        struct cio_event *ev;
+        while ((ev = cio_iter(ctx))) {
+            if (cioe_get_token(ev) == TOKEN_STREAM && cioe_is_drained(ev))
+                drained = 1;
+        }
+    }
+    assert_true(cio_stream_flush(stream) <= SENDQ_LOW);
+
+    // the slow consumer is evicted
+    assert_true(cio_stream_set_sendq(stream, ctx, SENDQ_LIMIT, SENDQ_LOW,
+                                     CIO_SENDQ_DISCONNECT) == 0);
+    for (;;) {
+        int nr = cio_stream_send(stream, msg, sizeof(msg));
+        if (nr == -1) {
+            assert_true(errno == ENOBUFS);
+            break;
+        }
+    }
+    assert_true(cio_stream_send(stream, msg, sizeof(msg)) == -1);
+    while (cio_stream_recv(client, buf, sizeof(buf)) > 0);
+    printf("[sendq]: sent:%zu before signaled, peer evicted\n", sent);
+
+    cio_unregister(ctx, fd);
+    cio_stream_drop(stream);
+    cio_stream_drop(client);
+    cio_drop(ctx);
+    cio_listener_drop(listener);
+}
+
+/**
+ * a bounded queue takes vectored sends as whole messages too
+ */
+static void test_unix_sendq_sendv(void **status)
+{
+    (void)status;
+
+    struct cio_listener *listener = cio_listener_bind(SENDQ_ADDR);
+    assert_true(listener);
+    struct cio_stream *client = cio_stream_connect(SENDQ_ADDR);
+    assert_true(client);
+    struct cio_stream *stream = cio_listener_accept(listener);
+    assert_true(stream);
+
+    struct cio *ctx = cio_new();
+    assert_true(cio_stream_set_sendq(stream, ctx, SENDQ_LIMIT, SENDQ_LOW,
+                                     CIO_SENDQ_SIGNAL) == 0);
+
+    // the stream is blocking, a full socket must queue rather than block
+    static char head[1024], body[3072];
+    struct cio_iovec iov[2] = { { head, sizeof(head) }, { body, sizeof(body) } };
+    size_t sent = 0;
+    for (;;) {
+        memset(head, 'a' + sent / 4096 % 26, sizeof(head));
+        memset(body, 'A' + sent / 4096 % 26, sizeof(body));
+        int nr = cio_stream_sendv(stream, iov, 2);
+        if (nr == -1) {
+            assert_true(errno == EAGAIN);
+            break;
+        }
+        assert_true(nr == sizeof(head) + sizeof(body));
+        sent += nr;
+    }
+    int queued = cio_stream_flush(stream);
+    assert_true(queued > SENDQ_LOW && queued <= SENDQ_LIMIT);
+
+    // every message arrives whole and in order
+    assert_true(cio_stream_set_nonblock(client, 1) == 0);
+    static char buf[4096];
+    size_t received = 0;
+    while (received < sent) {
+        assert_true(cio_poll(ctx, 0) == 0);
+        while (cio_iter(ctx));
+        int nr = cio_stream_recv(client, buf, sizeof(buf));
+        if (nr == -1) {
+            assert_true(errno == EAGAIN);
+            continue;
+        }
+        assert_true(nr > 0);
+        for (int i = 0; i < nr; i++, received++) {
+            size_t off = received % 4096;
+            char c = off < sizeof(head) ? 'a' : 'A';
+            assert_true(buf[i] == c + received / 4096 % 26);
+        }
+    }
+    assert_true(received == sent);
+    assert_true(cio_stream_flush(stream) == 0);
+
+    // and evicts on them
+    assert_true(cio_stream_set_sendq(stream, ctx, SENDQ_LIMIT, SENDQ_LOW,
+                                     CIO_SENDQ_DISCONNECT) == 0);
+    int nr;
+    while ((nr = cio_stream_sendv(stream, iov, 2)) > 0)
+        assert_true(nr == sizeof(head) + sizeof(body));
+    assert_true(errno == ENOBUFS);
+    printf("[sendq_sendv]: sent:%zu before signaled\n", sent);
+
+    cio_stream_drop(stream);
+    cio_stream_drop(client);
+    cio_drop(ctx);
+    cio_listener_drop(listener);
+}
+
+static void test_unix_sendq_drop(void **status)
+{
+    (void)status;
+
+    struct cio_listener *listener = cio_listener_bind(SENDQ_ADDR);
+    assert_true(listener);
+    struct cio_stream *client = cio_stream_connect(SENDQ_ADDR);
+    assert_true(client);
+    struct cio_stream *stream = cio_listener_accept(listener);
+    assert_true(stream);
+
+    struct cio *ctx = cio_new();
+    assert_true(cio_stream_set_sendq(stream, ctx, 8, 0, CIO_SENDQ_DROP_OLDEST) == 0);
+    assert_true(cio_stream_cork(stream, ctx) == 0);
+
+    // a vectored send is one message, dropped whole to make room
+    struct cio_iovec iov[2] = { { "AAAA", 4 }, { "BBBB", 4 } };
+    assert_true(cio_stream_sendv(stream, iov, 2) == 8);
+    assert_true(cio_stream_send(stream, "CCCC", 4) == 4);
+    assert_true(cio_stream_uncork(stream) == 0);
+
+    char buf[64] = {0};
+    int nr = 0;
+    while (nr < 4) {
+        int rc = cio_stream_recv(client, buf + nr, sizeof(buf) - nr);
+        assert_true(rc > 0);
+        nr += rc;
+    }
+    assert_true(cio_stream_set_nonblock(client, 1) == 0);
+    assert_true(cio_stream_recv(client, buf + nr, sizeof(buf) - nr) == -1);
+    assert_true(errno == EAGAIN);
+    printf("[sendq_drop]: wire:%s\n", buf);
+    assert_true(strcmp(buf, "CCCC") == 0);
+
+    cio_stream_drop(stream);
+    cio_stream_drop(client);
+    cio_drop(ctx);
+    cio_listener_drop(listener);
+}
+
+/**
+ * the ctx goes first, with a flush deferred and a rate timer armed
+ */
+static void test_unix_ctx_drop(void **status)
+{
+    (void)status;
+
+    struct cio_listener *listener = cio_listener_bind(SENDQ_ADDR);
+    assert_true(listener);
+    struct cio_stream *client = cio_stream_connect(SENDQ_ADDR);
+    assert_true(client);
+    struct cio_stream *stream = cio_listener_accept(listener);
+    assert_true(stream);
+
+    // one token, the second byte throttles the stream
+    assert_true(cio_stream_send(client, "abc", 3) == 3);
+    struct cio *ctx = cio_new();
+    assert_true(cio_stream_set_rate(stream, ctx, 1, 0, 0) == 0);
+    char c;
+    assert_true(cio_stream_recv(stream, &c, 1) == 1);
+    assert_true(cio_stream_recv(stream, &c, 1) == -1 && errno == EAGAIN);
+    assert_true(cio_stream_set_rate(stream, ctx, 0, 0, 0) == 0);
+
+    // the client doesn't read, so the flush defers itself again
+    char msg[4096];
+    memset(msg, 'x', sizeof(msg));
+    assert_true(cio_stream_cork(stream, ctx) == 0);
+    for (int i = 0; i < 256; i++)
+        assert_true(cio_stream_send(stream, msg, sizeof(msg)) == sizeof(msg));
+    assert_true(cio_stream_uncork(stream) > 0);
+    assert_true(cio_poll(ctx, 0) == 0);
+    assert_true(cio_stream_set_rate(stream, ctx, 1, 0, 0) == 0);
+    assert_true(cio_stream_recv(stream, &c, 1) == 1);
+    assert_true(cio_stream_recv(stream, &c, 1) == -1 && errno == EAGAIN);
+    cio_drop(ctx);
+
+    // queued data goes out on the next ctx
+    ctx = cio_new();
+    assert_true(cio_stream_bind(stream, ctx) == 0);
+    assert_true(cio_stream_set_rate(stream, ctx, 0, 0, 0) == 0);
+    size_t received = 0;
+    while (received < 256 * sizeof(msg)) {
+        assert_true(cio_poll(ctx, 0) == 0);
+        int nr = cio_stream_recv(client, msg, sizeof(msg));
+        assert_true(nr > 0);
+        received += nr;
+    }
+    assert_true(cio_stream_flush(stream) == 0);
+
+    cio_drop(ctx);
+    cio_stream_drop(stream);
+    cio_stream_drop(client);
+    cio_listener_drop(listener);
+}
+
+#define MIGRATE_ADDR "unix:///tmp/cio-unix-migrate-test"
+
+static volatile int migrate_stop = 0;
+static volatile int migrate_drained = 0;
+
+static void *migrate_thread(void *args)
+{
+    struct cio *ctx = args;
+    while (!migrate_stop) {
+        assert_true(cio_poll(ctx, 1000) == 0);
+        struct cio_event *ev;
+        while ((ev = cio_iter(ctx))) {
+            if (cioe_get_token(ev) == TOKEN_STREAM && cioe_is_drained(ev))
+                migrate_drained = 1;
+        }
+    }
+    return NULL;
+}
+
+static void test_unix_migrate(void **status)
+{
+    (void)status;
+
+    struct cio_listener *listener = cio_listener_bind(MIGRATE_ADDR);
+    assert_true(listener);
+    struct cio_stream *client = cio_stream_connect(MIGRATE_ADDR);
+    assert_true(client);
+    struct cio_stream *stream = cio_listener_accept(listener);
+    assert_true(stream);
+
+    struct cio *from = cio_new();
+    struct cio *to = cio_new();
+    int fd = cio_stream_getfd(stream);
+    cio_register(from, fd, TOKEN_STREAM, CIOF_READABLE, stream);
+    assert_true(cio_stream_set_sendq(stream, from, SENDQ_LIMIT, SENDQ_LOW,
+                                     CIO_SENDQ_SIGNAL) == 0);
+
+    // fill the socket and the queue, then hand the stream over
+    char msg[4096];
+    memset(msg, 'x', sizeof(msg));
+    size_t sent = 0;
+    while (cio_stream_send(stream, msg, sizeof(msg)) == sizeof(msg))
+        sent += sizeof(msg);
+    assert_true(cio_stream_flush(stream) > 0);
+
+    pthread_t pid;
+    pthread_create(&pid, NULL, migrate_thread, to);
+    assert_true(cio_stream_migrate(stream, to, from) == -1);
+    assert_true(cio_stream_migrate(stream, from, to) == 0);
+    assert_true(cio_get_flags(from, fd) == -1);
+
+    // the queued tail is flushed by to
+    size_t received = 0;
+    char buf[4096];
+    while (received < sent) {
+        int nr = cio_stream_recv(client, buf, sizeof(buf));
+        assert_true(nr > 0);
+        received += nr;
+    }
+    while (!migrate_drained)
+        usleep(1000);
+    migrate_stop = 1;
+    pthread_join(pid, NULL);
+    printf("[migrate]: sent:%zu, received:%zu\n", sent, received);
+
+    assert_true(cio_unregister(to, fd) == 0);
+    cio_stream_drop(stream);
+    cio_stream_drop(client);
+    cio_drop(from);
+    cio_drop(to);
+    cio_listener_drop(listener);
+}
+
+#define BROADCAST_ADDR "unix:///tmp/cio-unix-broadcast-test"
+#define NR_SUBSCRIBERS 8
+#define BROADCAST_LEN (1024 * 1024)
+
+static void test_unix_broadcast(void **status)
+{
+    (void)status;
+
+    struct cio_listener *listener = cio_listener_bind(BROADCAST_ADDR);
+    assert_true(listener);
+
+    struct cio_stream *clients[NR_SUBSCRIBERS];
+    struct cio_stream *streams[NR_SUBSCRIBERS];
+    for (int i = 0; i < NR_SUBSCRIBERS; i++) {
+        clients[i] = cio_stream_connect(BROADCAST_ADDR);
+        assert_true(clients[i]);
+        assert_true(cio_stream_set_nonblock(clients[i], 1) == 0);
+        streams[i] = cio_listener_accept(listener);
+        assert_true(streams[i]);
+    }
+
+    uint8_t *payload = malloc(BROADCAST_LEN);
+    for (int i = 0; i < BROADCAST_LEN; i++)
+        payload[i] = i % 251;
+
+    // larger than socket buffers, so every stream queues the shared tail
+    struct cio *ctx = cio_new();
+    struct cio_buf *buf = cio_buf_new(payload, BROADCAST_LEN);
+    assert_true(cio_broadcast(ctx, streams, NR_SUBSCRIBERS, buf) == NR_SUBSCRIBERS);
+    cio_buf_unref(buf);
+
+    uint8_t *received = malloc(BROADCAST_LEN);
+    for (int i = 0; i < NR_SUBSCRIBERS; i++) {
+        size_t len = 0;
+        while (len < BROADCAST_LEN) {
+            int nr = cio_stream_recv(clients[i], received + len, BROADCAST_LEN - len);
+            if (nr > 0)
+                len += nr;
+            else
+                assert_true(cio_poll(ctx, 0) == 0);
+        }
+        assert_true(memcmp(received, payload, BROADCAST_LEN) == 0);
+    }
+    for (int i = 0; i < NR_SUBSCRIBERS; i++)
+        assert_true(cio_stream_flush(streams[i]) == 0);
+
+    for (int i = 0; i < NR_SUBSCRIBERS; i++) {
+        cio_stream_drop(streams[i]);
+        cio_stream_drop(clients[i]);
+    }
+    free(received);
+    free(payload);
+    cio_drop(ctx);
+    cio_listener_drop(listener);
+}
+
+#define RATE_ADDR "unix:///tmp/cio-unix-rate-test"
+#define RATE_BPS (200 * 1024)
+#define RATE_BURST (20 * 1024)
+#define RATE_LEN (100 * 1024)
+
+static uint64_t now_usec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 * 1000 + tv.tv_usec;
+}
+
+static void test_unix_rate(void **status)
+{
+    (void)status;
+
+    struct cio_listener *listener = cio_listener_bind(RATE_ADDR);
+    assert_true(listener);
+    struct cio_stream *client = cio_stream_connect(RATE_ADDR);
+    assert_true(client);
+    assert_true(cio_stream_set_nonblock(client, 1) == 0);
+    struct cio_stream *stream = cio_listener_accept(listener);
+    assert_true(stream);
+
+    struct cio *ctx = cio_new();
+    int fd = cio_stream_getfd(stream);
+    cio_register(ctx, fd, TOKEN_STREAM, CIOF_READABLE, stream);
+    assert_true(cio_stream_set_nonblock(stream, 1) == 0);
+    assert_true(cio_stream_set_rate(stream, ctx, RATE_BPS, 0, RATE_BURST) == 0);
+
+    char *payload = calloc(1, RATE_LEN);
+    char buf[4096];
+    size_t sent = 0, received = 0;
+    int nr_events = 0;
+    uint64_t start = now_usec();
+
+    while (received < RATE_LEN) {
+        if (sent < RATE_LEN) {
+            int nr = cio_stream_send(client, payload + sent, RATE_LEN - sent);
+            if (nr > 0)
+                sent += nr;
+        }
+
+        assert_true(cio_poll(ctx, 10 * 1000) == 0);
+        struct cio_event *ev;
+        while ((ev = cio_iter(ctx))) {
+            nr_events++;
+            for (;;) {
+                int nr = cio_stream_recv(stream, buf, sizeof(buf));
+                if (nr <= 0)
+                    break;
+                received += nr;
+            }
+        }
+    }
+
+    // throttled fds are out of polling, not spinning on readiness
+    uint64_t elapsed = now_usec() - start;
+    printf("[rate]: %d bytes in %d usec with %d events\n",
+           RATE_LEN, (int)elapsed, nr_events);
+    assert_true(elapsed >= (uint64_t)(RATE_LEN - RATE_BURST) * 1000 * 1000 / RATE_BPS * 9 / 10);
+    assert_true(nr_events < 500);
+    assert_true(cio_get_flags(ctx, fd) == CIOF_READABLE);
+
+    free(payload);
+    cio_unregister(ctx, fd);
+    cio_stream_drop(stream);
+    cio_stream_drop(client);
+    cio_drop(ctx);
+    cio_listener_drop(listener);
+}
+
+/**
+ * at 2^63 bytes per second, elapsed * rate wraps for any idle of 2us or more
+ */
+static void test_unix_rate_idle(void **status)
+{
+    (void)status;
+
+    struct cio_listener *listener = cio_listener_bind(RATE_ADDR);
+    assert_true(listener);
+    struct cio_stream *client = cio_stream_connect(RATE_ADDR);
+    assert_true(client);
+    struct cio_stream *stream = cio_listener_accept(listener);
+    assert_true(stream);
+    assert_true(cio_stream_set_nonblock(stream, 1) == 0);
+
+    struct cio *ctx = cio_new();
+    assert_true(cio_stream_set_rate(stream, ctx, 1ULL << 63, 0, 4096) == 0);
+
+    // each idle refills the bucket whatever the wrapped product would be
+    char buf[4096] = {0};
+    for (int i = 0; i < 32; i++) {
+        assert_true(cio_stream_send(client, buf, sizeof(buf)) == sizeof(buf));
+        usleep(1000 + i);
+        assert_true(cio_stream_recv(stream, buf, sizeof(buf)) == sizeof(buf));
+    }
+
+    cio_stream_drop(stream);
+    cio_stream_drop(client);
+    cio_drop(ctx);
+    cio_listener_drop(listener);
+}
+
+#define BUDGET_ADDR "unix:///tmp/cio-unix-budget-test"
+#define NR_BUDGET_STREAMS 4
+#define BUDGET_BYTES 4096
+#define BUDGET_LEN (64 * 1024)
+
+static void test_unix_budget(void **status)
+{
+    (void)status;
+
+    struct cio_listener *listener = cio_listener_bind(BUDGET_ADDR);
+    assert_true(listener);
+
+    struct cio *ctx = cio_new();
+    cio_set_budget(ctx, 1, BUDGET_BYTES);
+
+    struct cio_stream *clients[NR_BUDGET_STREAMS];
+    struct cio_stream *streams[NR_BUDGET_STREAMS];
+    char *payload = calloc(1, BUDGET_LEN);
+    for (int i = 0; i < NR_BUDGET_STREAMS; i++) {
+        clients[i] = cio_stream_connect(BUDGET_ADDR);
+        assert_true(clients[i]);
+        streams[i] = cio_listener_accept(listener);
+        assert_true(streams[i]);
+        assert_true(cio_stream_set_nonblock(streams[i], 1) == 0);
+        assert_true(cio_stream_bind(streams[i], ctx) == 0);
+        cio_register(ctx, cio_stream_getfd(streams[i]), i, CIOF_READABLE, streams[i]);
+        assert_true(cio_stream_send(clients[i], payload, BUDGET_LEN) == BUDGET_LEN);
+    }
+
+    // one event and BUDGET_BYTES per round, streams take turns
+    size_t received[NR_BUDGET_STREAMS] = {0};
+    size_t total = 0;
+    int last = -1;
+    char buf[1024];
+    while (total < NR_BUDGET_STREAMS * BUDGET_LEN) {
+        assert_true(cio_poll(ctx, 0) == 0);
+        int nr_events = 0;
+        struct cio_event *ev;
+        while ((ev = cio_iter(ctx))) {
+            nr_events++;
+            int id = cioe_get_token(ev);
+            assert_true(id != last);
+            last = id;
+
+            size_t round = 0;
+            for (;;) {
+                int nr = cio_stream_recv(streams[id], buf, sizeof(buf));
+                if (nr <= 0)
+                    break;
+                round += nr;
+            }
+            assert_true(round <= BUDGET_BYTES);
+            received[id] += round;
+            total += round;
+        }
+        assert_true(nr_events <= 1);
+    }
+
+    for (int i = 0; i < NR_BUDGET_STREAMS; i++) {
+        assert_true(received[i] == BUDGET_LEN);
+        cio_unregister(ctx, cio_stream_getfd(streams[i]));
+        cio_stream_drop(streams[i]);
+        cio_stream_drop(clients[i]);
+    }
+    free(payload);
+    cio_drop(ctx);
+    cio_listener_drop(listener);
+}
+
+#define BUFPOOL_ADDR "unix:///tmp/cio-unix-bufpool-test"
+#define NR_BUFPOOL_STREAMS 32
+#define BUFPOOL_BUF_SIZE (16 * 1024)
+
+static void test_unix_bufpool(void **status)
+{
+    (void)status;
+
+    struct cio_listener *listener = cio_listener_bind(BUFPOOL_ADDR);
+    assert_true(listener);
+
+    struct cio *ctx = cio_new();
+    struct cio_stream *clients[NR_BUFPOOL_STREAMS];
+    struct cio_stream *streams[NR_BUFPOOL_STREAMS];
+    for (int i = 0; i < NR_BUFPOOL_STREAMS; i++) {
+        clients[i] = cio_stream_connect(BUFPOOL_ADDR);
+        assert_true(clients[i]);
+        streams[i] = cio_listener_accept(listener);
+        assert_true(streams[i]);
+        assert_true(cio_stream_set_nonblock(streams[i], 1) == 0);
+        cio_register(ctx, cio_stream_getfd(streams[i]), i, CIOF_READABLE, streams[i]);
+    }
+
+    // a few streams are active at a time, the rest stay idle
+    struct cio_bufpool *pool = cio_bufpool_new(BUFPOOL_BUF_SIZE, 4);
+    for (int i = 0; i < NR_BUFPOOL_STREAMS; i += 4) {
+        char payload[32];
+        int len = snprintf(payload, sizeof(payload), "stream %d", i);
+        assert_true(cio_stream_send(clients[i], payload, len) == len);
+
+        int echoed = 0;
+        while (!echoed) {
+            assert_true(cio_poll(ctx, 1000) == 0);
+            struct cio_event *ev;
+            while ((ev = cio_iter(ctx))) {
+                struct cio_stream *stream = cioe_get_wrapper(ev);
+                struct cio_buf *buf;
+                int nr = cio_stream_recv_buf(stream, pool, &buf);
+                assert_true(nr == len);
+                assert_true(cio_buf_len(buf) == (size_t)len);
+                assert_true(memcmp(cio_buf_data(buf), payload, len) == 0);
+                assert_true(cio_stream_send(stream, cio_buf_data(buf), nr) == nr);
+                cio_buf_unref(buf);
+                echoed = 1;
+            }
+        }
+
+        char echo[32] = {0};
+        assert_true(cio_stream_recv(clients[i], echo, sizeof(echo)) == len);
+        assert_true(memcmp(echo, payload, len) == 0);
+    }
+    // one buf served all the streams
+    assert_true(cio_bufpool_get_pooled(pool) == 1);
+
+    // nothing to read, the buf goes back to the pool
+    struct cio_buf *buf;
+    assert_true(cio_stream_recv_buf(streams[0], pool, &buf) == -1);
+    assert_true(buf == NULL);
+    assert_true(cio_bufpool_get_pooled(pool) == 1);
+
+    // a buf held by the handler outlives the pool
+    assert_true(cio_stream_send(clients[1], "x", 1) == 1);
+    assert_true(cio_stream_recv_buf(streams[1], pool, &buf) == 1);
+    assert_true(cio_bufpool_get_pooled(pool) == 0);
+    cio_bufpool_drop(pool);
+    assert_true(*(const char *)cio_buf_data(buf) == 'x');
+    cio_buf_unref(buf);
+
+    for (int i = 0; i < NR_BUFPOOL_STREAMS; i++) {
+        cio_unregister(ctx, cio_stream_getfd(streams[i]));
+        cio_stream_drop(streams[i]);
+        cio_stream_drop(clients[i]);
+    }
+    cio_drop(ctx);
+    cio_listener_drop(listener);
+}
+
 int main(void)
 {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_unix_stream),
+        cmocka_unit_test(test_unix_cork),
+        cmocka_unit_test(test_unix_sendq),
+        cmocka_unit_test(test_unix_sendq_sendv),
+        cmocka_unit_test(test_unix_sendq_drop),
+        cmocka_unit_test(test_unix_ctx_drop),
+        cmocka_unit_test(test_unix_migrate),
+        cmocka_unit_test(test_unix_broadcast),
+        cmocka_unit_test(test_unix_rate),
+        cmocka_unit_test(test_unix_rate_idle),
+        cmocka_unit_test(test_unix_budget),
+        cmocka_unit_test(test_unix_bufpool),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }